@@ -7,20 +7,43 @@
 
 // BTstack features that can be enabled
 #define ENABLE_LE_PERIPHERAL
+#define ENABLE_LE_CENTRAL
 #define ENABLE_LOG_INFO
 #define ENABLE_LOG_ERROR
 #define ENABLE_PRINTF_HEXDUMP
 #define ENABLE_LE_SECURE_CONNECTIONS
+#define ENABLE_LE_DATA_LENGTH_EXTENSION
+// Let the GATT client pair or re-encrypt when a peripheral answers a write
+// with an authentication or encryption error, then repeat the write
+#define ENABLE_GATT_CLIENT_PAIRING
 
 // For the BLE-MIDI server
-#define BLE_MIDI_SERVER_MAX_CONNECTIONS 1
+#define BLE_MIDI_SERVER_MAX_CONNECTIONS 4
 #define BLE_MIDI_SERVER_FILTER_ACTIVE_SENSING_TO_BLE
+#define BLE_MIDI_SERVER_REQUEST_2M_PHY
+// Print each switch between the active and idle connection parameters
+//#define MIDI_SERVICE_STREAM_DEBUG_CONN_PARAMS
+
+// For the BLE-MIDI client
+#define BLE_MIDI_CLIENT_MAX_CONNECTIONS 2
+#ifdef MIDI_RELAY_BLE_CENTRAL
+// The server's notification bursts leave an ACL buffer to the client's links
+#define MIDI_SERVICE_STREAM_ACL_RESERVE 1
+#else
+// Only the server runs; keep the client's connections out of the block pool
+#define BLE_MIDI_POOL_CLIENT_OWNERS 0
+#endif
 
 // BTstack configuration. buffers, sizes, ...
 #define HCI_OUTGOING_PRE_BUFFER_SIZE 4
 #define HCI_ACL_PAYLOAD_SIZE (255 + 4)
 #define HCI_ACL_CHUNK_SIZE_ALIGNMENT 4
-#define MAX_NR_HCI_CONNECTIONS 1
+#ifdef MIDI_RELAY_BLE_CENTRAL
+// The server's centrals and the client's peripherals
+#define MAX_NR_HCI_CONNECTIONS (BLE_MIDI_SERVER_MAX_CONNECTIONS + BLE_MIDI_CLIENT_MAX_CONNECTIONS)
+#else
+#define MAX_NR_HCI_CONNECTIONS BLE_MIDI_SERVER_MAX_CONNECTIONS
+#endif
 #define MAX_NR_SM_LOOKUP_ENTRIES 3
 #define MAX_NR_WHITELIST_ENTRIES 16
 #define MAX_NR_LE_DEVICE_DB_ENTRIES 16
@@ -42,7 +65,8 @@
 
 // We don't give btstack a malloc, so use a fixed-size ATT DB.
 #define MAX_ATT_DB_SIZE 512
-#define MAX_NR_GATT_CLIENTS 0
+// One GATT client per connection so the server can start the ATT MTU exchange
+#define MAX_NR_GATT_CLIENTS MAX_NR_HCI_CONNECTIONS
 
 // BTstack HAL configuration
 #define HAVE_EMBEDDED_TIME_MS
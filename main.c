@@ -3,7 +3,7 @@
  *
  * @brief MIDI Relay Controller for Pico W
  *        Controls 4 relays (GPIO 16-19) based on MIDI messages
- *        Supports both USB MIDI and Bluetooth MIDI input
+ *        Supports USB MIDI, Bluetooth MIDI and 5-pin DIN MIDI input
  *
  * @author mitimidi-relay
  * @date 2025-08-07
@@ -26,14 +26,22 @@
 #include "pico/cyw43_arch.h"
 #include "pico/btstack_cyw43.h"
 #include "ble_midi_server.h"
+#include "ble_midi_client.h"
 #include "btstack.h"
 #include "midimiti.h"
 
+// 5-pin DIN MIDI on a hardware UART
+#include "midi_uart_lib.h"
+#include "midi_uart_pio_rx.h"
+#include "midi_stream_merge.h"
+#include "midi_sysex_assembler.h"
+
 // MIDI constants
 #define MIDI_NOTE_OFF    0x80
 #define MIDI_NOTE_ON     0x90
 #define MIDI_CC          0xB0
 #define MIDI_PROGRAM_CHANGE 0xC0
+#define MIDI_SYSTEM      0xF0
 
 // Relay GPIO pins (same as breadboard-os)
 #define RELAY_1_PIN      16
@@ -41,22 +49,181 @@
 #define RELAY_3_PIN      18
 #define RELAY_4_PIN      19
 
+// DIN MIDI port (UART0 is the console)
+#define DIN_MIDI_UART    1
+#define DIN_MIDI_TX_PIN  4
+#define DIN_MIDI_RX_PIN  5
+
+// Additional DIN MIDI inputs on PIO0 state machines (PIO1 drives the CYW43)
+#define DIN_MIDI_NUM_PIO_PORTS 4
+static const uint8_t din_midi_pio_rx_pins[DIN_MIDI_NUM_PIO_PORTS] = {6, 7, 8, 9};
+
+// Build with MIDI_RELAY_BLE_CENTRAL defined to also connect to BLE-MIDI
+// peripherals, e.g. a foot controller or the next MidiMiti box in a chain,
+// while phones and tablets still connect to the relay. The relay connects to
+// each peripheral in MIDI_RELAY_BLE_CENTRAL_PEERS it finds advertising, up to
+// BLE_MIDI_CLIENT_MAX_CONNECTIONS of them, and reconnects whenever a
+// connection is lost.
+//
+// MIDI_RELAY_BLE_CENTRAL_PEERS comes from the CMake cache variable of the same
+// name: a comma-separated list of Bluetooth addresses such as
+// "C0:11:22:33:44:55,public:00:1B:DC:01:02:03". Addresses are random static
+// addresses unless prefixed with "public:".
+#ifndef MIDI_RELAY_BLE_CENTRAL_PEERS
+#define MIDI_RELAY_BLE_CENTRAL_PEERS ""
+#endif
+
 // MIDI note mappings for relays
 #define RELAY_1_NOTE     60  // C4
 #define RELAY_2_NOTE     61  // C#4
 #define RELAY_3_NOTE     62  // D4  
 #define RELAY_4_NOTE     63  // D#4
 
+// MIDI inputs that feed process_midi_message()
+typedef enum {
+    MIDI_SOURCE_USB = 0,
+    MIDI_SOURCE_BT,
+    MIDI_SOURCE_DIN,
+    MIDI_SOURCE_BT_PERIPHERAL,  // a BLE-MIDI peripheral the relay connected to as a central
+    MIDI_NUM_SOURCES
+} midi_source_t;
+
+static const char* const midi_source_names[] = {"USB", "BT", "DIN", "BTP"};
+
+// MIDI outputs the router writes to
+typedef enum {
+    MIDI_DEST_RELAYS = 0,       // process_midi_message()
+    MIDI_DEST_USB,              // the USB-MIDI host, cable 0
+    MIDI_DEST_BT,               // every central connected to the BLE-MIDI server
+    MIDI_DEST_DIN,              // the DIN MIDI OUT
+    MIDI_DEST_BT_PERIPHERAL,    // every peripheral the BLE-MIDI client connected to
+    MIDI_NUM_DESTS
+} midi_dest_t;
+
+static const char* const midi_dest_names[] = {"relays", "USB", "BT", "DIN", "BTP"};
+
+// Message types for midi_route_t.types
+#define MIDI_TYPE_NOTE_OFF          (1u << 0)
+#define MIDI_TYPE_NOTE_ON           (1u << 1)
+#define MIDI_TYPE_POLY_PRESSURE     (1u << 2)
+#define MIDI_TYPE_CC                (1u << 3)
+#define MIDI_TYPE_PROGRAM_CHANGE    (1u << 4)
+#define MIDI_TYPE_CHANNEL_PRESSURE  (1u << 5)
+#define MIDI_TYPE_PITCH_BEND        (1u << 6)
+#define MIDI_TYPE_SYSTEM_COMMON     (1u << 7)
+#define MIDI_TYPE_REALTIME          (1u << 8)
+#define MIDI_TYPES_ALL              0x01FF
+
+// Which of a source's messages go to a destination. A route with no types is off.
+typedef struct {
+    uint16_t ports;     // bit n passes port n: the USB-MIDI cable number, DIN n + 1, BT n + 1 or BTP n + 1
+    uint16_t channels;  // bit n passes channel n + 1; system messages ignore it
+    uint16_t types;     // the MIDI_TYPE_ bits the route passes
+} midi_route_t;
+
+#define MIDI_ROUTE_ALL {0xFFFF, 0xFFFF, MIDI_TYPES_ALL}
+
+// The routing matrix. Do not route an input back to its own transport; the
+// other centrals or peripherals would send it back again, and DIN OUT may be
+// cabled to a DIN IN. SysEx is not routed; see sysex_consumer().
+static const midi_route_t midi_routes[MIDI_NUM_SOURCES][MIDI_NUM_DESTS] = {
+    [MIDI_SOURCE_USB] = {
+        [MIDI_DEST_RELAYS] = MIDI_ROUTE_ALL,
+        [MIDI_DEST_BT] = MIDI_ROUTE_ALL,
+        [MIDI_DEST_DIN] = MIDI_ROUTE_ALL,
+#ifdef MIDI_RELAY_BLE_CENTRAL
+        // the downstream MidiMiti boxes get what this box gets, so one USB
+        // cable or phone drives the whole chain
+        [MIDI_DEST_BT_PERIPHERAL] = MIDI_ROUTE_ALL,
+#endif
+    },
+    [MIDI_SOURCE_BT] = {
+        [MIDI_DEST_RELAYS] = MIDI_ROUTE_ALL,
+        [MIDI_DEST_USB] = MIDI_ROUTE_ALL,
+        [MIDI_DEST_DIN] = MIDI_ROUTE_ALL,
+#ifdef MIDI_RELAY_BLE_CENTRAL
+        [MIDI_DEST_BT_PERIPHERAL] = MIDI_ROUTE_ALL,
+#endif
+    },
+    [MIDI_SOURCE_DIN] = {
+        [MIDI_DEST_RELAYS] = MIDI_ROUTE_ALL,
+        [MIDI_DEST_USB] = MIDI_ROUTE_ALL,
+        [MIDI_DEST_BT] = MIDI_ROUTE_ALL,
+#ifdef MIDI_RELAY_BLE_CENTRAL
+        [MIDI_DEST_BT_PERIPHERAL] = MIDI_ROUTE_ALL,
+#endif
+    },
+    [MIDI_SOURCE_BT_PERIPHERAL] = {
+        [MIDI_DEST_RELAYS] = MIDI_ROUTE_ALL,
+        [MIDI_DEST_USB] = MIDI_ROUTE_ALL,
+        // a phone or tablet connected to the relay hears the foot controllers too
+        [MIDI_DEST_BT] = MIDI_ROUTE_ALL,
+        [MIDI_DEST_DIN] = MIDI_ROUTE_ALL,
+    },
+};
+
+// What a route did with its source's messages
+typedef struct {
+    uint32_t forwarded;     // the destination took the whole message
+    uint32_t filtered;      // the route's filter held the message back
+    uint32_t dropped;       // the destination had no room for the message
+    uint32_t disconnected;  // nothing was connected to the destination
+} midi_route_stats_t;
+
+// What an output did with a message
+typedef enum {
+    MIDI_DEST_WRITTEN,          // the output took the whole message
+    MIDI_DEST_FULL,             // the output had no room; none of the message was written
+    MIDI_DEST_DISCONNECTED,     // nothing is connected to the output
+} midi_dest_result_t;
+
+// How often the main loop prints the route counters if any changed, in ms
+#define MIDI_ROUTE_STATS_INTERVAL_MS 10000
+
+// Forwarded messages that arrive within this many us share a BLE-MIDI packet.
+// It is well under the client's 15 ms connection interval, so forwarding adds
+// less than one connection interval to the latency.
+#define MIDI_CHAIN_COALESCE_US 2000
+
+// SysEx for the relay uses the non-commercial manufacturer ID; other SysEx is ignored
+static const uint32_t relay_sysex_ids[] = {MIDI_SYSEX_ID_NON_COMMERCIAL};
+
+// A SysEx input
+typedef struct {
+    midi_sysex_assembler_t assembler;
+    midi_source_t source;
+    uint8_t port;
+    hci_con_handle_t con_handle;    // the BLE connection the input last served
+} sysex_input_t;
+
 // Global state
 static bool relay_states[4] = {false, false, false, false};
 static bool bluetooth_connected = false;
+static midi_uart_t* din_midi = NULL;
+static midi_stream_merge_t din_midi_merge;
+static sysex_input_t usb_sysex;
+static midi_route_stats_t midi_route_stats[MIDI_NUM_SOURCES][MIDI_NUM_DESTS];
+static bool midi_route_stats_changed = false;
+// One SysEx input for each BLE connection, so interleaved messages from different centrals stay separate
+static sysex_input_t ble_sysex[BLE_MIDI_SERVER_MAX_CONNECTIONS];
+// One SysEx input for each BLE-MIDI peripheral in central mode
+static sysex_input_t ble_peripheral_sysex[BLE_MIDI_CLIENT_MAX_CONNECTIONS];
 
 // Function prototypes
 static void init_relays(void);
 static void set_relay(int relay_num, bool state);
-static void process_midi_message(uint8_t status, uint8_t data1, uint8_t data2, bool from_bluetooth);
+static void process_midi_message(uint8_t status, uint8_t data1, uint8_t data2, midi_source_t source, uint8_t port);
 static void setup_bluetooth_midi(void);
+static void setup_din_midi(void);
+static void setup_sysex(void);
+static void poll_din_midi(void);
 static void bt_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+static void ble_midi_message_handler(hci_con_handle_t con_handle, const ble_midi_message_t* mes);
+static void ble_midi_sysex_handler(hci_con_handle_t con_handle, const uint8_t* sysex, uint16_t nbytes, bool complete);
+#ifdef MIDI_RELAY_BLE_CENTRAL
+static void ble_peripheral_message_handler(hci_con_handle_t con_handle, const ble_midi_message_t* mes);
+static void ble_peripheral_sysex_handler(hci_con_handle_t con_handle, const uint8_t* sysex, uint16_t nbytes, bool complete);
+#endif
 static void print_relay_states(void);
 
 // Initialize relay GPIO pins
@@ -99,10 +266,21 @@ static void set_relay(int relay_num, bool state)
     print_relay_states();
 }
 
+// Get the console label for a MIDI input; DIN inputs and BLE connections are numbered from 1
+static const char* midi_source_label(midi_source_t source, uint8_t port)
+{
+    static char label[8];
+    if (source == MIDI_SOURCE_DIN || source == MIDI_SOURCE_BT || source == MIDI_SOURCE_BT_PERIPHERAL) {
+        snprintf(label, sizeof(label), "%s%u", midi_source_names[source], port + 1);
+        return label;
+    }
+    return midi_source_names[source];
+}
+
 // Process MIDI message and control relays
-static void process_midi_message(uint8_t status, uint8_t data1, uint8_t data2, bool from_bluetooth)
+static void process_midi_message(uint8_t status, uint8_t data1, uint8_t data2, midi_source_t source_id, uint8_t port)
 {
-    const char *source = from_bluetooth ? "BT" : "USB";
+    const char *source = midi_source_label(source_id, port);
     uint8_t msg_type = status & 0xF0;
     uint8_t channel = status & 0x0F;
     
@@ -170,6 +348,12 @@ static void process_midi_message(uint8_t status, uint8_t data1, uint8_t data2, b
                 set_relay(4, false);
             }
             break;
+
+        case MIDI_SYSTEM:
+            // System real-time (clock, active sensing, ...) does not control relays
+            if (status >= 0xF8) break;
+            printf("[%s] System: 0x%02X 0x%02X 0x%02X\r\n", source, status, data1, data2);
+            break;
             
         default:
             printf("[%s] Unknown MIDI: 0x%02X 0x%02X 0x%02X\r\n", source, status, data1, data2);
@@ -177,6 +361,110 @@ static void process_midi_message(uint8_t status, uint8_t data1, uint8_t data2, b
     }
 }
 
+// Get the MIDI_TYPE_ bit for a status byte
+static uint16_t midi_type_bit(uint8_t status)
+{
+    if (status < MIDI_NOTE_OFF) {
+        return 0;   // not a status byte; no route passes it
+    }
+    if (status < MIDI_SYSTEM) {
+        return 1u << ((status >> 4) - 8);
+    }
+    return status >= 0xF8 ? MIDI_TYPE_REALTIME : MIDI_TYPE_SYSTEM_COMMON;
+}
+
+// Get the USB-MIDI Code Index Number for a message that is not SysEx
+static uint8_t usb_midi_cin(uint8_t status, uint8_t nbytes)
+{
+    if (status < MIDI_SYSTEM) {
+        return status >> 4;
+    }
+    switch (nbytes) {
+        case 2: return 0x2;     // two-byte system common message
+        case 3: return 0x3;     // three-byte system common message
+        default: return status >= 0xF8 ? 0xF : 0x5;
+    }
+}
+
+// Write a message to an output without staging it in a router buffer. Each
+// output is checked for room first, so a message is written whole or not at all.
+static midi_dest_result_t write_midi_dest(midi_dest_t dest, const uint8_t* msg_bytes, uint8_t nbytes, midi_source_t source, uint8_t port)
+{
+    switch (dest) {
+        case MIDI_DEST_RELAYS:
+            process_midi_message(msg_bytes[0], nbytes >= 2 ? msg_bytes[1] : 0, nbytes >= 3 ? msg_bytes[2] : 0, source, port);
+            return MIDI_DEST_WRITTEN;
+        case MIDI_DEST_USB: {
+            if (!tud_midi_mounted()) return MIDI_DEST_DISCONNECTED;
+            // one event packet is written whole or not at all
+            uint8_t packet[4] = {usb_midi_cin(msg_bytes[0], nbytes), msg_bytes[0], 0, 0};
+            memcpy(packet + 2, msg_bytes + 1, nbytes - 1);
+            return tud_midi_packet_write(packet) ? MIDI_DEST_WRITTEN : MIDI_DEST_FULL;
+        }
+        case MIDI_DEST_BT:
+            // the server queues the message for every central or for none
+            if (!ble_midi_server_is_connected()) return MIDI_DEST_DISCONNECTED;
+            return ble_midi_server_stream_write(nbytes, msg_bytes) == nbytes ? MIDI_DEST_WRITTEN : MIDI_DEST_FULL;
+        case MIDI_DEST_DIN:
+            // the main loop starts sending the queued bytes
+            if (din_midi == NULL) return MIDI_DEST_DISCONNECTED;
+            if (midi_uart_get_tx_free(din_midi) < nbytes) return MIDI_DEST_FULL;
+            midi_uart_write_tx_buffer(din_midi, msg_bytes, nbytes);
+            return MIDI_DEST_WRITTEN;
+#ifdef MIDI_RELAY_BLE_CENTRAL
+        case MIDI_DEST_BT_PERIPHERAL:
+            // the client queues the message for every peripheral or for none
+            if (!ble_midi_client_is_connected()) return MIDI_DEST_DISCONNECTED;
+            return ble_midi_client_stream_write(nbytes, msg_bytes) == nbytes ? MIDI_DEST_WRITTEN : MIDI_DEST_FULL;
+#endif
+        default:
+            return MIDI_DEST_DISCONNECTED;
+    }
+}
+
+// Send a MIDI message nbytes long from an input to each destination whose route passes it
+static void route_midi_message(const uint8_t* msg_bytes, uint8_t nbytes, midi_source_t source, uint8_t port)
+{
+    uint16_t type = midi_type_bit(msg_bytes[0]);
+    for (int dest = 0; dest < MIDI_NUM_DESTS; dest++) {
+        const midi_route_t* route = &midi_routes[source][dest];
+        if (route->types == 0) continue;
+        midi_route_stats_t* stats = &midi_route_stats[source][dest];
+        if ((route->types & type) == 0 || port >= 16 || (route->ports & (1u << port)) == 0 ||
+                (msg_bytes[0] < MIDI_SYSTEM && (route->channels & (1u << (msg_bytes[0] & 0x0F))) == 0)) {
+            ++stats->filtered;
+            continue;
+        }
+        switch (write_midi_dest((midi_dest_t)dest, msg_bytes, nbytes, source, port)) {
+            case MIDI_DEST_WRITTEN:
+                ++stats->forwarded;
+                break;
+            case MIDI_DEST_FULL:
+                ++stats->dropped;
+                break;
+            default:
+                ++stats->disconnected;
+                break;
+        }
+        midi_route_stats_changed = true;
+    }
+}
+
+// Print the counters of each route that has seen a message
+static void print_route_stats(void)
+{
+    printf("Routes:\r\n");
+    for (int source = 0; source < MIDI_NUM_SOURCES; source++) {
+        for (int dest = 0; dest < MIDI_NUM_DESTS; dest++) {
+            const midi_route_stats_t* stats = &midi_route_stats[source][dest];
+            if (stats->forwarded == 0 && stats->filtered == 0 && stats->dropped == 0 && stats->disconnected == 0) continue;
+            printf("  %s->%s: %lu forwarded, %lu filtered, %lu dropped, %lu not connected\r\n", midi_source_names[source],
+                midi_dest_names[dest], (unsigned long)stats->forwarded, (unsigned long)stats->filtered,
+                (unsigned long)stats->dropped, (unsigned long)stats->disconnected);
+        }
+    }
+}
+
 // Print current relay states
 static void print_relay_states(void)
 {
@@ -202,6 +490,44 @@ const uint8_t scan_resp_data[] = {
     0x09, BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME, 'M', 'i', 'd', 'i', 'M', 'i', 't', 'i'
 };
 
+#ifdef MIDI_RELAY_BLE_CENTRAL
+// Add each address in a MIDI_RELAY_BLE_CENTRAL_PEERS list to the client's white list.
+// Returns the number of addresses added.
+static unsigned add_ble_central_peers(const char* peers)
+{
+    static const char public_prefix[] = "public:";
+    unsigned npeers = 0;
+    while (*peers != '\0') {
+        size_t len = strcspn(peers, ",");
+        char entry[32];
+        if (len < sizeof(entry)) {
+            memcpy(entry, peers, len);
+            entry[len] = '\0';
+            bd_addr_type_t addr_type = BD_ADDR_TYPE_LE_RANDOM;
+            const char* addr_str = entry;
+            if (strncmp(entry, public_prefix, strlen(public_prefix)) == 0) {
+                addr_type = BD_ADDR_TYPE_LE_PUBLIC;
+                addr_str += strlen(public_prefix);
+            }
+            bd_addr_t addr;
+            if (!sscanf_bd_addr(addr_str, addr)) {
+                printf("Ignoring peripheral address \"%s\"\r\n", entry);
+            }
+            else if (!ble_midi_client_whitelist_add(addr_type, addr)) {
+                printf("Failed to add %s to the white list\r\n", bd_addr_to_str(addr));
+            }
+            else {
+                npeers++;
+            }
+        }
+        peers += len;
+        if (*peers == ',')
+            peers++;
+    }
+    return npeers;
+}
+#endif
+
 // Setup Bluetooth MIDI
 static void setup_bluetooth_midi(void)
 {
@@ -211,13 +537,220 @@ static void setup_bluetooth_midi(void)
     ble_midi_server_init(profile_data, scan_resp_data, sizeof(scan_resp_data),
         IO_CAPABILITY_NO_INPUT_NO_OUTPUT,
         SM_AUTHREQ_SECURE_CONNECTION | SM_AUTHREQ_BONDING);
+
+    // Decode received BLE-MIDI packets straight into the relay dispatcher
+    ble_midi_server_set_message_callback(ble_midi_message_handler);
+    ble_midi_server_set_sysex_callback(ble_midi_sysex_handler);
     
     printf("BLE MIDI server initialized as 'MidiMiti'\r\n");
     printf("Device should be discoverable in Bluetooth MIDI settings\r\n");
+    printf("Up to %d Bluetooth MIDI devices can connect at once\r\n", BLE_MIDI_SERVER_MAX_CONNECTIONS);
+
+#ifdef MIDI_RELAY_BLE_CENTRAL
+    // The client shares the server's Bluetooth stack, so the relay is a
+    // peripheral to phones and tablets and a central to foot controllers at once
+    printf("Setting up BLE MIDI central...\r\n");
+    ble_midi_client_init_dual_role();
+    ble_midi_client_set_coalesce_window(MIDI_CHAIN_COALESCE_US);
+    ble_midi_client_set_message_callback(ble_peripheral_message_handler);
+    ble_midi_client_set_sysex_callback(ble_peripheral_sysex_handler);
+    unsigned npeers = add_ble_central_peers(MIDI_RELAY_BLE_CENTRAL_PEERS);
+    if (npeers == 0) {
+        printf("No Bluetooth MIDI peripherals configured; set MIDI_RELAY_BLE_CENTRAL_PEERS\r\n");
+    }
+    else {
+        ble_midi_client_auto_connect_begin();
+        printf("Connecting to up to %u of %u Bluetooth MIDI peripherals\r\n",
+            (unsigned)MIN(npeers, BLE_MIDI_CLIENT_MAX_CONNECTIONS), npeers);
+    }
+#endif
     
     bluetooth_connected = false;
 }
 
+// Route a decoded BLE-MIDI message
+static void dispatch_ble_midi_message(const ble_midi_message_t* mes, midi_source_t source, uint8_t port)
+{
+    // SysEx fragments are not routed
+    if (mes->nbytes & ble_midi_packet_is_sysex) return;
+    uint8_t nbytes = mes->nbytes & ble_midi_packet_nbytes_mask;
+    if (nbytes == 0) return;
+    route_midi_message(mes->msg_bytes, nbytes, source, port);
+}
+
+#ifdef MIDI_RELAY_BLE_CENTRAL
+// BLE-MIDI client callbacks; like the server's, they run from cyw43_arch_poll()
+// in the main loop, so the peripherals' messages reach the relays with no
+// phone or tablet in between. Each peripheral is a separate input; messages
+// from all of them reach the relays in the order their packets arrive.
+static void ble_peripheral_message_handler(hci_con_handle_t con_handle, const ble_midi_message_t* mes)
+{
+    int port = ble_midi_client_get_connection_index(con_handle);
+    if (port < 0) return;
+    dispatch_ble_midi_message(mes, MIDI_SOURCE_BT_PERIPHERAL, port);
+}
+
+static void ble_peripheral_sysex_handler(hci_con_handle_t con_handle, const uint8_t* sysex, uint16_t nbytes, bool complete)
+{
+    (void)complete;
+    int port = ble_midi_client_get_connection_index(con_handle);
+    if (port < 0) return;
+    sysex_input_t* input = &ble_peripheral_sysex[port];
+    if (input->con_handle != con_handle) {
+        // a new connection took over the slot; drop what the last one left unfinished
+        midi_sysex_assembler_reset(&input->assembler);
+        input->con_handle = con_handle;
+    }
+    midi_sysex_assembler_push_run(&input->assembler, sysex, nbytes);
+}
+#endif
+
+// BLE-MIDI decoder callback; runs from cyw43_arch_poll() in the main loop
+// Each connected central is a separate BLE input; messages from all of them
+// reach the relays in the order their packets arrive.
+static void ble_midi_message_handler(hci_con_handle_t con_handle, const ble_midi_message_t* mes)
+{
+    int port = ble_midi_server_get_connection_index(con_handle);
+    if (port < 0) return;
+    dispatch_ble_midi_message(mes, MIDI_SOURCE_BT, port);
+}
+
+// BLE-MIDI SysEx callback; SysEx bypasses ble_midi_message_handler()
+static void ble_midi_sysex_handler(hci_con_handle_t con_handle, const uint8_t* sysex, uint16_t nbytes, bool complete)
+{
+    (void)complete;
+    int port = ble_midi_server_get_connection_index(con_handle);
+    if (port < 0) return;
+    sysex_input_t* input = &ble_sysex[port];
+    if (input->con_handle != con_handle) {
+        // a new central took over the connection slot; drop what the last one left unfinished
+        midi_sysex_assembler_reset(&input->assembler);
+        input->con_handle = con_handle;
+    }
+    midi_sysex_assembler_push_run(&input->assembler, sysex, nbytes);
+}
+
+// midi_sysex_consumer_cb_t for the USB and BLE inputs. The relays have no
+// SysEx commands yet, so the messages that pass the filter are discarded here.
+static void sysex_consumer(midi_sysex_assembler_t* assembler, const uint8_t* bytes, uint16_t nbytes, bool complete, void* cb_context)
+{
+    (void)assembler;
+    (void)bytes;
+    (void)nbytes;
+    (void)complete;
+    (void)cb_context;
+}
+
+// Setup the SysEx assemblers for the USB input and each BLE connection
+static void setup_sysex(void)
+{
+    usb_sysex.source = MIDI_SOURCE_USB;
+    usb_sysex.port = 0;
+    midi_sysex_assembler_init(&usb_sysex.assembler, sysex_consumer, &usb_sysex);
+    midi_sysex_assembler_set_filter(&usb_sysex.assembler, relay_sysex_ids, count_of(relay_sysex_ids));
+    for (int idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        sysex_input_t* input = &ble_sysex[idx];
+        input->source = MIDI_SOURCE_BT;
+        input->port = idx;
+        input->con_handle = HCI_CON_HANDLE_INVALID;
+        midi_sysex_assembler_init(&input->assembler, sysex_consumer, input);
+        midi_sysex_assembler_set_filter(&input->assembler, relay_sysex_ids, count_of(relay_sysex_ids));
+    }
+    for (int idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        sysex_input_t* input = &ble_peripheral_sysex[idx];
+        input->source = MIDI_SOURCE_BT_PERIPHERAL;
+        input->port = idx;
+        input->con_handle = HCI_CON_HANDLE_INVALID;
+        midi_sysex_assembler_init(&input->assembler, sysex_consumer, input);
+        midi_sysex_assembler_set_filter(&input->assembler, relay_sysex_ids, count_of(relay_sysex_ids));
+    }
+}
+
+// Get the number of SysEx bytes in a USB-MIDI event packet, or 0 if it does not carry SysEx
+static uint8_t usb_midi_sysex_nbytes(const uint8_t packet[4])
+{
+    switch (packet[0] & 0x0F) {   // Code Index Number
+        case 0x4:   // SysEx starts or continues
+        case 0x7:   // SysEx ends with three bytes
+            return 3;
+        case 0x6:   // SysEx ends with two bytes
+            return 2;
+        case 0x5:   // SysEx ends with one byte, or a one-byte system common message
+            return packet[1] == 0xF7 ? 1 : 0;
+        default:
+            return 0;
+    }
+}
+
+// Get the number of MIDI bytes in a USB-MIDI event packet that does not carry SysEx
+static uint8_t usb_midi_nbytes(const uint8_t packet[4])
+{
+    switch (packet[0] & 0x0F) {   // Code Index Number
+        case 0x5:   // one-byte system common message
+        case 0xF:   // single byte, e.g. system real-time
+            return 1;
+        case 0x2:   // two-byte system common message
+        case 0xC:   // program change
+        case 0xD:   // channel pressure
+            return 2;
+        case 0x3:   // three-byte system common message
+        case 0x8:   // note off
+        case 0x9:   // note on
+        case 0xA:   // poly key pressure
+        case 0xB:   // control change
+        case 0xE:   // pitch bend
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// midi_stream_merge_poll_t adapters for the DIN MIDI inputs
+static RING_BUFFER_SIZE_TYPE poll_din_midi_uart(void* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+{
+    return midi_uart_poll_rx_buffer((midi_uart_t*)instance, buffer, buflen);
+}
+
+static RING_BUFFER_SIZE_TYPE poll_din_midi_pio(void* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+{
+    return midi_uart_pio_rx_poll_rx_buffer((midi_uart_pio_rx_t*)instance, buffer, buflen);
+}
+
+// Setup the DIN MIDI ports; the UART is DIN1 and the PIO inputs are DIN2 and up
+static void setup_din_midi(void)
+{
+    midi_stream_merge_init(&din_midi_merge);
+    din_midi = midi_uart_configure(DIN_MIDI_UART, DIN_MIDI_TX_PIN, DIN_MIDI_RX_PIN);
+    if (din_midi == NULL) {
+        printf("Failed to configure DIN MIDI on UART%d\r\n", DIN_MIDI_UART);
+    } else {
+        int port = midi_stream_merge_add_port(&din_midi_merge, poll_din_midi_uart, din_midi);
+        printf("DIN%d MIDI on UART%d (TX GPIO%d, RX GPIO%d)\r\n", port + 1, DIN_MIDI_UART, DIN_MIDI_TX_PIN, DIN_MIDI_RX_PIN);
+    }
+    for (int idx = 0; idx < DIN_MIDI_NUM_PIO_PORTS; idx++) {
+        midi_uart_pio_rx_t* pio_rx = midi_uart_pio_rx_configure(pio0, din_midi_pio_rx_pins[idx]);
+        if (pio_rx == NULL) {
+            printf("Failed to configure DIN MIDI input on GPIO%d\r\n", din_midi_pio_rx_pins[idx]);
+            continue;
+        }
+        int port = midi_stream_merge_add_port(&din_midi_merge, poll_din_midi_pio, pio_rx);
+        printf("DIN%d MIDI input on PIO0 (RX GPIO%d)\r\n", port + 1, din_midi_pio_rx_pins[idx]);
+    }
+}
+
+// Dispatch the messages the DIN MIDI inputs have received since the last poll
+static void poll_din_midi(void)
+{
+    midi_stream_message_t mes;
+    uint8_t port;
+    while (midi_stream_merge_next(&din_midi_merge, &mes, &port)) {
+        route_midi_message(mes.msg_bytes, mes.nbytes, MIDI_SOURCE_DIN, port);
+    }
+    if (din_midi != NULL) {
+        midi_uart_drain_tx_buffer(din_midi);
+    }
+}
+
 // Bluetooth packet handler (simplified)
 static void bt_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
 {
@@ -317,7 +850,7 @@ int main(void)
     
     printf("\r\n=== MIDI Relay Controller ===\r\n");
     printf("Controls 4 relays via MIDI messages\r\n");
-    printf("USB & Bluetooth MIDI supported\r\n\r\n");
+    printf("USB, Bluetooth & DIN MIDI supported\r\n\r\n");
     
     // Initialize hardware
     init_relays();
@@ -331,8 +864,14 @@ int main(void)
     // Initialize TinyUSB
     tud_init(0);
     
+    // Initialize SysEx reassembly for USB and Bluetooth MIDI
+    setup_sysex();
+
     // Initialize Bluetooth MIDI
     setup_bluetooth_midi();
+
+    // Initialize DIN MIDI
+    setup_din_midi();
     
     printf("\r\nMIDI Mapping:\r\n");
     printf("Notes: C4(60)=Relay1, C#4(61)=Relay2, D4(62)=Relay3, D#4(63)=Relay4\r\n");
@@ -342,37 +881,57 @@ int main(void)
     print_relay_states();
     
     uint8_t packet[4];
+#ifdef MIDI_RELAY_DEBUG_LOOP_TIMING
+    // The longest main loop pass so far, e.g. while a Bluetooth central pairs;
+    // passes under 1 ms are not worth reporting
+    uint32_t max_loop_us = 1000;
+#endif
+    uint64_t route_stats_us = time_us_64();
     
     // Main loop
     while (1) {
+#ifdef MIDI_RELAY_DEBUG_LOOP_TIMING
+        uint32_t loop_start_us = time_us_32();
+#endif
+
         // Handle TinyUSB tasks
         tud_task();
         
         // Check for USB MIDI messages
         if (tud_midi_mounted()) {
             if (tud_midi_packet_read(packet)) {
-                // Process USB MIDI message
-                process_midi_message(packet[1], packet[2], packet[3], false);
-            }
-        }
-        
-        // Check for BLE MIDI messages
-        if (ble_midi_server_is_connected()) {
-            uint16_t timestamp;
-            uint8_t ble_packet[3];
-            uint8_t nread = ble_midi_server_stream_read(sizeof(ble_packet), ble_packet, &timestamp);
-            if (nread > 0) {
-                // Process BLE MIDI message
-                if (nread >= 1) {
-                    uint8_t data1 = nread >= 2 ? ble_packet[1] : 0;
-                    uint8_t data2 = nread >= 3 ? ble_packet[2] : 0;
-                    process_midi_message(ble_packet[0], data1, data2, true);
+                uint8_t sysex_nbytes = usb_midi_sysex_nbytes(packet);
+                if (sysex_nbytes > 0) {
+                    midi_sysex_assembler_push(&usb_sysex.assembler, packet + 1, sysex_nbytes);
+                } else if (usb_midi_nbytes(packet) > 0) {
+                    // Route USB MIDI message; the cable number is the port
+                    route_midi_message(packet + 1, usb_midi_nbytes(packet), MIDI_SOURCE_USB, packet[0] >> 4);
                 }
             }
         }
         
-        // Handle CYW43 WiFi/Bluetooth
+        // Check for DIN MIDI messages
+        poll_din_midi();
+        
+        // Handle CYW43 WiFi/Bluetooth; BLE MIDI messages are dispatched from here
         cyw43_arch_poll();
+
+#ifdef MIDI_RELAY_DEBUG_LOOP_TIMING
+        // Report each new longest pass; MIDI input waits that long to be handled
+        uint32_t loop_us = time_us_32() - loop_start_us;
+        if (loop_us > max_loop_us) {
+            max_loop_us = loop_us;
+            printf("Main loop stalled for %lu us\r\n", (unsigned long)max_loop_us);
+        }
+#endif
+
+        // Report the route counters now and then while MIDI is flowing
+        uint64_t now_us = time_us_64();
+        if (midi_route_stats_changed && now_us - route_stats_us >= MIDI_ROUTE_STATS_INTERVAL_MS * 1000ull) {
+            route_stats_us = now_us;
+            midi_route_stats_changed = false;
+            print_route_stats();
+        }
         
         // Small delay to prevent tight loop
         sleep_ms(1);
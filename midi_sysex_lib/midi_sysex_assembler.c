@@ -0,0 +1,238 @@
+/******************************************************************************
+ * @file midi_sysex_assembler.c
+ *
+ * @brief System exclusive message assembler shared by the MIDI transports
+ *
+ * All assemblers are fed from the main loop (the BLE callbacks run from
+ * cyw43_arch_poll()), so the pool needs no locking.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include <assert.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "midi_sysex_assembler.h"
+
+static_assert(MIDI_SYSEX_POOL_BLOCKS <= 32, "pool_in_use has one bit per block");
+
+enum {
+    MIDI_SYSEX_IDLE,            // waiting for 0xF0
+    MIDI_SYSEX_HEADER,          // collecting the manufacturer ID in header[]
+    MIDI_SYSEX_ASSEMBLING,      // copying the message to block
+    MIDI_SYSEX_DISCARDING,      // skipping the message until the next 0xF0
+};
+
+static uint8_t pool[MIDI_SYSEX_POOL_BLOCKS][MIDI_SYSEX_BLOCK_SIZE];
+static uint32_t pool_in_use;
+
+static uint8_t* midi_sysex_pool_alloc()
+{
+    for (uint8_t idx = 0; idx < MIDI_SYSEX_POOL_BLOCKS; idx++) {
+        if ((pool_in_use & (1u << idx)) == 0) {
+            pool_in_use |= (1u << idx);
+            return pool[idx];
+        }
+    }
+    return NULL;
+}
+
+static void midi_sysex_pool_free(uint8_t* block)
+{
+    pool_in_use &= ~(1u << ((block - pool[0]) / MIDI_SYSEX_BLOCK_SIZE));
+}
+
+uint16_t midi_sysex_data_run_length(const uint8_t* buf, uint16_t buflen)
+{
+    uint16_t run = 0;
+    while (run < buflen && ((uintptr_t)(buf + run) & 3) != 0) {
+        if ((buf[run] & 0x80) != 0)
+            return run;
+        run++;
+    }
+    while (run + 4 <= buflen) {
+        uint32_t word;
+        memcpy(&word, __builtin_assume_aligned(buf + run, 4), sizeof(word));
+        if ((word & 0x80808080u) != 0)
+            break;
+        run += 4;
+    }
+    while (run < buflen && (buf[run] & 0x80) == 0)
+        run++;
+    return run;
+}
+
+// Return the number of header bytes (0xF0 plus the manufacturer ID) once the
+// first ID byte is known
+static uint8_t midi_sysex_header_len(const midi_sysex_assembler_t* assembler)
+{
+    return assembler->header[1] == 0 ? 4 : 2;
+}
+
+static bool midi_sysex_filter_accepts(const midi_sysex_assembler_t* assembler)
+{
+    if (assembler->nfilter_ids == 0)
+        return true;
+    uint32_t id = MIDI_SYSEX_MANUFACTURER_ID(assembler->header[1]);
+    if (assembler->header[1] == 0)
+        id = MIDI_SYSEX_MANUFACTURER_ID_3(assembler->header[2], assembler->header[3]);
+    for (uint8_t idx = 0; idx < assembler->nfilter_ids; idx++) {
+        if (assembler->filter_ids[idx] == id)
+            return true;
+    }
+    return false;
+}
+
+// Copy bytes to the block and pass each full block to the consumer
+static void midi_sysex_append(midi_sysex_assembler_t* assembler, const uint8_t* bytes, uint16_t nbytes)
+{
+    while (nbytes > 0) {
+        uint16_t ncopy = MIN(nbytes, MIDI_SYSEX_BLOCK_SIZE - assembler->len);
+        memcpy(assembler->block + assembler->len, bytes, ncopy);
+        assembler->len += ncopy;
+        bytes += ncopy;
+        nbytes -= ncopy;
+        if (assembler->len == MIDI_SYSEX_BLOCK_SIZE) {
+            assembler->consumer_cb(assembler, assembler->block, assembler->len, false, assembler->cb_context);
+            assembler->len = 0;
+        }
+    }
+}
+
+void midi_sysex_assembler_reset(midi_sysex_assembler_t* assembler)
+{
+    if (assembler->block != NULL) {
+        midi_sysex_pool_free(assembler->block);
+        assembler->block = NULL;
+    }
+    assembler->state = MIDI_SYSEX_IDLE;
+    assembler->len = 0;
+    assembler->header_len = 0;
+}
+
+void midi_sysex_assembler_init(midi_sysex_assembler_t* assembler, midi_sysex_consumer_cb_t consumer_cb, void* cb_context)
+{
+    assembler->block = NULL;
+    midi_sysex_assembler_reset(assembler);
+    assembler->nfilter_ids = 0;
+    assembler->consumer_cb = consumer_cb;
+    assembler->cb_context = cb_context;
+    assembler->nfiltered = 0;
+    assembler->ndropped = 0;
+}
+
+bool midi_sysex_assembler_set_filter(midi_sysex_assembler_t* assembler, const uint32_t* ids, uint8_t nids)
+{
+    if (nids > MIDI_SYSEX_MAX_FILTER_IDS)
+        return false;
+    memcpy(assembler->filter_ids, ids, nids * sizeof(ids[0]));
+    assembler->nfilter_ids = nids;
+    return true;
+}
+
+// Handle a status byte other than a real-time status byte
+static void midi_sysex_status(midi_sysex_assembler_t* assembler, uint8_t status)
+{
+    if (status == 0xF0) {
+        if (assembler->state == MIDI_SYSEX_ASSEMBLING || assembler->state == MIDI_SYSEX_HEADER)
+            assembler->ndropped++;
+        midi_sysex_assembler_reset(assembler);
+        assembler->header[assembler->header_len++] = status;
+        assembler->state = MIDI_SYSEX_HEADER;
+        return;
+    }
+    if (status == 0xF7) {
+        if (assembler->state == MIDI_SYSEX_ASSEMBLING) {
+            // midi_sysex_append() never leaves the block full
+            assembler->block[assembler->len++] = status;
+            assembler->consumer_cb(assembler, assembler->block, assembler->len, true, assembler->cb_context);
+        }
+        else if (assembler->state == MIDI_SYSEX_HEADER) {
+            // a message too short to hold a manufacturer ID
+            if (assembler->nfilter_ids == 0) {
+                assembler->header[assembler->header_len++] = status;
+                assembler->consumer_cb(assembler, assembler->header, assembler->header_len, true, assembler->cb_context);
+            }
+            else {
+                assembler->nfiltered++;
+            }
+        }
+        midi_sysex_assembler_reset(assembler);
+        return;
+    }
+    // any other status byte ends the message without an 0xF7
+    if (assembler->state == MIDI_SYSEX_ASSEMBLING || assembler->state == MIDI_SYSEX_HEADER)
+        assembler->ndropped++;
+    midi_sysex_assembler_reset(assembler);
+}
+
+// Handle a run of data bytes
+static void midi_sysex_data(midi_sysex_assembler_t* assembler, const uint8_t* bytes, uint16_t nbytes)
+{
+    uint16_t idx = 0;
+    switch (assembler->state) {
+        case MIDI_SYSEX_HEADER:
+            while (idx < nbytes && assembler->header_len < 4) {
+                assembler->header[assembler->header_len++] = bytes[idx++];
+                if (assembler->header_len == midi_sysex_header_len(assembler)) {
+                    if (!midi_sysex_filter_accepts(assembler)) {
+                        assembler->nfiltered++;
+                        assembler->state = MIDI_SYSEX_DISCARDING;
+                    }
+                    else if ((assembler->block = midi_sysex_pool_alloc()) == NULL) {
+                        assembler->ndropped++;
+                        assembler->state = MIDI_SYSEX_DISCARDING;
+                    }
+                    else {
+                        assembler->state = MIDI_SYSEX_ASSEMBLING;
+                        midi_sysex_append(assembler, assembler->header, assembler->header_len);
+                    }
+                    break;
+                }
+            }
+            if (assembler->state == MIDI_SYSEX_ASSEMBLING) {
+                midi_sysex_append(assembler, bytes + idx, nbytes - idx);
+            }
+            break;
+        case MIDI_SYSEX_ASSEMBLING:
+            midi_sysex_append(assembler, bytes + idx, nbytes - idx);
+            break;
+        default:
+            // data outside a message or in a discarded message
+            break;
+    }
+}
+
+void midi_sysex_assembler_push(midi_sysex_assembler_t* assembler, const uint8_t* bytes, uint16_t nbytes)
+{
+    uint16_t idx = 0;
+    while (idx < nbytes) {
+        uint8_t byte = bytes[idx];
+        if (byte >= 0xF8) {
+            // real-time bytes may be interleaved with the message
+            idx++;
+            continue;
+        }
+        if (byte & 0x80) {
+            midi_sysex_status(assembler, byte);
+            idx++;
+            continue;
+        }
+        uint16_t run = midi_sysex_data_run_length(bytes + idx, nbytes - idx);
+        midi_sysex_data(assembler, bytes + idx, run);
+        idx += run;
+    }
+}
+
+void midi_sysex_assembler_push_run(midi_sysex_assembler_t* assembler, const uint8_t* bytes, uint16_t nbytes)
+{
+    if (nbytes > 0 && (bytes[0] & 0x80) != 0) {
+        midi_sysex_status(assembler, bytes[0]);
+        bytes++;
+        nbytes--;
+    }
+    if (nbytes > 0)
+        midi_sysex_data(assembler, bytes, nbytes);
+}
@@ -0,0 +1,146 @@
+/******************************************************************************
+ * @file midi_sysex_assembler.h
+ *
+ * @brief System exclusive message assembler shared by the MIDI transports
+ *
+ * Each transport feeds the raw system exclusive bytes it receives, 0xF0
+ * through 0xF7, to its own assembler. The assembler copies the bytes to a
+ * block taken from a pool shared by every assembler and passes the block to
+ * a consumer callback each time it fills and when the message is complete.
+ * A manufacturer ID filter is checked as soon as the ID bytes arrive, so
+ * messages for other devices never take a pool block.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of blocks in the pool; this many messages can be assembled at once
+#ifndef MIDI_SYSEX_POOL_BLOCKS
+#define MIDI_SYSEX_POOL_BLOCKS 2
+#endif
+
+// Number of bytes in each pool block; the consumer sees chunks up to this long
+#ifndef MIDI_SYSEX_BLOCK_SIZE
+#define MIDI_SYSEX_BLOCK_SIZE 256
+#endif
+
+// Maximum number of manufacturer IDs in a filter
+#define MIDI_SYSEX_MAX_FILTER_IDS 4
+
+// Encode a 1-byte manufacturer ID or a 3-byte manufacturer ID (0x00 id1 id2) for
+// midi_sysex_assembler_set_filter(). The encodings cannot collide because 1-byte
+// IDs are never 0.
+#define MIDI_SYSEX_MANUFACTURER_ID(id) ((uint32_t)(id) << 16)
+#define MIDI_SYSEX_MANUFACTURER_ID_3(id1, id2) (((uint32_t)(id1) << 8) | (id2))
+
+// The MIDI Association ID for non-commercial and educational use
+#define MIDI_SYSEX_ID_NON_COMMERCIAL MIDI_SYSEX_MANUFACTURER_ID(0x7D)
+
+typedef struct midi_sysex_assembler_s midi_sysex_assembler_t;
+
+/**
+ * @brief the function that consumes assembled system exclusive bytes
+ *
+ * @param assembler the assembler that assembled the bytes
+ * @param bytes the next chunk of the message. The first chunk starts with 0xF0.
+ * The bytes are only valid for the duration of the call.
+ * @param nbytes the number of bytes in the chunk (1 to MIDI_SYSEX_BLOCK_SIZE)
+ * @param complete true if the chunk ends with the 0xF7 that ends the message
+ * @param cb_context the cb_context pointer passed to midi_sysex_assembler_init()
+ */
+typedef void (*midi_sysex_consumer_cb_t)(midi_sysex_assembler_t* assembler, const uint8_t* bytes, uint16_t nbytes, bool complete, void* cb_context);
+
+struct midi_sysex_assembler_s {
+    uint8_t state;
+    uint8_t header[4];          // 0xF0 and the manufacturer ID until the filter is checked
+    uint8_t header_len;
+    uint8_t* block;             // the pool block for the message being assembled, or NULL
+    uint16_t len;               // number of bytes in block
+    uint8_t nfilter_ids;        // 0 accepts every manufacturer ID
+    uint32_t filter_ids[MIDI_SYSEX_MAX_FILTER_IDS];
+    midi_sysex_consumer_cb_t consumer_cb;
+    void* cb_context;
+    uint32_t nfiltered;         // messages dropped by the filter
+    uint32_t ndropped;          // messages dropped because no pool block was free or the message was cut short
+};
+
+/**
+ * @brief initialize an assembler
+ *
+ * @param assembler a pointer to the assembler
+ * @param consumer_cb the function that consumes assembled bytes
+ * @param cb_context a pointer passed to every call of consumer_cb
+ */
+void midi_sysex_assembler_init(midi_sysex_assembler_t* assembler, midi_sysex_consumer_cb_t consumer_cb, void* cb_context);
+
+/**
+ * @brief only assemble messages with one of the listed manufacturer IDs
+ *
+ * @param assembler a pointer to the assembler
+ * @param ids manufacturer IDs encoded with MIDI_SYSEX_MANUFACTURER_ID() or
+ * MIDI_SYSEX_MANUFACTURER_ID_3()
+ * @param nids the number of IDs (0 to MIDI_SYSEX_MAX_FILTER_IDS); 0 accepts every message
+ * @return true if nids is in range
+ */
+bool midi_sysex_assembler_set_filter(midi_sysex_assembler_t* assembler, const uint32_t* ids, uint8_t nids);
+
+/**
+ * @brief assemble the next bytes of a system exclusive byte stream
+ *
+ * A 0xF0 starts a new message and abandons any unterminated one. Data bytes
+ * outside a message are ignored. A status byte other than 0xF7 or a real-time
+ * byte ends the message early; its bytes so far are dropped.
+ *
+ * @param assembler a pointer to the assembler
+ * @param bytes the stream bytes
+ * @param nbytes the number of bytes
+ */
+void midi_sysex_assembler_push(midi_sysex_assembler_t* assembler, const uint8_t* bytes, uint16_t nbytes);
+
+/**
+ * @brief assemble a run the caller has already split from the stream
+ *
+ * Same as midi_sysex_assembler_push() for a run that is at most one status
+ * byte followed only by data bytes, as the BLE-MIDI decoder delivers them.
+ * The data bytes are not scanned again.
+ *
+ * @param assembler a pointer to the assembler
+ * @param bytes the run
+ * @param nbytes the number of bytes
+ */
+void midi_sysex_assembler_push_run(midi_sysex_assembler_t* assembler, const uint8_t* bytes, uint16_t nbytes);
+
+/**
+ * @brief get the number of data bytes (bytes with bit 7 clear) at the start of a buffer
+ *
+ * Once the pointer is word aligned, the bytes are tested 4 at a time. The
+ * RP2040 cannot load unaligned words, so the head of the run is tested a
+ * byte at a time.
+ *
+ * @param buf the bytes to scan
+ * @param buflen the number of bytes in buf
+ * @return the number of bytes before the first status byte, or buflen if there is none
+ */
+uint16_t midi_sysex_data_run_length(const uint8_t* buf, uint16_t buflen);
+
+/**
+ * @brief abandon the message being assembled, if any, and return its pool block
+ *
+ * Call this when the transport the assembler serves disconnects.
+ *
+ * @param assembler a pointer to the assembler
+ */
+void midi_sysex_assembler_reset(midi_sysex_assembler_t* assembler);
+
+#ifdef __cplusplus
+}
+#endif
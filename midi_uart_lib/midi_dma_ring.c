@@ -0,0 +1,74 @@
+/******************************************************************************
+ * @file midi_dma_ring.c
+ *
+ * @brief Lock-free receive ring filled by a DMA channel
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include <assert.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "midi_dma_ring.h"
+
+static_assert((MIDI_DMA_RING_SIZE & (MIDI_DMA_RING_SIZE - 1)) == 0,
+    "MIDI_DMA_RING_SIZE must be a power of 2");
+static_assert(MIDI_DMA_RING_SIZE <= 32768, "DMA ring size is limited to 32768 bytes");
+
+// Start (or restart) the DMA channel. The channel's write address wraps
+// inside buf forever, so the transfer count only runs out after 2^32 bytes;
+// midi_dma_ring_read() re-triggers it when that happens.
+static void midi_dma_ring_start(midi_dma_ring_t* ring)
+{
+    dma_channel_set_trans_count(ring->dma_chan, 0xFFFFFFFF, true);
+}
+
+static uint16_t midi_dma_ring_in_idx(midi_dma_ring_t* ring)
+{
+    uintptr_t write_addr = (uintptr_t)dma_channel_hw_addr(ring->dma_chan)->write_addr;
+    return (uint16_t)((write_addr - (uintptr_t)ring->buf) & (MIDI_DMA_RING_SIZE - 1));
+}
+
+bool midi_dma_ring_init(midi_dma_ring_t* ring, uint8_t* buf, const volatile void* read_addr, uint dreq)
+{
+    assert(((uintptr_t)buf & (MIDI_DMA_RING_SIZE - 1)) == 0);
+    ring->dma_chan = dma_claim_unused_channel(false);
+    if (ring->dma_chan < 0)
+        return false;
+    ring->buf = buf;
+    ring->out_idx = 0;
+
+    dma_channel_config config = dma_channel_get_default_config(ring->dma_chan);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_ring(&config, true, __builtin_ctz(MIDI_DMA_RING_SIZE));
+    channel_config_set_dreq(&config, dreq);
+    dma_channel_configure(ring->dma_chan, &config, ring->buf, read_addr, 0, false);
+    midi_dma_ring_start(ring);
+    return true;
+}
+
+RING_BUFFER_SIZE_TYPE midi_dma_ring_read(midi_dma_ring_t* ring, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+{
+    uint16_t in_idx = midi_dma_ring_in_idx(ring);
+    RING_BUFFER_SIZE_TYPE nread = 0;
+    // at most two contiguous spans: up to the end of the ring, then from the start
+    while (ring->out_idx != in_idx && nread < buflen) {
+        uint16_t span = (in_idx > ring->out_idx) ? (in_idx - ring->out_idx) :
+            (MIDI_DMA_RING_SIZE - ring->out_idx);
+        if (span > buflen - nread)
+            span = buflen - nread;
+        memcpy(buffer + nread, ring->buf + ring->out_idx, span);
+        nread += span;
+        ring->out_idx = (ring->out_idx + span) & (MIDI_DMA_RING_SIZE - 1);
+    }
+    if (!dma_channel_is_busy(ring->dma_chan)) {
+        // the peripheral's receive FIFO holds incoming bytes until the channel is re-triggered
+        midi_dma_ring_start(ring);
+    }
+    return nread;
+}
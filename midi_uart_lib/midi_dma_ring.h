@@ -0,0 +1,64 @@
+/******************************************************************************
+ * @file midi_dma_ring.h
+ *
+ * @brief Lock-free receive ring filled by a DMA channel
+ *
+ * A DMA channel paced by a peripheral DREQ copies received bytes into an
+ * address-aligned ring buffer; the DMA write address is the ring's input
+ * index. The DMA channel is the only producer and the application is the
+ * only consumer, so no critical section or interrupt is needed.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "ring_buffer_lib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of bytes in a DMA receive ring. Must be a power of 2 no larger
+// than 32768. At 31250 baud the ring holds this many bytes ~= 0.32 ms each,
+// so the application must poll at least once every (SIZE * 0.32) ms.
+#ifndef MIDI_DMA_RING_SIZE
+#define MIDI_DMA_RING_SIZE 256
+#endif
+
+// Use this to declare the storage for a ring
+#define MIDI_DMA_RING_STORAGE_ATTR __attribute__((aligned(MIDI_DMA_RING_SIZE)))
+
+typedef struct midi_dma_ring_s {
+    uint8_t* buf;       // MIDI_DMA_RING_SIZE bytes aligned to MIDI_DMA_RING_SIZE
+    uint16_t out_idx;   // index of the next byte in buf the application has not read
+    int dma_chan;
+} midi_dma_ring_t;
+
+/**
+ * @brief claim a DMA channel and start it copying bytes from a peripheral
+ *
+ * @param ring a pointer to the ring structure
+ * @param buf storage declared with MIDI_DMA_RING_STORAGE_ATTR
+ * @param read_addr the address of the peripheral's 8-bit receive data
+ * @param dreq the peripheral's receive DREQ
+ * @return true if a DMA channel was available
+ */
+bool midi_dma_ring_init(midi_dma_ring_t* ring, uint8_t* buf, const volatile void* read_addr, uint dreq);
+
+/**
+ * @brief copy the bytes received since the last call to a buffer
+ *
+ * @param ring a pointer to the ring structure
+ * @param buffer a pointer to storage for the received bytes
+ * @param buflen the maximum number of bytes to copy
+ * @return the number of bytes copied (may be 0)
+ */
+RING_BUFFER_SIZE_TYPE midi_dma_ring_read(midi_dma_ring_t* ring, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen);
+
+#ifdef __cplusplus
+}
+#endif
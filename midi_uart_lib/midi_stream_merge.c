@@ -0,0 +1,61 @@
+/******************************************************************************
+ * @file midi_stream_merge.c
+ *
+ * @brief Fair merge of several serial MIDI byte streams
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include <stddef.h>
+#include "midi_stream_merge.h"
+
+void midi_stream_merge_init(midi_stream_merge_t* merge)
+{
+    merge->nports = 0;
+    merge->next_port = 0;
+}
+
+int midi_stream_merge_add_port(midi_stream_merge_t* merge, midi_stream_merge_poll_t poll, void* instance)
+{
+    if (merge->nports >= MIDI_STREAM_MERGE_MAX_PORTS || poll == NULL)
+        return -1;
+    midi_stream_merge_port_t* merge_port = merge->ports + merge->nports;
+    merge_port->poll = poll;
+    merge_port->instance = instance;
+    merge_port->nstaged = 0;
+    merge_port->stage_idx = 0;
+    midi_stream_parser_init(&merge_port->parser);
+    return merge->nports++;
+}
+
+// Parse bytes from one port until a message is complete or the input is empty
+static bool midi_stream_merge_port_next(midi_stream_merge_port_t* merge_port, midi_stream_message_t* mes)
+{
+    for (;;) {
+        if (merge_port->stage_idx >= merge_port->nstaged) {
+            merge_port->stage_idx = 0;
+            merge_port->nstaged = merge_port->poll(merge_port->instance, merge_port->stage, sizeof(merge_port->stage));
+            if (merge_port->nstaged == 0)
+                return false;
+        }
+        while (merge_port->stage_idx < merge_port->nstaged) {
+            if (midi_stream_parser_push(&merge_port->parser, merge_port->stage[merge_port->stage_idx++], mes))
+                return true;
+        }
+    }
+}
+
+bool midi_stream_merge_next(midi_stream_merge_t* merge, midi_stream_message_t* mes, uint8_t* port)
+{
+    for (uint8_t count = 0; count < merge->nports; count++) {
+        uint8_t idx = merge->next_port;
+        merge->next_port = (idx + 1) % merge->nports;
+        if (midi_stream_merge_port_next(merge->ports + idx, mes)) {
+            *port = idx;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,88 @@
+/******************************************************************************
+ * @file midi_stream_merge.h
+ *
+ * @brief Fair merge of several serial MIDI byte streams
+ *
+ * Each port has its own midi_stream_parser_t, so messages are reassembled
+ * per port and keep their per-port order. midi_stream_merge_next() serves
+ * the ports round-robin, one complete message per port per turn, so a busy
+ * port cannot starve the others.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "ring_buffer_lib.h"
+#include "midi_stream_parser.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MIDI_STREAM_MERGE_MAX_PORTS
+#define MIDI_STREAM_MERGE_MAX_PORTS 6
+#endif
+
+// The number of bytes a port reads from its input at a time
+#define MIDI_STREAM_MERGE_STAGE_SIZE 16
+
+/**
+ * @brief the function a port calls to read bytes from its input
+ *
+ * @param instance the instance pointer passed to midi_stream_merge_add_port()
+ * @param buffer a pointer to storage for the bytes read
+ * @param buflen the maximum number of bytes to read
+ * @return the number of bytes read (may be 0)
+ */
+typedef RING_BUFFER_SIZE_TYPE (*midi_stream_merge_poll_t)(void* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen);
+
+typedef struct midi_stream_merge_port_s {
+    midi_stream_merge_poll_t poll;
+    void* instance;
+    midi_stream_parser_t parser;
+    uint8_t stage[MIDI_STREAM_MERGE_STAGE_SIZE];   // bytes read from the input but not yet parsed
+    uint8_t nstaged;
+    uint8_t stage_idx;
+} midi_stream_merge_port_t;
+
+typedef struct midi_stream_merge_s {
+    midi_stream_merge_port_t ports[MIDI_STREAM_MERGE_MAX_PORTS];
+    uint8_t nports;
+    uint8_t next_port;      // the port served first on the next call to midi_stream_merge_next()
+} midi_stream_merge_t;
+
+/**
+ * @brief initialize a merge with no ports
+ *
+ * @param merge a pointer to the merge state
+ */
+void midi_stream_merge_init(midi_stream_merge_t* merge);
+
+/**
+ * @brief add an input to the merge
+ *
+ * @param merge a pointer to the merge state
+ * @param poll the function that reads bytes from the input
+ * @param instance the input's driver context; passed to poll
+ * @return the port number used to tag messages from this input, or -1
+ * if MIDI_STREAM_MERGE_MAX_PORTS ports are already in use
+ */
+int midi_stream_merge_add_port(midi_stream_merge_t* merge, midi_stream_merge_poll_t poll, void* instance);
+
+/**
+ * @brief get the next complete message from the merged inputs
+ *
+ * @param merge a pointer to the merge state
+ * @param mes a pointer to storage for the message
+ * @param port a pointer to storage for the port number the message came from
+ * @return true if a message was stored in mes, false if no port has a complete message
+ */
+bool midi_stream_merge_next(midi_stream_merge_t* merge, midi_stream_message_t* mes, uint8_t* port);
+
+#ifdef __cplusplus
+}
+#endif
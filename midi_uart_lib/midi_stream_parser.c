@@ -0,0 +1,86 @@
+/******************************************************************************
+ * @file midi_stream_parser.c
+ *
+ * @brief Byte-at-a-time MIDI 1.0 stream parser for serial MIDI inputs
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include "midi_stream_parser.h"
+
+// Return the total length of the message that starts with status byte, or 0
+// if the status byte does not start a message with a fixed length
+static uint8_t midi_stream_parser_msg_len(uint8_t status)
+{
+    switch (status & 0xF0) {
+        case 0xC0:
+        case 0xD0:
+            return 2;
+        case 0xF0:
+            break;
+        default:
+            return 3;
+    }
+    switch (status) {
+        case 0xF1:
+        case 0xF3:
+            return 2;
+        case 0xF2:
+            return 3;
+        case 0xF6:
+            return 1;
+        default:
+            return 0; // 0xF0, 0xF7 and the undefined 0xF4 and 0xF5
+    }
+}
+
+void midi_stream_parser_init(midi_stream_parser_t* parser)
+{
+    parser->running_status = 0;
+    parser->msg_len = 0;
+    parser->ndata = 0;
+    parser->in_sysex = false;
+}
+
+bool midi_stream_parser_push(midi_stream_parser_t* parser, uint8_t byte, midi_stream_message_t* mes)
+{
+    if (byte >= 0xF8) {
+        // real-time messages may appear anywhere and do not affect running status
+        mes->nbytes = 1;
+        mes->msg_bytes[0] = byte;
+        return true;
+    }
+    if (byte & 0x80) {
+        parser->in_sysex = (byte == 0xF0);
+        parser->ndata = 0;
+        parser->msg_len = midi_stream_parser_msg_len(byte);
+        // only channel messages establish running status
+        parser->running_status = (byte < 0xF0 || parser->msg_len > 1) ? byte : 0;
+        if (parser->msg_len == 1) {
+            mes->nbytes = 1;
+            mes->msg_bytes[0] = byte;
+            return true;
+        }
+        return false;
+    }
+    // data byte
+    if (parser->in_sysex || parser->running_status == 0) {
+        return false;
+    }
+    parser->data[parser->ndata++] = byte;
+    if (parser->ndata + 1 < parser->msg_len) {
+        return false;
+    }
+    mes->nbytes = parser->msg_len;
+    mes->msg_bytes[0] = parser->running_status;
+    mes->msg_bytes[1] = parser->data[0];
+    mes->msg_bytes[2] = parser->ndata > 1 ? parser->data[1] : 0;
+    parser->ndata = 0;
+    if (parser->running_status >= 0xF0) {
+        // system common messages cancel running status
+        parser->running_status = 0;
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+/******************************************************************************
+ * @file midi_stream_parser.h
+ *
+ * @brief Byte-at-a-time MIDI 1.0 stream parser for serial MIDI inputs
+ *
+ * Reassembles complete channel and system common messages from a raw MIDI
+ * 1.0 byte stream. Running status is expanded, and system real-time bytes
+ * are returned immediately even if they arrive in the middle of another
+ * message. System exclusive bytes are consumed without being returned.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A complete MIDI 1.0 message without running status
+typedef struct midi_stream_message_s {
+    uint8_t nbytes;         //!< the number of valid bytes in msg_bytes (1-3)
+    uint8_t msg_bytes[3];
+} midi_stream_message_t;
+
+typedef struct midi_stream_parser_s {
+    uint8_t running_status;     // status byte of the message being assembled; 0 if none
+    uint8_t msg_len;            // total length of the message being assembled
+    uint8_t ndata;              // number of data bytes received for the message being assembled
+    uint8_t data[2];
+    bool in_sysex;
+} midi_stream_parser_t;
+
+/**
+ * @brief reset the parser to the state it has before any bytes are received
+ *
+ * @param parser a pointer to the parser state
+ */
+void midi_stream_parser_init(midi_stream_parser_t* parser);
+
+/**
+ * @brief parse the next byte of a MIDI 1.0 byte stream
+ *
+ * @param parser a pointer to the parser state
+ * @param byte the next byte from the stream
+ * @param mes a pointer to storage for the completed message
+ * @return true if byte completed a message and mes holds it
+ */
+bool midi_stream_parser_push(midi_stream_parser_t* parser, uint8_t byte, midi_stream_message_t* mes);
+
+#ifdef __cplusplus
+}
+#endif
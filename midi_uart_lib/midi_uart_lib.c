@@ -0,0 +1,95 @@
+/******************************************************************************
+ * @file midi_uart_lib.c
+ *
+ * @brief 5-pin DIN MIDI driver for the RP2040 hardware UARTs
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/uart.h"
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+#include "midi_uart_lib.h"
+
+#define MIDI_UART_NUM_UARTS 2
+// The number of bytes handed to the transmit DMA channel at a time
+#define MIDI_UART_TX_DMA_CHUNK 32
+
+struct midi_uart_s {
+    uart_inst_t* uart;
+    midi_dma_ring_t rx_ring;
+    int tx_dma_chan;
+    ring_buffer_t tx_rb;
+    uint8_t tx_rb_storage[MIDI_UART_TX_BUFFER_SIZE];
+    uint8_t tx_dma_buf[MIDI_UART_TX_DMA_CHUNK]; // bytes being sent by tx_dma_chan
+};
+
+static midi_uart_t midi_uarts[MIDI_UART_NUM_UARTS];
+
+static uint8_t midi_uart_rx_storage[MIDI_UART_NUM_UARTS][MIDI_DMA_RING_SIZE] MIDI_DMA_RING_STORAGE_ATTR;
+
+midi_uart_t* midi_uart_configure(uint8_t uartnum, uint8_t txgpio, uint8_t rxgpio)
+{
+    if (uartnum >= MIDI_UART_NUM_UARTS)
+        return NULL;
+    midi_uart_t* instance = midi_uarts + uartnum;
+    instance->tx_dma_chan = dma_claim_unused_channel(false);
+    if (instance->tx_dma_chan < 0)
+        return NULL;
+    instance->uart = uart_get_instance(uartnum);
+    ring_buffer_init(&instance->tx_rb, instance->tx_rb_storage, sizeof(instance->tx_rb_storage), 0);
+
+    uart_init(instance->uart, MIDI_UART_BAUD_RATE);
+    uart_set_format(instance->uart, 8, 1, UART_PARITY_NONE);
+    uart_set_hw_flow(instance->uart, false, false);
+    uart_set_fifo_enabled(instance->uart, true);
+    gpio_set_function(txgpio, GPIO_FUNC_UART);
+    gpio_set_function(rxgpio, GPIO_FUNC_UART);
+    // the opto-isolator output is open collector
+    gpio_pull_up(rxgpio);
+
+    if (!midi_dma_ring_init(&instance->rx_ring, midi_uart_rx_storage[uartnum], &uart_get_hw(instance->uart)->dr,
+        uart_get_dreq(instance->uart, false))) {
+        uart_deinit(instance->uart);
+        gpio_set_function(txgpio, GPIO_FUNC_NULL);
+        gpio_set_function(rxgpio, GPIO_FUNC_NULL);
+        gpio_disable_pulls(rxgpio);
+        dma_channel_unclaim(instance->tx_dma_chan);
+        return NULL;
+    }
+
+    dma_channel_config config = dma_channel_get_default_config(instance->tx_dma_chan);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, uart_get_dreq(instance->uart, true));
+    dma_channel_configure(instance->tx_dma_chan, &config, &uart_get_hw(instance->uart)->dr, instance->tx_dma_buf, 0, false);
+    return instance;
+}
+
+RING_BUFFER_SIZE_TYPE midi_uart_poll_rx_buffer(midi_uart_t* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+{
+    return midi_dma_ring_read(&instance->rx_ring, buffer, buflen);
+}
+
+RING_BUFFER_SIZE_TYPE midi_uart_write_tx_buffer(midi_uart_t* instance, const uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+{
+    return ring_buffer_push(&instance->tx_rb, buffer, buflen);
+}
+
+RING_BUFFER_SIZE_TYPE midi_uart_get_tx_free(midi_uart_t* instance)
+{
+    return sizeof(instance->tx_rb_storage) - ring_buffer_get_num_bytes(&instance->tx_rb);
+}
+
+void midi_uart_drain_tx_buffer(midi_uart_t* instance)
+{
+    if (dma_channel_is_busy(instance->tx_dma_chan) || ring_buffer_is_empty(&instance->tx_rb))
+        return;
+    RING_BUFFER_SIZE_TYPE npopped = ring_buffer_pop(&instance->tx_rb, instance->tx_dma_buf, sizeof(instance->tx_dma_buf));
+    dma_channel_transfer_from_buffer_now(instance->tx_dma_chan, instance->tx_dma_buf, npopped);
+}
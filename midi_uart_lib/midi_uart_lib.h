@@ -0,0 +1,92 @@
+/******************************************************************************
+ * @file midi_uart_lib.h
+ *
+ * @brief 5-pin DIN MIDI driver for the RP2040 hardware UARTs
+ *
+ * The UART receiver is drained by a DMA channel into a midi_dma_ring_t, so
+ * received bytes never cost an interrupt. The application polls the ring
+ * from its main loop. Transmitted bytes are queued in a ring_buffer_t and
+ * sent to the UART by a second DMA channel.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+#include <stdint.h>
+#include "ring_buffer_lib.h"
+#include "midi_dma_ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// MIDI 1.0 serial data rate
+#define MIDI_UART_BAUD_RATE 31250
+
+// Number of bytes in the transmit ring buffer
+#ifndef MIDI_UART_TX_BUFFER_SIZE
+#define MIDI_UART_TX_BUFFER_SIZE 128
+#endif
+
+// The driver context for one UART. The definition is opaque to other applications
+typedef struct midi_uart_s midi_uart_t;
+
+/**
+ * @brief configure a hardware UART for MIDI and start the receive DMA
+ *
+ * @param uartnum the UART number (0 or 1)
+ * @param txgpio the GPIO number for the UART TX pin
+ * @param rxgpio the GPIO number for the UART RX pin
+ * @return a pointer to the driver context or NULL if the UART number is
+ * out of range or no DMA channels are available
+ */
+midi_uart_t* midi_uart_configure(uint8_t uartnum, uint8_t txgpio, uint8_t rxgpio);
+
+/**
+ * @brief copy the bytes received since the last call to a buffer
+ *
+ * @param instance the driver context returned by midi_uart_configure()
+ * @param buffer a pointer to storage for the received bytes
+ * @param buflen the maximum number of bytes to copy
+ * @return the number of bytes copied (may be 0)
+ */
+RING_BUFFER_SIZE_TYPE midi_uart_poll_rx_buffer(midi_uart_t* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen);
+
+/**
+ * @brief queue MIDI bytes for transmission
+ *
+ * Call midi_uart_drain_tx_buffer() to start sending the queued bytes.
+ *
+ * @param instance the driver context returned by midi_uart_configure()
+ * @param buffer the bytes to send
+ * @param buflen the number of bytes to send
+ * @return the number of bytes queued
+ */
+RING_BUFFER_SIZE_TYPE midi_uart_write_tx_buffer(midi_uart_t* instance, const uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen);
+
+/**
+ * @brief get the number of bytes midi_uart_write_tx_buffer() can queue now
+ *
+ * Check this before writing a message so the message is queued whole or
+ * not at all; a partial message would corrupt the stream.
+ *
+ * @param instance the driver context returned by midi_uart_configure()
+ * @return the number of free bytes in the transmit buffer
+ */
+RING_BUFFER_SIZE_TYPE midi_uart_get_tx_free(midi_uart_t* instance);
+
+/**
+ * @brief start a DMA transfer of the queued transmit bytes if the previous
+ * transfer is complete
+ *
+ * Call this function from the main loop.
+ *
+ * @param instance the driver context returned by midi_uart_configure()
+ */
+void midi_uart_drain_tx_buffer(midi_uart_t* instance);
+
+#ifdef __cplusplus
+}
+#endif
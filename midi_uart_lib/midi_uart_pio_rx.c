@@ -0,0 +1,64 @@
+/******************************************************************************
+ * @file midi_uart_pio_rx.c
+ *
+ * @brief 5-pin DIN MIDI inputs implemented with PIO state machines
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "midi_uart_pio_rx.h"
+#include "midi_uart_pio_rx.pio.h"
+#include "midi_uart_lib.h" // for MIDI_UART_BAUD_RATE
+#include "midi_dma_ring.h"
+
+struct midi_uart_pio_rx_s {
+    PIO pio;
+    uint sm;
+    midi_dma_ring_t rx_ring;
+};
+
+static midi_uart_pio_rx_t midi_uart_pio_rx_ports[MIDI_UART_PIO_RX_MAX_PORTS];
+static uint8_t midi_uart_pio_rx_nports = 0;
+static uint8_t midi_uart_pio_rx_storage[MIDI_UART_PIO_RX_MAX_PORTS][MIDI_DMA_RING_SIZE] MIDI_DMA_RING_STORAGE_ATTR;
+
+// instruction memory offset of the receiver program in each PIO
+static bool midi_uart_pio_rx_program_loaded[NUM_PIOS];
+static uint midi_uart_pio_rx_program_offset[NUM_PIOS];
+
+midi_uart_pio_rx_t* midi_uart_pio_rx_configure(PIO pio, uint8_t rxgpio)
+{
+    if (midi_uart_pio_rx_nports >= MIDI_UART_PIO_RX_MAX_PORTS)
+        return NULL;
+    uint pio_idx = pio_get_index(pio);
+    if (!midi_uart_pio_rx_program_loaded[pio_idx]) {
+        if (!pio_can_add_program(pio, &midi_uart_pio_rx_program))
+            return NULL;
+        midi_uart_pio_rx_program_offset[pio_idx] = pio_add_program(pio, &midi_uart_pio_rx_program);
+        midi_uart_pio_rx_program_loaded[pio_idx] = true;
+    }
+    int sm = pio_claim_unused_sm(pio, false);
+    if (sm < 0)
+        return NULL;
+    midi_uart_pio_rx_t* instance = midi_uart_pio_rx_ports + midi_uart_pio_rx_nports;
+    // the received byte is in the most significant byte of the FIFO word
+    const volatile uint8_t* rxfifo_msb = (const volatile uint8_t*)&pio->rxf[sm] + 3;
+    if (!midi_dma_ring_init(&instance->rx_ring, midi_uart_pio_rx_storage[midi_uart_pio_rx_nports], rxfifo_msb,
+        pio_get_dreq(pio, sm, false))) {
+        pio_sm_unclaim(pio, sm);
+        return NULL;
+    }
+    instance->pio = pio;
+    instance->sm = sm;
+    midi_uart_pio_rx_program_init(pio, sm, midi_uart_pio_rx_program_offset[pio_idx], rxgpio, MIDI_UART_BAUD_RATE);
+    ++midi_uart_pio_rx_nports;
+    return instance;
+}
+
+RING_BUFFER_SIZE_TYPE midi_uart_pio_rx_poll_rx_buffer(midi_uart_pio_rx_t* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen)
+{
+    return midi_dma_ring_read(&instance->rx_ring, buffer, buflen);
+}
@@ -0,0 +1,58 @@
+/******************************************************************************
+ * @file midi_uart_pio_rx.h
+ *
+ * @brief 5-pin DIN MIDI inputs implemented with PIO state machines
+ *
+ * Each input uses one PIO state machine running an 8n1 serial receiver at
+ * 31250 baud and one DMA channel that drains the state machine's RX FIFO
+ * into the input's own midi_dma_ring_t. Use these for MIDI inputs beyond
+ * the two hardware UARTs.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+#include <stdint.h>
+#include "hardware/pio.h"
+#include "ring_buffer_lib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The maximum number of PIO MIDI inputs
+#ifndef MIDI_UART_PIO_RX_MAX_PORTS
+#define MIDI_UART_PIO_RX_MAX_PORTS 4
+#endif
+
+// The driver context for one PIO MIDI input. The definition is opaque to other applications
+typedef struct midi_uart_pio_rx_s midi_uart_pio_rx_t;
+
+/**
+ * @brief start a PIO MIDI input on a GPIO pin
+ *
+ * The receiver program is loaded into the PIO instruction memory the first
+ * time an input uses that PIO.
+ *
+ * @param pio the PIO instance (pio0 or pio1) to use
+ * @param rxgpio the GPIO number of the MIDI input
+ * @return a pointer to the driver context or NULL if no input, state machine,
+ * program space or DMA channel is available
+ */
+midi_uart_pio_rx_t* midi_uart_pio_rx_configure(PIO pio, uint8_t rxgpio);
+
+/**
+ * @brief copy the bytes received since the last call to a buffer
+ *
+ * @param instance the driver context returned by midi_uart_pio_rx_configure()
+ * @param buffer a pointer to storage for the received bytes
+ * @param buflen the maximum number of bytes to copy
+ * @return the number of bytes copied (may be 0)
+ */
+RING_BUFFER_SIZE_TYPE midi_uart_pio_rx_poll_rx_buffer(midi_uart_pio_rx_t* instance, uint8_t* buffer, RING_BUFFER_SIZE_TYPE buflen);
+
+#ifdef __cplusplus
+}
+#endif
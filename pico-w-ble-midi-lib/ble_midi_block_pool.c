@@ -0,0 +1,210 @@
+/******************************************************************************
+ * @file ble_midi_block_pool.c
+ *
+ * @brief Fixed-size block pool shared by the BLE-MIDI connection queues
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include <assert.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "ble_midi_block_pool.h"
+
+static_assert(BLE_MIDI_POOL_NBLOCKS >= BLE_MIDI_POOL_RESERVED_BLOCKS * BLE_MIDI_POOL_NOWNERS,
+    "the pool must hold every connection's reserved blocks");
+static_assert(BLE_MIDI_POOL_MAX_BLOCKS_PER_OWNER >= BLE_MIDI_POOL_RESERVED_BLOCKS,
+    "an owner's quota must include its reserved blocks");
+
+static ble_midi_pool_block_t pool[BLE_MIDI_POOL_NBLOCKS];
+static ble_midi_pool_block_t* free_list;
+static bool pool_initialized;
+static uint16_t nfree;
+static uint16_t nfree_min;
+// Reserved blocks the owners have not taken yet. Borrowing may never make
+// nfree smaller than this.
+static uint16_t nreserved_unused;
+static uint32_t nalloc_failed;
+
+static void ble_midi_block_pool_init()
+{
+    free_list = NULL;
+    for (uint16_t idx = 0; idx < BLE_MIDI_POOL_NBLOCKS; idx++) {
+        pool[idx].next = free_list;
+        free_list = pool + idx;
+    }
+    nfree = BLE_MIDI_POOL_NBLOCKS;
+    nfree_min = nfree;
+    nreserved_unused = 0;
+    nalloc_failed = 0;
+    pool_initialized = true;
+}
+
+void ble_midi_block_pool_add_owner(ble_midi_pool_owner_t* owner)
+{
+    if (!pool_initialized)
+        ble_midi_block_pool_init();
+    owner->nheld = 0;
+    owner->nheld_max = 0;
+    owner->nalloc_failed = 0;
+    nreserved_unused += BLE_MIDI_POOL_RESERVED_BLOCKS;
+    assert(nreserved_unused <= nfree);
+}
+
+void ble_midi_block_pool_get_stats(ble_midi_pool_stats_t* stats)
+{
+    stats->nblocks = BLE_MIDI_POOL_NBLOCKS;
+    stats->nfree = nfree;
+    stats->nfree_min = nfree_min;
+    stats->nalloc_failed = nalloc_failed;
+}
+
+// Return true if owner may take nblocks more blocks from the pool
+static bool ble_midi_block_pool_can_alloc(const ble_midi_pool_owner_t* owner, uint16_t nblocks)
+{
+    if (owner->nheld + nblocks > BLE_MIDI_POOL_MAX_BLOCKS_PER_OWNER)
+        return false;
+    uint16_t nreserved = owner->nheld < BLE_MIDI_POOL_RESERVED_BLOCKS ? BLE_MIDI_POOL_RESERVED_BLOCKS - owner->nheld : 0;
+    if (nblocks <= nreserved)
+        return true;
+    // the rest must be borrowed from the blocks nobody has reserved
+    return (uint16_t)(nblocks - nreserved) <= nfree - nreserved_unused;
+}
+
+// Call only after ble_midi_block_pool_can_alloc() returns true
+static ble_midi_pool_block_t* ble_midi_block_pool_alloc(ble_midi_pool_owner_t* owner)
+{
+    ble_midi_pool_block_t* block = free_list;
+    free_list = block->next;
+    block->next = NULL;
+    if (owner->nheld < BLE_MIDI_POOL_RESERVED_BLOCKS)
+        --nreserved_unused;
+    if (++owner->nheld > owner->nheld_max)
+        owner->nheld_max = owner->nheld;
+    if (--nfree < nfree_min)
+        nfree_min = nfree;
+    return block;
+}
+
+static void ble_midi_block_pool_free(ble_midi_pool_owner_t* owner, ble_midi_pool_block_t* block)
+{
+    block->next = free_list;
+    free_list = block;
+    ++nfree;
+    if (--owner->nheld < BLE_MIDI_POOL_RESERVED_BLOCKS)
+        ++nreserved_unused;
+}
+
+void ble_midi_block_queue_init(ble_midi_block_queue_t* queue, ble_midi_pool_owner_t* owner)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->head_idx = 0;
+    queue->tail_idx = 0;
+    queue->nbytes = 0;
+    queue->owner = owner;
+}
+
+void ble_midi_block_queue_clear(ble_midi_block_queue_t* queue)
+{
+    while (queue->head != NULL) {
+        ble_midi_pool_block_t* next = queue->head->next;
+        ble_midi_block_pool_free(queue->owner, queue->head);
+        queue->head = next;
+    }
+    ble_midi_block_queue_init(queue, queue->owner);
+}
+
+// Return the number of blocks the queue needs to append nbytes
+static uint16_t ble_midi_block_queue_blocks_needed(const ble_midi_block_queue_t* queue, uint16_t nbytes)
+{
+    uint16_t space = queue->tail ? BLE_MIDI_POOL_BLOCK_SIZE - queue->tail_idx : 0;
+    return nbytes > space ? (nbytes - space + BLE_MIDI_POOL_BLOCK_SIZE - 1) / BLE_MIDI_POOL_BLOCK_SIZE : 0;
+}
+
+int ble_midi_block_queue_get_push_cost(const ble_midi_block_queue_t* queue, uint16_t nbytes)
+{
+    uint16_t nblocks = ble_midi_block_queue_blocks_needed(queue, nbytes);
+    const ble_midi_pool_owner_t* owner = queue->owner;
+    if (owner->nheld + nblocks > BLE_MIDI_POOL_MAX_BLOCKS_PER_OWNER)
+        return -1;
+    uint16_t nreserved = owner->nheld < BLE_MIDI_POOL_RESERVED_BLOCKS ? BLE_MIDI_POOL_RESERVED_BLOCKS - owner->nheld : 0;
+    return nblocks > nreserved ? nblocks - nreserved : 0;
+}
+
+uint16_t ble_midi_block_pool_get_num_lendable()
+{
+    return nfree - nreserved_unused;
+}
+
+bool ble_midi_block_queue_push(ble_midi_block_queue_t* queue, const uint8_t* data, uint16_t nbytes)
+{
+    uint16_t nblocks = ble_midi_block_queue_blocks_needed(queue, nbytes);
+    if (nblocks > 0 && !ble_midi_block_pool_can_alloc(queue->owner, nblocks)) {
+        ++queue->owner->nalloc_failed;
+        ++nalloc_failed;
+        return false;
+    }
+    queue->nbytes += nbytes;
+    while (nbytes > 0) {
+        if (queue->tail == NULL || queue->tail_idx == BLE_MIDI_POOL_BLOCK_SIZE) {
+            ble_midi_pool_block_t* block = ble_midi_block_pool_alloc(queue->owner);
+            if (queue->tail == NULL)
+                queue->head = block;
+            else
+                queue->tail->next = block;
+            queue->tail = block;
+            queue->tail_idx = 0;
+        }
+        uint16_t ncopy = MIN(nbytes, BLE_MIDI_POOL_BLOCK_SIZE - queue->tail_idx);
+        memcpy(queue->tail->data + queue->tail_idx, data, ncopy);
+        queue->tail_idx += ncopy;
+        data += ncopy;
+        nbytes -= ncopy;
+    }
+    return true;
+}
+
+uint16_t ble_midi_block_queue_pop(ble_midi_block_queue_t* queue, uint8_t* data, uint16_t maxbytes)
+{
+    uint16_t npopped = 0;
+    while (npopped < maxbytes && queue->nbytes > 0) {
+        uint16_t end = queue->head == queue->tail ? queue->tail_idx : BLE_MIDI_POOL_BLOCK_SIZE;
+        uint16_t ncopy = MIN(maxbytes - npopped, end - queue->head_idx);
+        memcpy(data + npopped, queue->head->data + queue->head_idx, ncopy);
+        npopped += ncopy;
+        queue->head_idx += ncopy;
+        queue->nbytes -= ncopy;
+        if (queue->head_idx == end) {
+            // the head block is empty; give it back so other connections can borrow it
+            ble_midi_pool_block_t* next = queue->head->next;
+            ble_midi_block_pool_free(queue->owner, queue->head);
+            queue->head = next;
+            queue->head_idx = 0;
+            if (next == NULL) {
+                queue->tail = NULL;
+                queue->tail_idx = 0;
+            }
+        }
+    }
+    return npopped;
+}
+
+uint16_t ble_midi_block_queue_peek(const ble_midi_block_queue_t* queue, uint8_t* data, uint16_t maxbytes)
+{
+    uint16_t npeeked = 0;
+    const ble_midi_pool_block_t* block = queue->head;
+    uint16_t idx = queue->head_idx;
+    maxbytes = MIN(maxbytes, queue->nbytes);
+    while (npeeked < maxbytes) {
+        uint16_t end = block == queue->tail ? queue->tail_idx : BLE_MIDI_POOL_BLOCK_SIZE;
+        uint16_t ncopy = MIN(maxbytes - npeeked, end - idx);
+        memcpy(data + npeeked, block->data + idx, ncopy);
+        npeeked += ncopy;
+        block = block->next;
+        idx = 0;
+    }
+    return npeeked;
+}
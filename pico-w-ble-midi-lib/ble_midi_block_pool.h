@@ -0,0 +1,191 @@
+/******************************************************************************
+ * @file ble_midi_block_pool.h
+ *
+ * @brief Fixed-size block pool shared by the BLE-MIDI connection queues
+ *
+ * Each connection's packet-to-send and decoded-message queues are chains of
+ * blocks taken from one static pool when data arrives and given back as soon
+ * as the data is read. Every connection is an owner of the pool: it is
+ * guaranteed BLE_MIDI_POOL_RESERVED_BLOCKS blocks and may borrow unreserved
+ * blocks on demand up to BLE_MIDI_POOL_MAX_BLOCKS_PER_OWNER.
+ *
+ * The queues are only used from the BTstack context and the main loop, which
+ * are the same thread with pico_cyw43_arch_none, so the pool needs no locking.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "btstack_config.h" // for BLE_MIDI_SERVER_MAX_CONNECTIONS & BLE_MIDI_CLIENT_MAX_CONNECTIONS
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of BLE-MIDI peripherals the client can connect to at once
+#ifndef BLE_MIDI_CLIENT_MAX_CONNECTIONS
+#define BLE_MIDI_CLIENT_MAX_CONNECTIONS 1
+#endif
+
+// Number of client connections with a codec context; 0 if the client is never started
+#ifndef BLE_MIDI_POOL_CLIENT_OWNERS
+#define BLE_MIDI_POOL_CLIENT_OWNERS BLE_MIDI_CLIENT_MAX_CONNECTIONS
+#endif
+
+// Every server connection and each of those client connections has a codec context that owns pool blocks
+#define BLE_MIDI_POOL_NOWNERS (BLE_MIDI_SERVER_MAX_CONNECTIONS + BLE_MIDI_POOL_CLIENT_OWNERS)
+
+// Number of data bytes in one pool block
+#ifndef BLE_MIDI_POOL_BLOCK_SIZE
+#define BLE_MIDI_POOL_BLOCK_SIZE 128
+#endif
+
+// Number of blocks each owner can always get, even when the others have borrowed the rest
+#ifndef BLE_MIDI_POOL_RESERVED_BLOCKS
+#define BLE_MIDI_POOL_RESERVED_BLOCKS 4
+#endif
+
+// Number of blocks in the pool. Most of the pool is shared, so RAM grows
+// by only the reserved blocks for each additional connection.
+#ifndef BLE_MIDI_POOL_NBLOCKS
+#define BLE_MIDI_POOL_NBLOCKS (8 + BLE_MIDI_POOL_RESERVED_BLOCKS * BLE_MIDI_POOL_NOWNERS)
+#endif
+
+// The most blocks one owner may hold, reserved and borrowed
+#ifndef BLE_MIDI_POOL_MAX_BLOCKS_PER_OWNER
+#define BLE_MIDI_POOL_MAX_BLOCKS_PER_OWNER (BLE_MIDI_POOL_NBLOCKS - BLE_MIDI_POOL_RESERVED_BLOCKS * (BLE_MIDI_POOL_NOWNERS - 1))
+#endif
+
+typedef struct ble_midi_pool_block_s {
+    struct ble_midi_pool_block_s* next;
+    uint8_t data[BLE_MIDI_POOL_BLOCK_SIZE];
+} ble_midi_pool_block_t;
+
+// The blocks held by one connection
+typedef struct ble_midi_pool_owner_s {
+    uint16_t nheld;             // blocks currently held
+    uint16_t nheld_max;         // the most blocks held at once
+    uint32_t nalloc_failed;     // pushes refused because the quota or the pool ran out
+} ble_midi_pool_owner_t;
+
+// A byte FIFO stored in a chain of pool blocks
+typedef struct ble_midi_block_queue_s {
+    ble_midi_pool_block_t* head;    // the block with the oldest data
+    ble_midi_pool_block_t* tail;    // the block being written
+    uint16_t head_idx;              // index in head->data of the next byte to read
+    uint16_t tail_idx;              // index in tail->data of the next byte to write
+    uint16_t nbytes;                // the number of bytes in the queue
+    ble_midi_pool_owner_t* owner;   // the owner charged for the queue's blocks
+} ble_midi_block_queue_t;
+
+// Pool occupancy statistics
+typedef struct ble_midi_pool_stats_s {
+    uint16_t nblocks;           // the number of blocks in the pool
+    uint16_t nfree;             // the number of blocks not held by any owner
+    uint16_t nfree_min;         // the fewest free blocks since the pool was initialized
+    uint32_t nalloc_failed;     // pushes refused by all owners
+} ble_midi_pool_stats_t;
+
+/**
+ * @brief register an owner with the pool and reserve its guaranteed blocks
+ *
+ * Call once for each owner before its queues are used. The pool puts all of
+ * its blocks on the free list on the first call.
+ *
+ * @param owner the owner to register
+ */
+void ble_midi_block_pool_add_owner(ble_midi_pool_owner_t* owner);
+
+/**
+ * @brief get the pool occupancy statistics
+ *
+ * @param stats a pointer to storage for the statistics
+ */
+void ble_midi_block_pool_get_stats(ble_midi_pool_stats_t* stats);
+
+/**
+ * @brief initialize an empty queue
+ *
+ * @param queue the queue
+ * @param owner the owner charged for the blocks the queue holds
+ */
+void ble_midi_block_queue_init(ble_midi_block_queue_t* queue, ble_midi_pool_owner_t* owner);
+
+/**
+ * @brief give all of the queue's blocks back to the pool and empty it
+ *
+ * @param queue the queue
+ */
+void ble_midi_block_queue_clear(ble_midi_block_queue_t* queue);
+
+/**
+ * @brief append bytes to the queue if all of them fit
+ *
+ * @param queue the queue
+ * @param data the bytes to append
+ * @param nbytes the number of bytes to append
+ * @return true if the bytes were appended; false if the owner's quota or the
+ * pool ran out, in which case nothing was appended
+ */
+bool ble_midi_block_queue_push(ble_midi_block_queue_t* queue, const uint8_t* data, uint16_t nbytes);
+
+/**
+ * @brief get the number of unreserved blocks appending bytes would borrow from the pool
+ *
+ * A caller that appends to several queues at once can add up the borrowed
+ * blocks and compare the sum with ble_midi_block_pool_get_num_lendable()
+ * before it appends anything.
+ *
+ * @param queue the queue
+ * @param nbytes the number of bytes to append
+ * @return the number of blocks borrowed, or -1 if the owner's quota cannot hold them
+ */
+int ble_midi_block_queue_get_push_cost(const ble_midi_block_queue_t* queue, uint16_t nbytes);
+
+/**
+ * @brief get the number of free blocks no owner has reserved
+ *
+ * @return the number of blocks owners may borrow
+ */
+uint16_t ble_midi_block_pool_get_num_lendable();
+
+/**
+ * @brief remove bytes from the front of the queue
+ *
+ * Blocks that become empty go back to the pool.
+ *
+ * @param queue the queue
+ * @param data storage for the bytes
+ * @param maxbytes the most bytes to remove
+ * @return the number of bytes removed
+ */
+uint16_t ble_midi_block_queue_pop(ble_midi_block_queue_t* queue, uint8_t* data, uint16_t maxbytes);
+
+/**
+ * @brief copy bytes from the front of the queue without removing them
+ *
+ * @param queue the queue
+ * @param data storage for the bytes
+ * @param maxbytes the most bytes to copy
+ * @return the number of bytes copied
+ */
+uint16_t ble_midi_block_queue_peek(const ble_midi_block_queue_t* queue, uint8_t* data, uint16_t maxbytes);
+
+/**
+ * @brief get the number of bytes in the queue
+ *
+ * @param queue the queue
+ * @return the number of bytes in the queue
+ */
+static inline uint16_t ble_midi_block_queue_get_num_bytes(const ble_midi_block_queue_t* queue)
+{
+    return queue->nbytes;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,23 +3,36 @@
 #include "pico/btstack_cyw43.h"
 #include "ble_midi_client.h"
 #include "ble_midi_pkt_codec.h"
+#include "ble_midi_ecc.h"
+#include <assert.h>
 #include <inttypes.h>
 // Fixed passkey - used with sm_pairing_peripheral. Passkey is random in general
 #define FIXED_PASSKEY 123456U
 
+// What the client is doing apart from its connections
 static enum {
     BLEMC_DEINIT = 0,
     BLEMC_IDLE,
     BLEMC_WAIT_FOR_SCAN_COMPLETE,
     BLEMC_WAIT_FOR_CONNECTION,
+} state;
+
+// What one connection is doing
+typedef enum {
     BLEMC_WAIT_FOR_SERVICES,
     BLEMC_WAIT_FOR_CHARACTERISTICS,
+    BLEMC_WAIT_FOR_DESCRIPTORS,
     BLEMC_WAIT_FOR_ENABLE_NOTIFICATIONS_COMPLETE,
     BLEMC_WAIT_FOR_MIDI_DATA_RX,
     BLEMC_WAIT_FOR_DISCONNECTION,
-} state;
+} connection_state_t;
 
 #define BLEMC_MAX_SCAN_ITEMS 16
+// Open addressed map from a scan result's BD_ADDR to its midi_peripherals[]
+// index; a power of 2 at least twice BLEMC_MAX_SCAN_ITEMS keeps probes short
+#define BLEMC_SCAN_MAP_SIZE 32
+static_assert((BLEMC_SCAN_MAP_SIZE & (BLEMC_SCAN_MAP_SIZE - 1)) == 0 && BLEMC_SCAN_MAP_SIZE >= 2 * BLEMC_MAX_SCAN_ITEMS,
+    "BLEMC_SCAN_MAP_SIZE must be a power of 2 and at least twice BLEMC_MAX_SCAN_ITEMS");
 
 typedef struct  {
     char name[32];
@@ -32,27 +45,63 @@ typedef struct  {
 typedef struct {
     Advertised_MIDI_Peripheral_t midi_peripherals[BLEMC_MAX_SCAN_ITEMS];
     uint8_t n_midi_peripherals;
+    uint8_t map[BLEMC_SCAN_MAP_SIZE];   // index + 1 of the entry for a BD_ADDR; 0 means empty
 } BLEMC_client_t;
 
+// A connection to a BLE-MIDI peripheral
+typedef struct {
+    hci_con_handle_t con_handle;        // HCI_CON_HANDLE_INVALID if the context is free
+    connection_state_t state;
+    uint8_t addr_type;                  // the peripheral
+    bd_addr_t addr;
+    gatt_client_service_t midi_service;
+    gatt_client_characteristic_t midi_data_io_characteristic;
+    uint16_t cccd_handle;               // the MIDI Data I/O characteristic's client characteristic configuration
+    bool using_cached_handles;          // true if the handles came from the cache rather than discovery
+    gatt_client_notification_t notification_listener;
+    bool listener_registered;
+    ble_midi_codec_data_t* ble_midi_pkt_codec_data;
+    btstack_context_callback_registration_t write_callback_registration;
+    btstack_timer_source_t coalesce_timer;  // ends the coalescing window of the packet collecting messages
+    bool coalesce_timer_active;
+} ble_midi_client_connection_t;
+
+static const uint8_t midi_service_uuid128[] = { 0x03, 0xB8, 0x0E, 0x5A, 0xED, 0xE8, 0x4B, 0x33, 0xA7, 0x51, 0x6C, 0xE3, 0x4E, 0xC4, 0xC7, 0x00 };
 static uint32_t const scan_blink_timeout_ms = 500;
 static int32_t const scan_remove_timeout = 6; // when decremented to 0, remove entry from midi_peripherals (in units of scan_blink_timeout_ms)
 static btstack_packet_callback_registration_t sm_event_callback_registration;
 static btstack_packet_callback_registration_t hci_event_callback_registration;
 static btstack_timer_source_t scan_timer;
 static BLEMC_client_t midi_client;
-static hci_con_handle_t con_handle = HCI_CON_HANDLE_INVALID;
+static ble_midi_client_connection_t connections[BLE_MIDI_CLIENT_MAX_CONNECTIONS];
+// The connection ble_midi_client_stream_read() tries first
+static uint8_t next_read_idx;
 static uint16_t conn_interval;
 static uint8_t next_connect_bd_addr_type;
 static uint8_t next_connect_bd_addr[6];
-static gatt_client_service_t midi_service;
-static gatt_client_characteristic_t midi_data_io_characteristic;
-static gatt_client_notification_t notification_listener;
-static bool listener_registered = 0;
-static ble_midi_codec_data_t* ble_midi_pkt_codec_data;
-static btstack_context_callback_registration_t write_callback_registration;
 static uint8_t *client_profile_data = NULL;
 static io_capability_t iocaps;
 static uint8_t secmask;
+static ble_midi_client_message_cb_t client_message_cb;
+static ble_midi_client_sysex_cb_t client_sysex_cb;
+// true to connect to white listed peripherals whenever not connected
+static bool auto_connect = false;
+// true if the client runs on the Bluetooth stack the BLE-MIDI server set up
+static bool dual_role = false;
+
+// The GATT handles a peripheral's MIDI Data I/O characteristic had when the client last connected
+typedef struct {
+    bool valid;
+    uint8_t addr_type;
+    bd_addr_t addr;
+    gatt_client_characteristic_t characteristic;
+    uint16_t cccd_handle;
+} handle_cache_entry_t;
+static handle_cache_entry_t handle_cache[BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE];
+static uint8_t handle_cache_next;       // the entry to replace when the cache is full
+// Entries for bonded peripherals are also kept in the TLV store, one tag per entry.
+// Entries for other peripherals only last until they disconnect, in case they bond meanwhile.
+#define BLE_MIDI_CLIENT_TLV_TAG_HANDLE_CACHE(idx) (((uint32_t)'M' << 24) | ((uint32_t)'H' << 16) | ((uint32_t)'C' << 8) | (idx))
 static void printUUID(uint8_t * uuid128, uint16_t uuid16){
     if (uuid16){
         printf("%04x",uuid16);
@@ -73,13 +122,49 @@ static void dump_service(gatt_client_service_t * service){
     printf("\n");
 }
 
-static int find_midi_peripheral(BLEMC_client_t* blemc, uint8_t* bdaddr)
+// FNV-1a hash of a BD_ADDR, folded to a scan map slot
+static uint8_t scan_map_slot(const uint8_t* bdaddr)
 {
-    uint8_t idx;
-    for (idx = 0; idx < blemc->n_midi_peripherals && memcmp(blemc->midi_peripherals[idx].bdaddr, bdaddr, 6) != 0; idx++) {
+    uint32_t hash = 2166136261u;
+    for (uint8_t idx = 0; idx < 6; idx++)
+        hash = (hash ^ bdaddr[idx]) * 16777619u;
+    return (hash ^ (hash >> 16)) & (BLEMC_SCAN_MAP_SIZE - 1);
+}
 
+static void scan_map_insert(BLEMC_client_t* blemc, uint8_t idx)
+{
+    uint8_t slot = scan_map_slot(blemc->midi_peripherals[idx].bdaddr);
+    while (blemc->map[slot] != 0)
+        slot = (slot + 1) & (BLEMC_SCAN_MAP_SIZE - 1);
+    blemc->map[slot] = idx + 1;
+}
+
+// Rebuild the map from the list, as removing entries moves them around the list
+static void scan_map_rebuild(BLEMC_client_t* blemc)
+{
+    memset(blemc->map, 0, sizeof(blemc->map));
+    for (uint8_t idx = 0; idx < blemc->n_midi_peripherals; idx++)
+        scan_map_insert(blemc, idx);
+}
+
+static void clear_midi_peripherals(BLEMC_client_t* blemc)
+{
+    blemc->n_midi_peripherals = 0;
+    memset(blemc->map, 0, sizeof(blemc->map));
+}
+
+// Return the index of the entry for bdaddr, or n_midi_peripherals if there is none.
+// Every advertising report in range comes through here, so it must be cheap.
+static int find_midi_peripheral(BLEMC_client_t* blemc, uint8_t* bdaddr)
+{
+    uint8_t slot = scan_map_slot(bdaddr);
+    while (blemc->map[slot] != 0) {
+        uint8_t idx = blemc->map[slot] - 1;
+        if (memcmp(blemc->midi_peripherals[idx].bdaddr, bdaddr, 6) == 0)
+            return idx;
+        slot = (slot + 1) & (BLEMC_SCAN_MAP_SIZE - 1);
     }
-    return idx;
+    return blemc->n_midi_peripherals;
 }
 
 static void scan_timer_cb(btstack_timer_source_t* timer_)
@@ -94,21 +179,205 @@ static void scan_timer_cb(btstack_timer_source_t* timer_)
     BLEMC_client_t *mp = (BLEMC_client_t*)(timer_->context);
     cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, led_on);
     // update the midi_peripheral list timeout field and delete entries with expired timers
+    bool removed = false;
     for (uint8_t idx = 0; idx < mp->n_midi_peripherals;) {
         if (--mp->midi_peripherals[idx].timeout <= 0) {
             mp->midi_peripherals[idx] = mp->midi_peripherals[mp->n_midi_peripherals - 1];
             mp->n_midi_peripherals--;
+            removed = true;
         }
         else {
             ++idx;
         }
     }
+    if (removed)
+        scan_map_rebuild(mp);
 
     // Restart timer
     btstack_run_loop_set_timer(timer_, scan_blink_timeout_ms);
     btstack_run_loop_add_timer(timer_);
 }
 
+static handle_cache_entry_t* find_cached_handles(uint8_t addr_type, const bd_addr_t addr)
+{
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE; idx++) {
+        if (handle_cache[idx].valid && handle_cache[idx].addr_type == addr_type && bd_addr_cmp(handle_cache[idx].addr, addr) == 0)
+            return handle_cache + idx;
+    }
+    return NULL;
+}
+
+static bool is_bonded(uint8_t addr_type, const bd_addr_t addr)
+{
+    for (int idx = 0; idx < le_device_db_max_count(); idx++) {
+        int db_addr_type;
+        bd_addr_t db_addr;
+        le_device_db_info(idx, &db_addr_type, db_addr, NULL);
+        if (db_addr_type == addr_type && bd_addr_cmp(db_addr, addr) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Write a cache entry to flash if its peripheral is bonded and flash has something else
+static void store_cached_handles(const handle_cache_entry_t* entry)
+{
+    const btstack_tlv_t* tlv_impl;
+    void* tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl == NULL || !is_bonded(entry->addr_type, entry->addr))
+        return;
+    uint32_t tag = BLE_MIDI_CLIENT_TLV_TAG_HANDLE_CACHE(entry - handle_cache);
+    handle_cache_entry_t stored;
+    if (tlv_impl->get_tag(tlv_context, tag, (uint8_t*)&stored, sizeof(stored)) == sizeof(stored) &&
+            memcmp(&stored, entry, sizeof(stored)) == 0)
+        return; // spare the flash
+    tlv_impl->store_tag(tlv_context, tag, (const uint8_t*)entry, sizeof(*entry));
+}
+
+static void forget_cached_handles(handle_cache_entry_t* entry)
+{
+    entry->valid = false;
+    const btstack_tlv_t* tlv_impl;
+    void* tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl != NULL)
+        tlv_impl->delete_tag(tlv_context, BLE_MIDI_CLIENT_TLV_TAG_HANDLE_CACHE(entry - handle_cache));
+}
+
+// Fill the cache with the entries stored for peripherals that are still bonded
+static void load_cached_handles()
+{
+    const btstack_tlv_t* tlv_impl;
+    void* tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    handle_cache_next = BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE;
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE; idx++) {
+        handle_cache_entry_t* entry = handle_cache + idx;
+        if (tlv_impl == NULL ||
+                tlv_impl->get_tag(tlv_context, BLE_MIDI_CLIENT_TLV_TAG_HANDLE_CACHE(idx), (uint8_t*)entry, sizeof(*entry)) != sizeof(*entry)) {
+            entry->valid = false;
+        }
+        else if (!entry->valid || !is_bonded(entry->addr_type, entry->addr)) {
+            // the bond was deleted since
+            forget_cached_handles(entry);
+        }
+        if (!entry->valid && handle_cache_next == BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE)
+            handle_cache_next = idx;
+    }
+    if (handle_cache_next == BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE)
+        handle_cache_next = 0;
+}
+
+static void cache_handles(const ble_midi_client_connection_t* conn)
+{
+    handle_cache_entry_t* entry = find_cached_handles(conn->addr_type, conn->addr);
+    for (uint8_t idx = 0; entry == NULL && idx < BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE; idx++) {
+        // reuse an entry left by a peripheral that disconnected without bonding
+        if (!handle_cache[idx].valid)
+            entry = handle_cache + idx;
+    }
+    if (entry == NULL) {
+        entry = handle_cache + handle_cache_next;
+        handle_cache_next = (handle_cache_next + 1) % BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE;
+    }
+    entry->valid = true;
+    entry->addr_type = conn->addr_type;
+    bd_addr_copy(entry->addr, conn->addr);
+    entry->characteristic = conn->midi_data_io_characteristic;
+    entry->cccd_handle = conn->cccd_handle;
+    store_cached_handles(entry);
+}
+
+// true if an ATT error says the attribute at a cached handle is not what it was
+static bool is_handle_mismatch(uint8_t att_status)
+{
+    return att_status == ATT_ERROR_INVALID_HANDLE || att_status == ATT_ERROR_ATTRIBUTE_NOT_FOUND ||
+        att_status == ATT_ERROR_WRITE_NOT_PERMITTED;
+}
+
+// Return the connection with the handle con_handle, or NULL if it is not one of the client's
+static ble_midi_client_connection_t* get_connection(hci_con_handle_t con_handle)
+{
+    if (con_handle == HCI_CON_HANDLE_INVALID)
+        return NULL;
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        if (connections[idx].con_handle == con_handle)
+            return connections + idx;
+    }
+    return NULL;
+}
+
+// Return a connection context with no connection, or NULL if all are in use
+static ble_midi_client_connection_t* get_free_connection()
+{
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        if (connections[idx].con_handle == HCI_CON_HANDLE_INVALID)
+            return connections + idx;
+    }
+    return NULL;
+}
+
+static uint8_t get_num_ready_connections()
+{
+    uint8_t nready = 0;
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        if (connections[idx].con_handle != HCI_CON_HANDLE_INVALID && connections[idx].state == BLEMC_WAIT_FOR_MIDI_DATA_RX)
+            ++nready;
+    }
+    return nready;
+}
+
+static void handle_gatt_client_event(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void discover_midi_service(ble_midi_client_connection_t* conn)
+{
+    conn->using_cached_handles = false;
+    printf("Search for MIDI service.\n");
+    int err = gatt_client_discover_primary_services_by_uuid128(handle_gatt_client_event, conn->con_handle, midi_service_uuid128);
+    if (err != ERROR_CODE_SUCCESS)
+        printf("Error(%d): Failed to discover primary services by uuid128\r\n", err);
+    conn->state = BLEMC_WAIT_FOR_SERVICES;
+}
+
+// Listen for notifications and write the client characteristic configuration to turn them on
+static void enable_notifications(ble_midi_client_connection_t* conn)
+{
+    static const uint8_t enable_notification[] = {
+        GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION & 0xff,
+        GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION >> 8
+    };
+    conn->state = BLEMC_WAIT_FOR_ENABLE_NOTIFICATIONS_COMPLETE;
+    if (!conn->listener_registered) {
+        conn->listener_registered = true;
+        gatt_client_listen_for_characteristic_value_updates(&conn->notification_listener, handle_gatt_client_event,
+            conn->con_handle, &conn->midi_data_io_characteristic);
+    }
+    if (ERROR_CODE_SUCCESS != gatt_client_write_value_of_characteristic(handle_gatt_client_event, conn->con_handle,
+            conn->cccd_handle, sizeof(enable_notification), (uint8_t*)enable_notification)) {
+        printf("failed to write client characteristic configuration\r\n");
+    }
+    else {
+        printf("wrote client characteristic configuration\r\n");
+    }
+}
+
+static void stop_coalesce_timer(ble_midi_client_connection_t* conn)
+{
+    if (conn->coalesce_timer_active) {
+        btstack_run_loop_remove_timer(&conn->coalesce_timer);
+        conn->coalesce_timer_active = false;
+    }
+}
+
+static void stop_listening(ble_midi_client_connection_t* conn)
+{
+    if (conn->listener_registered) {
+        conn->listener_registered = false;
+        gatt_client_stop_listening_for_characteristic_value_updates(&conn->notification_listener);
+    }
+}
+
 static void handle_gatt_client_event(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
 {
     (void)packet_type;
@@ -116,58 +385,88 @@ static void handle_gatt_client_event(uint8_t packet_type, uint16_t channel, uint
     (void)size;
     static uint8_t midi_data_io_characteristic_uuid[16] = {0x77, 0x72, 0xE5, 0xDB, 0x38, 0x68, 0x41, 0x12, 0xA1, 0xA9, 0xF2, 0x66, 0x9D, 0x10, 0x6B, 0xF3};
     uint8_t att_status;
+    gatt_client_characteristic_descriptor_t descriptor;
     uint16_t data_len;
     const uint8_t* data;
     uint16_t ndecoded;
+    // every GATT event starts with the connection handle
+    ble_midi_client_connection_t* conn = get_connection(little_endian_read_16(packet, 2));
+    if (conn == NULL)
+        return;
     switch(hci_event_packet_get_type(packet)){
         case GATT_EVENT_SERVICE_QUERY_RESULT:
-            if (state != BLEMC_WAIT_FOR_SERVICES)
+            if (conn->state != BLEMC_WAIT_FOR_SERVICES)
                 break;
-            gatt_event_service_query_result_get_service(packet, &midi_service);
-            dump_service(&midi_service);
+            gatt_event_service_query_result_get_service(packet, &conn->midi_service);
+            dump_service(&conn->midi_service);
             break;
         case GATT_EVENT_CHARACTERISTIC_QUERY_RESULT:
-            if (state == BLEMC_WAIT_FOR_CHARACTERISTICS) {
-                gatt_event_characteristic_query_result_get_characteristic(packet, &midi_data_io_characteristic);
-                dump_characteristic(&midi_data_io_characteristic);
+            if (conn->state == BLEMC_WAIT_FOR_CHARACTERISTICS) {
+                gatt_event_characteristic_query_result_get_characteristic(packet, &conn->midi_data_io_characteristic);
+                dump_characteristic(&conn->midi_data_io_characteristic);
             }
             break;
+        case GATT_EVENT_ALL_CHARACTERISTIC_DESCRIPTORS_QUERY_RESULT:
+            if (conn->state != BLEMC_WAIT_FOR_DESCRIPTORS)
+                break;
+            gatt_event_all_characteristic_descriptors_query_result_get_characteristic_descriptor(packet, &descriptor);
+            if (descriptor.uuid16 == ORG_BLUETOOTH_DESCRIPTOR_GATT_CLIENT_CHARACTERISTIC_CONFIGURATION)
+                conn->cccd_handle = descriptor.handle;
+            break;
         case GATT_EVENT_QUERY_COMPLETE:
             att_status = gatt_event_query_complete_get_att_status(packet);
+            if (conn->state == BLEMC_WAIT_FOR_ENABLE_NOTIFICATIONS_COMPLETE && conn->using_cached_handles && is_handle_mismatch(att_status)) {
+                // the peripheral's handles changed, e.g. after a firmware update; find them again
+                printf("cached handles failed with ATT Error 0x%02x; rediscovering\r\n", att_status);
+                handle_cache_entry_t* entry = find_cached_handles(conn->addr_type, conn->addr);
+                if (entry != NULL)
+                    forget_cached_handles(entry);
+                stop_listening(conn);
+                discover_midi_service(conn);
+                break;
+            }
             if (att_status != ATT_ERROR_SUCCESS) {
                 printf("SERVICE_QUERY_RESULT, ATT Error 0x%02x.\n", att_status);
-                //state = BLEMC_WAIT_FOR_DISCONNECTION;
-                //gap_disconnect(con_handle);
+                //conn->state = BLEMC_WAIT_FOR_DISCONNECTION;
+                //gap_disconnect(conn->con_handle);
                 break;  
             } 
-            if (state == BLEMC_WAIT_FOR_SERVICES) {
+            if (conn->state == BLEMC_WAIT_FOR_SERVICES) {
                 printf("\nCHARACTERISTIC for SERVICE %s, [0x%04x-0x%04x]\n",
-                    uuid128_to_str(midi_service.uuid128), midi_service.start_group_handle, midi_service.end_group_handle);
-                state = BLEMC_WAIT_FOR_CHARACTERISTICS;
-                gatt_client_discover_characteristics_for_service_by_uuid128(handle_gatt_client_event, con_handle, &midi_service, midi_data_io_characteristic_uuid);
+                    uuid128_to_str(conn->midi_service.uuid128), conn->midi_service.start_group_handle, conn->midi_service.end_group_handle);
+                conn->state = BLEMC_WAIT_FOR_CHARACTERISTICS;
+                gatt_client_discover_characteristics_for_service_by_uuid128(handle_gatt_client_event, conn->con_handle,
+                    &conn->midi_service, midi_data_io_characteristic_uuid);
                 break;
             }
-            else if (state == BLEMC_WAIT_FOR_CHARACTERISTICS) {
+            else if (conn->state == BLEMC_WAIT_FOR_CHARACTERISTICS) {
                 printf("found all characteristics query complete\r\n");
-                state = BLEMC_WAIT_FOR_ENABLE_NOTIFICATIONS_COMPLETE;
-                listener_registered = true;
-                gatt_client_listen_for_characteristic_value_updates(&notification_listener, handle_gatt_client_event, con_handle, &midi_data_io_characteristic);
-                if (ERROR_CODE_SUCCESS != gatt_client_write_client_characteristic_configuration(handle_gatt_client_event, con_handle,
-                    &midi_data_io_characteristic, GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION)) {
-                        printf("failed to write client characteristic configuration\r\n");
-                }
-                else {
-                    printf("wrote client characteristic configuration\r\n");
+                conn->state = BLEMC_WAIT_FOR_DESCRIPTORS;
+                conn->cccd_handle = 0;
+                gatt_client_discover_characteristic_descriptors(handle_gatt_client_event, conn->con_handle, &conn->midi_data_io_characteristic);
+            }
+            else if (conn->state == BLEMC_WAIT_FOR_DESCRIPTORS) {
+                if (conn->cccd_handle == 0) {
+                    printf("MIDI Data I/O characteristic has no client characteristic configuration\r\n");
+                    break;
                 }
+                cache_handles(conn);
+                enable_notifications(conn);
             }
-            else if (state == BLEMC_WAIT_FOR_ENABLE_NOTIFICATIONS_COMPLETE) {
-                state = BLEMC_WAIT_FOR_MIDI_DATA_RX;
-                printf("ready to receive MIDI data\r\n");
+            else if (conn->state == BLEMC_WAIT_FOR_ENABLE_NOTIFICATIONS_COMPLETE) {
+                conn->state = BLEMC_WAIT_FOR_MIDI_DATA_RX;
+                printf("ready to receive MIDI data from %s%s\r\n", bd_addr_to_str(conn->addr),
+                    conn->using_cached_handles ? " (cached handles)" : "");
                 cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, true);
-                hci_connection_t * con = hci_connection_for_handle(con_handle);
-                printf("HCI Connection: bdaddr=%s type=%u", bd_addr_to_str(con->address), con->address_type);
+                // the MTU exchange waited so it would not delay the first MIDI data
+                gatt_client_send_mtu_negotiation(handle_gatt_client_event, conn->con_handle);
             }
             break;
+        case GATT_EVENT_MTU:
+            // a write without response carries the ATT MTU less the 3 byte ATT header
+            ble_midi_pkt_codec_update_mtu(conn->ble_midi_pkt_codec_data, gatt_event_mtu_get_MTU(packet) - 3);
+            printf("ATT MTU = %u => max MIDI packet len %u\r\n", gatt_event_mtu_get_MTU(packet), ble_midi_pkt_codec_get_mtu(conn->ble_midi_pkt_codec_data));
+            break;
         case GATT_EVENT_NOTIFICATION:
             data_len = gatt_event_notification_get_value_length(packet);
             data = gatt_event_notification_get_value(packet);
@@ -178,7 +477,7 @@ static void handle_gatt_client_event(uint8_t packet_type, uint16_t channel, uint
             }
             printf("\r\n");
 #endif
-            ndecoded = ble_midi_pkt_codec_ble_midi_decode_push(data, data_len, ble_midi_pkt_codec_data);
+            ndecoded = ble_midi_pkt_codec_ble_midi_decode_push(data, data_len, conn->ble_midi_pkt_codec_data);
             if (ndecoded != data_len) {
                 printf("Parse error decoding midi packet\r\n");
                 printf_hexdump(data, data_len);
@@ -237,6 +536,15 @@ static void midi_service_emit_state(hci_con_handle_t con_handle, bool enabled)
 #endif
 }
 
+// Connect to the next white listed peripheral that advertises, if there is room for it
+static void connect_next_from_whitelist()
+{
+    if (auto_connect && state == BLEMC_IDLE && get_free_connection() != NULL) {
+        state = BLEMC_WAIT_FOR_CONNECTION;
+        gap_connect_with_whitelist();
+    }
+}
+
 static void handle_hci_event(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
 {
     (void)channel;
@@ -247,10 +555,10 @@ static void handle_hci_event(uint8_t packet_type, uint16_t channel, uint8_t *pac
     const uint8_t* ad_data;
     uint8_t ad_data_len;
     bd_addr_t bdaddr;
-    static const uint8_t midi_service_uuid128[] = { 0x03, 0xB8, 0x0E, 0x5A, 0xED, 0xE8, 0x4B, 0x33, 0xA7, 0x51, 0x6C, 0xE3, 0x4E, 0xC4, 0xC7, 0x00 };
     bool mapped; // true if the advertising report is from a BD_ADDR already mapped
     int idx;
-    int err;
+    handle_cache_entry_t* cached;
+    ble_midi_client_connection_t* conn;
     static const char * const phy_names[] = {
             "1 M", "2 M", "Codec"
     };
@@ -260,13 +568,16 @@ static void handle_hci_event(uint8_t packet_type, uint16_t channel, uint8_t *pac
             if (btstack_event_state_get_state(packet) != HCI_STATE_WORKING)
                 break;
             if (state == BLEMC_WAIT_FOR_SCAN_COMPLETE) {
-                midi_client.n_midi_peripherals = 0;
+                clear_midi_peripherals(&midi_client);
                 printf("BTstack activated, start active scanning\n");
                 gap_set_scan_params(1,0x0030, 0x0030,0);
                 gap_start_scan();
             }
             else if (state == BLEMC_WAIT_FOR_CONNECTION) {
-                if (next_connect_bd_addr_type != BD_ADDR_TYPE_UNKNOWN) {
+                if (auto_connect) {
+                    gap_connect_with_whitelist();
+                }
+                else if (next_connect_bd_addr_type != BD_ADDR_TYPE_UNKNOWN) {
                     gap_connect(next_connect_bd_addr, next_connect_bd_addr_type);
                 }
             }
@@ -277,58 +588,88 @@ static void handle_hci_event(uint8_t packet_type, uint16_t channel, uint8_t *pac
             gap_event_advertising_report_get_address(packet, bdaddr);
             idx = find_midi_peripheral(&midi_client, bdaddr);
             mapped = idx < midi_client.n_midi_peripherals;
-            if (ad_data_contains_uuid128(ad_data_len, ad_data, midi_service_uuid128) || mapped) {
-                if (mapped) {
-                    if (midi_client.midi_peripherals[idx].type == BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME) {
-                        midi_client.midi_peripherals[idx].timeout = scan_remove_timeout;
-                        break; // no need to repeat ourselves.
-                    }
+            if (mapped) {
+                if (midi_client.midi_peripherals[idx].type == BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME) {
+                    midi_client.midi_peripherals[idx].timeout = scan_remove_timeout;
+                    break; // no need to repeat ourselves.
                 }
-                else {
-                    // initialize the map with the BD_ADDR as the name and record the address type
-                    midi_client.midi_peripherals[idx].type = 0;
-                    // Need the address type to connect
-                    midi_client.midi_peripherals[idx].addr_type = gap_event_advertising_report_get_address_type(packet);
-                    memcpy(midi_client.midi_peripherals[idx].bdaddr, bdaddr, sizeof(bdaddr));
-                    strncpy(midi_client.midi_peripherals[idx].name, bd_addr_to_str(bdaddr), strlen(bd_addr_to_str(bdaddr))+1);
-                    midi_client.n_midi_peripherals++;
-                }
-                midi_client.midi_peripherals[idx].timeout = scan_remove_timeout; // do not time out this entry
-                get_local_name_from_ad_data(ad_data_len, ad_data, &midi_client.midi_peripherals[idx]);
-                //printf("    * adv. event: addr=%s[%s]\r\n", bd_addr_to_str(bdaddr), midi_client.midi_peripherals[idx].name);
             }
+            else if (midi_client.n_midi_peripherals >= BLEMC_MAX_SCAN_ITEMS ||
+                    !ad_data_contains_uuid128(ad_data_len, ad_data, midi_service_uuid128)) {
+                break;
+            }
+            else {
+                // initialize the map with the BD_ADDR as the name and record the address type
+                midi_client.midi_peripherals[idx].type = 0;
+                // Need the address type to connect
+                midi_client.midi_peripherals[idx].addr_type = gap_event_advertising_report_get_address_type(packet);
+                memcpy(midi_client.midi_peripherals[idx].bdaddr, bdaddr, sizeof(bdaddr));
+                strncpy(midi_client.midi_peripherals[idx].name, bd_addr_to_str(bdaddr), strlen(bd_addr_to_str(bdaddr))+1);
+                midi_client.n_midi_peripherals++;
+                scan_map_insert(&midi_client, idx);
+            }
+            midi_client.midi_peripherals[idx].timeout = scan_remove_timeout; // do not time out this entry
+            get_local_name_from_ad_data(ad_data_len, ad_data, &midi_client.midi_peripherals[idx]);
+            //printf("    * adv. event: addr=%s[%s]\r\n", bd_addr_to_str(bdaddr), midi_client.midi_peripherals[idx].name);
             break;
         case HCI_EVENT_LE_META:
             switch (hci_event_le_meta_get_subevent_code(packet)) {
                 case HCI_SUBEVENT_LE_CONNECTION_COMPLETE:
-                    if (state != BLEMC_WAIT_FOR_CONNECTION) {
+                    if (state != BLEMC_WAIT_FOR_CONNECTION || hci_subevent_le_connection_complete_get_role(packet) != HCI_ROLE_MASTER) {
+                        break;
+                    }
+                    state = BLEMC_IDLE;
+                    if (hci_subevent_le_connection_complete_get_status(packet) != ERROR_CODE_SUCCESS) {
+                        printf("Connection failed, status 0x%02x\n", hci_subevent_le_connection_complete_get_status(packet));
+                        connect_next_from_whitelist();
+                        break;
+                    }
+                    conn = get_free_connection();
+                    if (conn == NULL) {
+                        // should not get here; the client only connects when a context is free
+                        gap_disconnect(hci_subevent_le_connection_complete_get_connection_handle(packet));
                         break;
                     }
                     printf("\nCONNECTED\n");
-                    con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
+                    conn->con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
+                    conn->addr_type = hci_subevent_le_connection_complete_get_peer_address_type(packet);
+                    hci_subevent_le_connection_complete_get_peer_address(packet, conn->addr);
+                    // forget the state of the last connection's streams
+                    ble_midi_pkt_codec_init_data(conn->ble_midi_pkt_codec_data, MAX_BLE_MIDI_PACKET);
+                    ble_midi_pkt_codec_update_mtu(conn->ble_midi_pkt_codec_data, ATT_DEFAULT_MTU - 3);
                     // print connection parameters (without using float operations)
                     conn_interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
                     printf("Connection Interval: %u.%02u ms\n", conn_interval * 125 / 100, 25 * (conn_interval & 3));
                     printf("Connection Latency: %u\n", hci_subevent_le_connection_complete_get_conn_latency(packet));
-                    // initialize gatt client context with handle, and add it to the list of active clients
-                    // query primary services
-                    printf("Search for MIDI service.\n");
-                    err = gatt_client_discover_primary_services_by_uuid128(handle_gatt_client_event, con_handle, midi_service_uuid128);
-                    if (err != ERROR_CODE_SUCCESS)
-                        printf("Error(%d): Failed to discover primary services by uuid128\r\n", err);
-                    state = BLEMC_WAIT_FOR_SERVICES;
-                    midi_service_emit_state(con_handle, true); // pass the connection handle to the client application to this library
+                    // without a bond there is no telling the peer is the device the handles came from
+                    cached = is_bonded(conn->addr_type, conn->addr) ? find_cached_handles(conn->addr_type, conn->addr) : NULL;
+                    if (cached != NULL) {
+                        // a known peripheral; skip the service, characteristic and descriptor discovery round trips
+                        // and write the client characteristic configuration in the first connection event
+                        conn->midi_data_io_characteristic = cached->characteristic;
+                        conn->cccd_handle = cached->cccd_handle;
+                        conn->using_cached_handles = true;
+                        enable_notifications(conn);
+                    }
+                    else {
+                        discover_midi_service(conn);
+                    }
+                    midi_service_emit_state(conn->con_handle, true); // pass the connection handle to the client application to this library
+                    // look for the next peripheral while this one is set up
+                    connect_next_from_whitelist();
                     break;
                 case HCI_SUBEVENT_LE_DATA_LENGTH_CHANGE:
-                    con_handle = hci_subevent_le_data_length_change_get_connection_handle(packet);
-                    midi_service_emit_state(con_handle, true); // pass the connection handle to the client application to this library
-                    printf("- LE Connection 0x%04x: data length change - max %u bytes per packet\n", con_handle,
+                    conn = get_connection(hci_subevent_le_data_length_change_get_connection_handle(packet));
+                    if (conn == NULL)
+                        break;
+                    printf("- LE Connection 0x%04x: data length change - max %u bytes per packet\n", conn->con_handle,
                            hci_subevent_le_data_length_change_get_max_tx_octets(packet));
                     break;
                 case HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE:
-                    con_handle = hci_subevent_le_phy_update_complete_get_connection_handle(packet);
-                    midi_service_emit_state(con_handle, true); // pass the connection handle to the client application to this library
-                    printf("- LE Connection 0x%04x: PHY update - using LE %s PHY now\n", con_handle,
+                    conn = get_connection(hci_subevent_le_phy_update_complete_get_connection_handle(packet));
+                    if (conn == NULL)
+                        break;
+                    printf("- LE Connection 0x%04x: PHY update - using LE %s PHY now\n", conn->con_handle,
                            phy_names[hci_subevent_le_phy_update_complete_get_tx_phy(packet)]);
                     break;
                 default:
@@ -336,20 +677,22 @@ static void handle_hci_event(uint8_t packet_type, uint16_t channel, uint8_t *pac
             }
             break;
         case HCI_EVENT_DISCONNECTION_COMPLETE:
-            printf("\nDISCONNECTED\n");
-            if (listener_registered) {
-                listener_registered = false;
-                gatt_client_stop_listening_for_characteristic_value_updates(&notification_listener);
-            }
-            if (state == BLEMC_WAIT_FOR_CONNECTION) // then disconnected from previous to connect to next
-                gap_connect(next_connect_bd_addr, next_connect_bd_addr_type);
-            else {
-                state = BLEMC_IDLE;
-                midi_client.n_midi_peripherals = 0;
-            }
-            midi_service_emit_state(con_handle, false); // pass the connection handle to the client application to this library
-            cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, false);
-
+            conn = get_connection(hci_event_disconnection_complete_get_connection_handle(packet));
+            if (conn == NULL)
+                break;
+            printf("\nDISCONNECTED from %s\n", bd_addr_to_str(conn->addr));
+            cached = find_cached_handles(conn->addr_type, conn->addr);
+            if (cached != NULL && !is_bonded(conn->addr_type, conn->addr))
+                forget_cached_handles(cached);
+            stop_listening(conn);
+            stop_coalesce_timer(conn);
+            ble_midi_pkt_codec_release_data(conn->ble_midi_pkt_codec_data);
+            midi_service_emit_state(conn->con_handle, false); // pass the connection handle to the client application to this library
+            conn->con_handle = HCI_CON_HANDLE_INVALID;
+            if (get_num_ready_connections() == 0)
+                cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, false);
+            if (state != BLEMC_DEINIT)
+                connect_next_from_whitelist();
             break;
 
         default:
@@ -362,10 +705,14 @@ static void sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *pa
     UNUSED(size);
 
     if (packet_type != HCI_EVENT_PACKET) return;
+    // every SM event starts with the connection handle; links where this
+    // device is the peripheral belong to the BLE-MIDI server
+    if (gap_get_role(little_endian_read_16(packet, 2)) != HCI_ROLE_MASTER) return;
 
     bd_addr_t addr;
     bd_addr_type_t addr_type;
     uint16_t idx;
+    handle_cache_entry_t* cached;
 
     switch (hci_event_packet_get_type(packet)) {
         case SM_EVENT_IDENTITY_RESOLVING_STARTED:
@@ -397,6 +744,11 @@ static void sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *pa
             switch (sm_event_pairing_complete_get_status(packet)){
                 case ERROR_CODE_SUCCESS:
                     printf("Pairing complete, success\n");
+                    // the handles may have been discovered before the peripheral was bonded
+                    sm_event_pairing_complete_get_address(packet, addr);
+                    cached = find_cached_handles(sm_event_pairing_complete_get_addr_type(packet), addr);
+                    if (cached != NULL)
+                        store_cached_handles(cached);
                     break;
                 case ERROR_CODE_CONNECTION_TIMEOUT:
                     printf("Pairing failed, timeout\n");
@@ -455,11 +807,26 @@ static void exit_client_mode()
 {
     if (ble_midi_client_is_connected())
         ble_midi_client_request_disconnect();
+    if (dual_role) {
+        // the rest of the stack belongs to the server
+        ble_midi_client_auto_connect_end();
+        ble_midi_client_scan_end();
+        hci_remove_event_handler(&hci_event_callback_registration);
+        sm_remove_event_handler(&sm_event_callback_registration);
+        state = BLEMC_DEINIT;
+        for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+            stop_listening(connections + idx);
+            stop_coalesce_timer(connections + idx);
+            connections[idx].con_handle = HCI_CON_HANDLE_INVALID;
+        }
+        return;
+    }
     hci_power_control(HCI_POWER_OFF);
     hci_remove_event_handler(&hci_event_callback_registration);
     sm_remove_event_handler(&sm_event_callback_registration);
     ble_midi_client_scan_end();
 
+    ble_midi_ecc_deinit();
     sm_deinit();
     btstack_crypto_deinit();
     l2cap_deinit();
@@ -468,7 +835,11 @@ static void exit_client_mode()
         client_profile_data = NULL;
     }
     state = BLEMC_DEINIT;
-    con_handle = HCI_CON_HANDLE_INVALID;
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        stop_listening(connections + idx);
+        stop_coalesce_timer(connections + idx);
+        connections[idx].con_handle = HCI_CON_HANDLE_INVALID;
+    }
 }
 
 static void enter_client_mode()
@@ -478,10 +849,8 @@ static void enter_client_mode()
         // make sure scan is stopped
         if (state == BLEMC_WAIT_FOR_SCAN_COMPLETE)
             ble_midi_client_scan_end();
-        else if (con_handle != HCI_CON_HANDLE_INVALID) {
-            state = BLEMC_WAIT_FOR_DISCONNECTION;
-            gap_disconnect(con_handle);
-        }
+        else
+            ble_midi_client_request_disconnect();
         return;
     }
 
@@ -491,14 +860,25 @@ static void enter_client_mode()
     // security manager event processing
     sm_event_callback_registration.callback = &sm_packet_handler;
     sm_add_event_handler(&sm_event_callback_registration);
+    if (dual_role) {
+        // the server set up the GATT client with MTU auto negotiation off
+        load_cached_handles();
+        gap_set_connection_parameters(96, BLE_MIDI_CLIENT_DUAL_ROLE_SCAN_WINDOW,
+            BLE_MIDI_CLIENT_DUAL_ROLE_CONN_INTERVAL, BLE_MIDI_CLIENT_DUAL_ROLE_CONN_INTERVAL, 4, 1000,
+            0, BLE_MIDI_CLIENT_DUAL_ROLE_CE_LEN_MAX);
+        return;
+    }
     // Initialize L2CAP and register HCI event handler
     l2cap_init();
     // set up attribute server in case the device queries the client's name
     att_server_init(client_profile_data, NULL, NULL); 
-    // Set up security manager
+    // Set up security manager; core 1 generates its P-256 keypair
+    ble_midi_ecc_init();
     sm_init();
-    // Initialize GATT client
+    // Initialize GATT client; exchange the MTU only after notifications are on
     gatt_client_init();
+    gatt_client_mtu_enable_auto_negotiation(0);
+    load_cached_handles();
     // register for HCI events
     sm_set_io_capabilities(iocaps);
     sm_set_authentication_requirements(secmask);
@@ -507,11 +887,28 @@ static void enter_client_mode()
     gap_set_connection_parameters(96, 48, 6, 12, 4, 1000, 0x01, 6 * 2);
 }
 
+static void coalesce_timeout(btstack_timer_source_t* ts);
+
+static void init_connections()
+{
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        ble_midi_client_connection_t* conn = connections + idx;
+        conn->con_handle = HCI_CON_HANDLE_INVALID;
+        conn->listener_registered = false;
+        btstack_run_loop_set_timer_handler(&conn->coalesce_timer, coalesce_timeout);
+        btstack_run_loop_set_timer_context(&conn->coalesce_timer, conn);
+        conn->coalesce_timer_active = false;
+        // the client's codec contexts follow the server's
+        conn->ble_midi_pkt_codec_data = ble_midi_pkt_codec_get_data_by_index(BLE_MIDI_SERVER_MAX_CONNECTIONS + idx);
+        ble_midi_pkt_codec_init_data(conn->ble_midi_pkt_codec_data, MAX_BLE_MIDI_PACKET);
+    }
+}
+
 void ble_midi_client_init(const char* profile_name, uint8_t profile_name_len, io_capability_t iocaps_, uint8_t secmask_)
 {
     //client_application_packet_handler = packet_handler;
-    ble_midi_pkt_codec_data = ble_midi_pkt_codec_get_data_by_index(0);
-    ble_midi_pkt_codec_init_data(ble_midi_pkt_codec_data, MAX_BLE_MIDI_PACKET);
+    dual_role = false;
+    init_connections();
     const uint8_t base_profile_data[] =
     {
         // ATT DB Version
@@ -532,7 +929,6 @@ void ble_midi_client_init(const char* profile_name, uint8_t profile_name_len, io
     // 13 value characteristic-gap device name bytes+
     // 8 characteristic value header bytes + 2 zero termination bytes
     client_profile_data = malloc(34+profile_name_len);
-    con_handle = HCI_CON_HANDLE_INVALID;
 
     if (client_profile_data != NULL) {
         memcpy(client_profile_data, base_profile_data, sizeof(base_profile_data));
@@ -546,6 +942,18 @@ void ble_midi_client_init(const char* profile_name, uint8_t profile_name_len, io
     }
 }
 
+void ble_midi_client_init_dual_role()
+{
+    if (dual_role && state != BLEMC_DEINIT)
+        return; // already running
+    dual_role = true;
+    init_connections();
+    enter_client_mode();
+    // The server turns the Bluetooth chip on. BTstack holds a scan or
+    // connection the client starts before then until the stack is working.
+    state = BLEMC_IDLE;
+}
+
 void ble_midi_client_deinit()
 {
     exit_client_mode();
@@ -564,7 +972,7 @@ void ble_midi_client_scan_begin()
     if (turn_on)
         hci_power_control(HCI_POWER_ON); // active scan will start when power on event happens
     else {
-        midi_client.n_midi_peripherals = 0;
+        clear_midi_peripherals(&midi_client);
         printf("BTstack activated, start active scanning\n");
         gap_set_scan_params(1,0x0030, 0x0030,0);        
         gap_start_scan();
@@ -609,6 +1017,13 @@ bool ble_midi_client_request_connect(uint8_t idx)
         next_connect_bd_addr_type = midi_client.midi_peripherals[idx].addr_type;
         memcpy(next_connect_bd_addr, midi_client.midi_peripherals[idx].bdaddr, sizeof(next_connect_bd_addr));
     }
+    if (get_free_connection() == NULL)
+        return false; // connected to as many peripherals as the client can handle
+    for (uint8_t conn_idx = 0; conn_idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; conn_idx++) {
+        if (connections[conn_idx].con_handle != HCI_CON_HANDLE_INVALID &&
+                bd_addr_cmp(connections[conn_idx].addr, next_connect_bd_addr) == 0)
+            return false; // already connected
+    }
     switch(state) {
         case BLEMC_DEINIT:
             enter_client_mode();
@@ -620,31 +1035,13 @@ bool ble_midi_client_request_connect(uint8_t idx)
             state = BLEMC_WAIT_FOR_CONNECTION;
             gap_connect(next_connect_bd_addr, next_connect_bd_addr_type);
             break;
-        case BLEMC_WAIT_FOR_DISCONNECTION:
-        case BLEMC_WAIT_FOR_SERVICES:
-        case BLEMC_WAIT_FOR_CHARACTERISTICS:
-        case BLEMC_WAIT_FOR_ENABLE_NOTIFICATIONS_COMPLETE:
-        case BLEMC_WAIT_FOR_MIDI_DATA_RX:
-            if (con_handle == HCI_CON_HANDLE_INVALID)
-                return false; // does not make sense
-            state = BLEMC_WAIT_FOR_CONNECTION;
-            gap_disconnect(con_handle);
-            break;
-        case BLEMC_WAIT_FOR_CONNECTION:
-            if (con_handle != HCI_CON_HANDLE_INVALID) {
-                return false; // does not make sense
-            }
-            state = BLEMC_WAIT_FOR_CONNECTION;
-            gap_connect(next_connect_bd_addr, next_connect_bd_addr_type);
-            break;
         case BLEMC_WAIT_FOR_SCAN_COMPLETE:
-            if (con_handle != HCI_CON_HANDLE_INVALID) {
-                return false; // does not make sense
-            }
-            gap_stop_scan();
+            ble_midi_client_scan_end();
             state = BLEMC_WAIT_FOR_CONNECTION;
             gap_connect(next_connect_bd_addr, next_connect_bd_addr_type);
             break;
+        case BLEMC_WAIT_FOR_CONNECTION:
+            return false; // one connection at a time
         default:
             return false; // should not get here
             break;
@@ -655,63 +1052,206 @@ bool ble_midi_client_request_connect(uint8_t idx)
 
 void ble_midi_client_request_disconnect()
 {
-    if (state > BLEMC_WAIT_FOR_SCAN_COMPLETE && ble_midi_client_is_connected()) {
-        state = BLEMC_WAIT_FOR_DISCONNECTION;
-        gap_disconnect(con_handle);
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        ble_midi_client_connection_t* conn = connections + idx;
+        if (conn->con_handle != HCI_CON_HANDLE_INVALID && conn->state != BLEMC_WAIT_FOR_DISCONNECTION) {
+            conn->state = BLEMC_WAIT_FOR_DISCONNECTION;
+            gap_disconnect(conn->con_handle);
+        }
     }
 }
 
+static void request_write_without_response(ble_midi_client_connection_t* conn);
+
 static void handle_can_write_without_response(void * context)
 {
-    (void)context;
+    ble_midi_client_connection_t* conn = (ble_midi_client_connection_t*)context;
+    if (conn->con_handle == HCI_CON_HANDLE_INVALID)
+        return; // disconnected since the request
     ble_midi_packet_t pkt;
-    if (ble_midi_pkt_codec_ble_pkt_pop(&pkt, ble_midi_pkt_codec_data))
-        gatt_client_write_value_of_characteristic_without_response(con_handle, midi_data_io_characteristic.value_handle, pkt.nbytes, pkt.pkt);
+    uint32_t wait_us;
+    uint8_t nsent = 0;
+    ble_midi_pkt_codec_flush_coalesced(conn->ble_midi_pkt_codec_data, &wait_us);
+    // The callback may always send one packet. Send more while the controller
+    // has ACL buffers free so they all go out in the next connection event.
+    while (nsent < BLE_MIDI_CLIENT_MAX_BURST &&
+            (nsent == 0 || att_dispatch_client_can_send_now(conn->con_handle)) &&
+            ble_midi_pkt_codec_ble_pkt_pop(&pkt, conn->ble_midi_pkt_codec_data) == sizeof(pkt)) {
+        gatt_client_write_value_of_characteristic_without_response(conn->con_handle, conn->midi_data_io_characteristic.value_handle, pkt.nbytes, pkt.pkt);
+        ++nsent;
+    }
     // ready next packet to send if there is one buffered
-    if (ble_midi_pkt_codec_ble_pkt_available(ble_midi_pkt_codec_data)) {
-        write_callback_registration.callback = handle_can_write_without_response;
-        write_callback_registration.context = NULL;
-
-        gatt_client_request_to_write_without_response(&write_callback_registration, con_handle);
+    if (ble_midi_pkt_codec_ble_pkt_available(conn->ble_midi_pkt_codec_data)) {
+        request_write_without_response(conn);
+    }
+    else if (wait_us > 0 && !conn->coalesce_timer_active) {
+        // A packet is still collecting messages
+        btstack_run_loop_set_timer(&conn->coalesce_timer, ble_midi_pkt_codec_coalesce_timeout_ms(wait_us));
+        btstack_run_loop_add_timer(&conn->coalesce_timer);
+        conn->coalesce_timer_active = true;
     }
 }
 
+static void request_write_without_response(ble_midi_client_connection_t* conn)
+{
+    conn->write_callback_registration.callback = handle_can_write_without_response;
+    conn->write_callback_registration.context = conn;
+    gatt_client_request_to_write_without_response(&conn->write_callback_registration, conn->con_handle);
+}
 
-uint8_t ble_midi_client_stream_write(uint8_t nbytes, const uint8_t* midi_stream_bytes)
+static void coalesce_timeout(btstack_timer_source_t* ts)
 {
-    uint8_t bytes_written = 0;
-    bool ready_to_send = false;
-    bytes_written = ble_midi_pkt_codec_push_midi(midi_stream_bytes, nbytes, ble_midi_pkt_codec_data, &ready_to_send);
-    if (bytes_written > 0) {
-        if (ready_to_send) {
-            write_callback_registration.callback = handle_can_write_without_response;
-            write_callback_registration.context = NULL;
+    ble_midi_client_connection_t* conn = (ble_midi_client_connection_t*)btstack_run_loop_get_timer_context(ts);
+    conn->coalesce_timer_active = false;
+    if (conn->con_handle != HCI_CON_HANDLE_INVALID)
+        request_write_without_response(conn);
+}
 
-            gatt_client_request_to_write_without_response(&write_callback_registration, con_handle);
-        }
 
+uint8_t ble_midi_client_stream_write(uint8_t nbytes, const uint8_t* midi_stream_bytes)
+{
+    // check every server has room first so the stream goes to all of them or none
+    bool connected = false;
+    uint16_t nborrow = 0;
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        ble_midi_client_connection_t* conn = connections + idx;
+        if (conn->con_handle == HCI_CON_HANDLE_INVALID || conn->state != BLEMC_WAIT_FOR_MIDI_DATA_RX)
+            continue;
+        int cost = ble_midi_pkt_codec_get_push_midi_cost(conn->ble_midi_pkt_codec_data, nbytes);
+        if (cost < 0)
+            return 0;
+        connected = true;
+        nborrow += cost;
+    }
+    if (!connected || nborrow > ble_midi_block_pool_get_num_lendable())
+        return 0;
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        ble_midi_client_connection_t* conn = connections + idx;
+        if (conn->con_handle == HCI_CON_HANDLE_INVALID || conn->state != BLEMC_WAIT_FOR_MIDI_DATA_RX)
+            continue;
+        bool ready_to_send = false;
+        uint8_t bytes_written = ble_midi_pkt_codec_push_midi(midi_stream_bytes, nbytes, conn->ble_midi_pkt_codec_data, &ready_to_send);
+        if (bytes_written > 0 && ready_to_send && !conn->coalesce_timer_active) {
+            // messages written until the callback join the packet that is collecting them
+            request_write_without_response(conn);
+        }
     }
-    return bytes_written;
+    return nbytes;
 }
 
 uint8_t ble_midi_client_stream_read(uint8_t max_bytes, uint8_t* midi_stream_bytes, uint16_t* timestamp)
 {
-    ble_midi_message_t mes;
-    uint8_t nread = 0;
-    uint8_t nbytes = ble_midi_pkt_codec_pop_midi(&mes, ble_midi_pkt_codec_data);
-    if (nbytes == sizeof(mes)) {
-        uint8_t bytecount = mes.nbytes & ble_midi_packet_nbytes_mask;
-        if (bytecount <= max_bytes) {
-            *timestamp = mes.timestamp_ms;
-            memcpy(midi_stream_bytes, mes.msg_bytes, bytecount);
-            nread = bytecount;
+    // take turns so a busy peripheral cannot starve the others
+    for (uint8_t count = 0; count < BLE_MIDI_CLIENT_MAX_CONNECTIONS; count++) {
+        ble_midi_client_connection_t* conn = connections + next_read_idx;
+        if (++next_read_idx >= BLE_MIDI_CLIENT_MAX_CONNECTIONS)
+            next_read_idx = 0;
+        if (conn->con_handle == HCI_CON_HANDLE_INVALID)
+            continue;
+        ble_midi_message_t mes;
+        uint8_t nbytes = ble_midi_pkt_codec_pop_midi(&mes, conn->ble_midi_pkt_codec_data);
+        if (nbytes == sizeof(mes)) {
+            uint8_t bytecount = mes.nbytes & ble_midi_packet_nbytes_mask;
+            if (bytecount <= max_bytes) {
+                if (timestamp != NULL)
+                    *timestamp = mes.timestamp_ms;
+                memcpy(midi_stream_bytes, mes.msg_bytes, bytecount);
+                return bytecount;
+            }
         }
     }
-
-    return nread;
+    return 0;
 }
 
 bool ble_midi_client_is_connected(void)
 {
-    return con_handle != HCI_CON_HANDLE_INVALID;
-}
\ No newline at end of file
+    return ble_midi_client_get_num_connections() > 0;
+}
+
+uint8_t ble_midi_client_get_num_connections()
+{
+    return get_num_ready_connections();
+}
+
+int ble_midi_client_get_connection_index(hci_con_handle_t con_handle)
+{
+    ble_midi_client_connection_t* conn = get_connection(con_handle);
+    return conn != NULL ? conn - connections : -1;
+}
+
+// ble_midi_pkt_codec_message_cb_t that adds the connection handle and calls the application's callback
+static void deliver_message(const ble_midi_message_t* mes, void* cb_context)
+{
+    client_message_cb(((ble_midi_client_connection_t*)cb_context)->con_handle, mes);
+}
+
+// ble_midi_pkt_codec_sysex_cb_t that adds the connection handle and calls the application's callback
+static void deliver_sysex(const uint8_t* sysex, uint16_t nbytes, bool complete, void* cb_context)
+{
+    client_sysex_cb(((ble_midi_client_connection_t*)cb_context)->con_handle, sysex, nbytes, complete);
+}
+
+void ble_midi_client_set_coalesce_window(uint32_t window_us)
+{
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        ble_midi_pkt_codec_set_coalesce_window(connections[idx].ble_midi_pkt_codec_data, window_us);
+    }
+}
+
+void ble_midi_client_set_message_callback(ble_midi_client_message_cb_t message_cb)
+{
+    client_message_cb = message_cb;
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        ble_midi_pkt_codec_set_message_callback(connections[idx].ble_midi_pkt_codec_data,
+            message_cb ? deliver_message : NULL, connections + idx);
+    }
+}
+
+void ble_midi_client_set_sysex_callback(ble_midi_client_sysex_cb_t sysex_cb)
+{
+    client_sysex_cb = sysex_cb;
+    for (uint8_t idx = 0; idx < BLE_MIDI_CLIENT_MAX_CONNECTIONS; idx++) {
+        ble_midi_pkt_codec_set_sysex_callback(connections[idx].ble_midi_pkt_codec_data,
+            sysex_cb ? deliver_sysex : NULL, connections + idx);
+    }
+}
+
+bool ble_midi_client_whitelist_add(bd_addr_type_t addr_type, const bd_addr_t addr)
+{
+    return gap_whitelist_add(addr_type, addr) == ERROR_CODE_SUCCESS;
+}
+
+void ble_midi_client_auto_connect_begin()
+{
+    if (auto_connect)
+        return;
+    auto_connect = true;
+    switch (state) {
+        case BLEMC_DEINIT:
+            // connecting starts when the power on event happens
+            enter_client_mode();
+            state = BLEMC_WAIT_FOR_CONNECTION;
+            hci_power_control(HCI_POWER_ON);
+            break;
+        case BLEMC_WAIT_FOR_SCAN_COMPLETE:
+            ble_midi_client_scan_end();
+            // fall through
+        case BLEMC_IDLE:
+            connect_next_from_whitelist();
+            break;
+        default:
+            // connecting; the next connection starts when this one completes
+            break;
+    }
+}
+
+void ble_midi_client_auto_connect_end()
+{
+    if (!auto_connect)
+        return;
+    auto_connect = false;
+    if (state == BLEMC_WAIT_FOR_CONNECTION) {
+        gap_connect_cancel();
+        state = BLEMC_IDLE;
+    }
+}
@@ -75,11 +75,69 @@
 #include <stdint.h>
 #include "bluetooth.h"
 #include "btstack_defines.h"
+#include "ble_midi_pkt_codec.h"
+#include "ble_midi_block_pool.h" // for BLE_MIDI_CLIENT_MAX_CONNECTIONS
 
 #if defined __cplusplus
 extern "C" {
 #endif
 
+// Number of peripherals whose MIDI characteristic handles the client
+// remembers, so reconnecting to one of them skips GATT discovery. The
+// handles of bonded peripherals are also kept in the BTstack TLV flash
+// bank, so they survive a power cycle.
+#ifndef BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE
+#define BLE_MIDI_CLIENT_HANDLE_CACHE_SIZE 4
+#endif
+
+// The most writes without response one connection sends per can write
+// callback. By default, as many as the controller has ACL buffers for.
+#ifndef BLE_MIDI_CLIENT_MAX_BURST
+#ifdef MAX_NR_CONTROLLER_ACL_BUFFERS
+#define BLE_MIDI_CLIENT_MAX_BURST MAX_NR_CONTROLLER_ACL_BUFFERS
+#else
+#define BLE_MIDI_CLIENT_MAX_BURST 1
+#endif
+#endif
+
+// Connection parameters the client asks for after ble_midi_client_init_dual_role(),
+// when the controller also keeps the server's links to centrals. A 15 ms
+// interval (units of 1.25 ms) lines up with the 7.5, 15, 30 and 45 ms
+// intervals a central picks for the server, and a connection event of at most
+// 2.5 ms (units of 0.625 ms) leaves the rest of each interval to them, so the
+// controller does not have to skip either role's events.
+#ifndef BLE_MIDI_CLIENT_DUAL_ROLE_CONN_INTERVAL
+#define BLE_MIDI_CLIENT_DUAL_ROLE_CONN_INTERVAL 12
+#endif
+#ifndef BLE_MIDI_CLIENT_DUAL_ROLE_CE_LEN_MAX
+#define BLE_MIDI_CLIENT_DUAL_ROLE_CE_LEN_MAX 4
+#endif
+// While waiting for a peripheral to advertise, scan 15 ms of every 60 ms
+// (units of 0.625 ms) instead of half the time
+#ifndef BLE_MIDI_CLIENT_DUAL_ROLE_SCAN_WINDOW
+#define BLE_MIDI_CLIENT_DUAL_ROLE_SCAN_WINDOW 24
+#endif
+
+/**
+ * @brief the function the client calls with each decoded MIDI message
+ * when a message callback is registered with ble_midi_client_set_message_callback()
+ *
+ * @param con_handle the connection the message arrived on
+ * @param mes the decoded message; it is only valid for the duration of the call
+ */
+typedef void (*ble_midi_client_message_cb_t)(hci_con_handle_t con_handle, const ble_midi_message_t* mes);
+
+/**
+ * @brief the function the client calls with each run of system exclusive bytes
+ * when a sysex callback is registered with ble_midi_client_set_sysex_callback()
+ *
+ * @param con_handle the connection the bytes arrived on
+ * @param sysex the bytes; they are only valid for the duration of the call
+ * @param nbytes the number of bytes in sysex
+ * @param complete true if sysex ends with the 0xF7 that ends the message
+ */
+typedef void (*ble_midi_client_sysex_cb_t)(hci_con_handle_t con_handle, const uint8_t* sysex, uint16_t nbytes, bool complete);
+
 /* API_START */
 
 /**
@@ -90,6 +148,21 @@ extern "C" {
  */
 void ble_midi_client_init(const char* profile_name, uint8_t profile_name_len, io_capability_t iocaps, uint8_t secmask);
 
+/**
+ * @brief Initialize the BLE-MIDI client to run next to the BLE-MIDI server
+ *
+ * Call after ble_midi_server_init(). The client uses the L2CAP, security
+ * manager, ATT server and GATT client the server set up, including the
+ * server's profile and security settings, and leaves the Bluetooth chip
+ * power to the server. The device is then a peripheral to the centrals that
+ * connect to it and a central to the peripherals the client connects to.
+ * Each library only handles the security manager events of its own links.
+ *
+ * ble_midi_server_deinit() stops both. After ble_midi_client_deinit(), call
+ * this function again before using the client.
+ */
+void ble_midi_client_init_dual_role();
+
 /**
  * @brief de-initialize the BLE-MIDI client in preparation to switching to server mode
  *
@@ -117,30 +190,68 @@ void ble_midi_client_dump_midi_peripherals();
 /**
  * @brief request connection to a device discovered during the scan
  *
+ * The client stays connected to the peripherals it is already connected to.
+ * Up to BLE_MIDI_CLIENT_MAX_CONNECTIONS peripherals may be connected at once.
+ *
  * @param idx the index number of the device as displayed by ble_midi_client_dump_midi_peripherals()
  * @return true if the connection request is successful
- * @return false if the device was never discovered or the connection request failed immediately.
+ * @return false if the device was never discovered, is already connected, the
+ * client is connecting to another device or has no room for another connection,
+ * or the connection request failed immediately.
  */
 bool ble_midi_client_request_connect(uint8_t idx);
 
 /**
- * @brief If already connected, disconnect from the connected server.
+ * @brief add a peripheral to the ones ble_midi_client_auto_connect_begin() connects to
+ *
+ * The controller matches the address the peripheral advertises with, so
+ * peripherals that advertise with a resolvable private address are not found.
+ *
+ * @param addr_type the address type, BD_ADDR_TYPE_LE_PUBLIC or BD_ADDR_TYPE_LE_RANDOM
+ * @param addr the peripheral's address
+ * @return true if the peripheral was added; false if the controller's white list is full
+ */
+bool ble_midi_client_whitelist_add(bd_addr_type_t addr_type, const bd_addr_t addr);
+
+/**
+ * @brief connect to each white listed peripheral that advertises, up to
+ * BLE_MIDI_CLIENT_MAX_CONNECTIONS of them, and connect again each time a
+ * connection is lost
+ *
+ * The controller does the scanning, so the BTstack context sees no
+ * advertising reports. Call after ble_midi_client_init(); it turns on the
+ * Bluetooth chip if necessary.
+ */
+void ble_midi_client_auto_connect_begin();
+
+/**
+ * @brief stop connecting to white listed peripherals
+ *
+ * An existing connection stays up.
+ */
+void ble_midi_client_auto_connect_end();
+
+/**
+ * @brief disconnect from every connected server
  *
  * This function returns before the disconnection is complete.
  */
 void ble_midi_client_request_disconnect();
 
 /**
- * @brief write a MIDI 1.0 byte stream nbytes long
+ * @brief write a MIDI 1.0 byte stream nbytes long to every connected server
  *
  * The MIDI byte stream will be timestamped with the time the stream
  * is writen and will be sent when the MIDI service allows it. The
  * stream may not use running status. However, Bluetooth MIDI packets
  * will be encoded with running status if it is possible to do so.
- * 
+ * The stream is queued for every server or for none, so no server gets
+ * bytes twice if the caller writes the stream again.
+ *
  * @param nbytes the number of bytes in the MIDI byte stream
  * @param midi_stream_bytes a pointer to the MIDI 1.0 byte stream storage
- * @return uint8_t the number of bytes successfully written
+ * @return nbytes, or 0 if no server is connected or a server's queue does
+ * not have room for the stream
  */
 uint8_t ble_midi_client_stream_write(uint8_t nbytes, const uint8_t* midi_stream_bytes);
 
@@ -149,11 +260,12 @@ uint8_t ble_midi_client_stream_write(uint8_t nbytes, const uint8_t* midi_stream_
  *
  * The application that calls this function should call it in a loop until
  * the function returns 0 (no more timestamped byte streams available to read)
+ * Each call reads from the next connection that has data, so every connected
+ * server gets a turn.
  *
  * This function removes any Bluetooth MIDI running status from the byte stream
  * to simplify parsing for the application that calls this function
  *
- * @param con_handle the HCI connection handle for the connection providing the MIDI stream
  * @param max_bytes The length of the midi_stream_bytes array
  * @param midi_stream_bytes a pointer to the MIDI 1.0 formatted byte stream storage
  * @param timestamp a pointer to the MIDI byte stream message timestamp. If this
@@ -169,6 +281,55 @@ uint8_t ble_midi_client_stream_read(uint8_t max_bytes, uint8_t* midi_stream_byte
  * @return true if the client is connected to a server, false otherwise
  */
 bool ble_midi_client_is_connected(void);
+
+/**
+ * @brief get the number of connected servers
+ *
+ * @return the number of servers with MIDI notifications enabled
+ */
+uint8_t ble_midi_client_get_num_connections();
+
+/**
+ * @brief get a small number that identifies a connected server
+ *
+ * @param con_handle the connection handle passed to the message and SysEx callbacks
+ * @return the index, from 0 to BLE_MIDI_CLIENT_MAX_CONNECTIONS - 1, or -1
+ * if con_handle is not one of the client's connections
+ */
+int ble_midi_client_get_connection_index(hci_con_handle_t con_handle);
+
+/**
+ * @brief collect the messages written within a time window into one packet
+ *
+ * By default, each ble_midi_client_stream_write() makes at least one packet.
+ * With a window, messages written close together, e.g. while forwarding a
+ * chord, share a write without response. Keep the window shorter than the
+ * connection interval so it does not delay a packet past the connection
+ * event it could have gone out in.
+ *
+ * @param window_us the window in microseconds, measured from the first message
+ * in the packet, or 0 to finish every packet right away
+ */
+void ble_midi_client_set_coalesce_window(uint32_t window_us);
+
+/**
+ * @brief deliver each MIDI message to a callback as soon as it is decoded
+ *
+ * The callback runs in the BTstack context and ble_midi_client_stream_read()
+ * returns nothing while a callback is registered.
+ *
+ * @param message_cb the callback function, or NULL to go back to buffering
+ */
+void ble_midi_client_set_message_callback(ble_midi_client_message_cb_t message_cb);
+
+/**
+ * @brief pass each run of system exclusive bytes to a callback as soon as it is decoded
+ *
+ * The callback runs in the BTstack context.
+ *
+ * @param sysex_cb the callback function, or NULL to go back to message fragments
+ */
+void ble_midi_client_set_sysex_callback(ble_midi_client_sysex_cb_t sysex_cb);
 #if defined __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+/******************************************************************************
+ * @file ble_midi_clock_sync.c
+ *
+ * @brief Map a BLE-MIDI sender's 13-bit millisecond timestamps to local time
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include "pico/stdlib.h"
+#include "ble_midi_clock_sync.h"
+
+// BLE-MIDI timestamps count milliseconds modulo 2^13
+#define BLE_MIDI_TIMESTAMP_PERIOD_MS 8192
+#define BLE_MIDI_TIMESTAMP_MASK (BLE_MIDI_TIMESTAMP_PERIOD_MS - 1)
+
+// 1000 local microseconds per sender millisecond
+#define BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16 (1000 << 16)
+// Clamp the slope to +/-500 ppm; crystals are much better than that, so a
+// steeper slope is latency jitter over a short span
+#define BLE_MIDI_CLOCK_SYNC_MAX_SLOPE_ERROR_Q16 (BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16 / 2000)
+// Samples spanning less time than this use the nominal slope
+#define BLE_MIDI_CLOCK_SYNC_MIN_FIT_SPAN_MS 8000
+// An interval with fewer packets than this, e.g. one cut short by an idle gap,
+// gives a sample only if the sample is not later than the fit predicts
+#define BLE_MIDI_CLOCK_SYNC_MIN_INTERVAL_PACKETS 16
+
+static int64_t ble_midi_clock_sync_floor_div(int64_t num, int64_t den)
+{
+    int64_t quot = num / den;
+    if ((num % den) != 0 && (num < 0) != (den < 0))
+        --quot;
+    return quot;
+}
+
+// Return timestamp - reference as a signed difference of two 13-bit timestamps
+static int16_t ble_midi_clock_sync_timestamp_diff(uint16_t timestamp, uint16_t reference)
+{
+    int16_t diff = (timestamp - reference) & BLE_MIDI_TIMESTAMP_MASK;
+    if (diff >= BLE_MIDI_TIMESTAMP_PERIOD_MS / 2)
+        diff -= BLE_MIDI_TIMESTAMP_PERIOD_MS;
+    return diff;
+}
+
+static uint8_t ble_midi_clock_sync_sample_idx(const ble_midi_clock_sync_t* sync, uint8_t age)
+{
+    return (sync->newest_idx + BLE_MIDI_CLOCK_SYNC_NSAMPLES - age) % BLE_MIDI_CLOCK_SYNC_NSAMPLES;
+}
+
+static int64_t ble_midi_clock_sync_predict_us(const ble_midi_clock_sync_t* sync, int64_t sender_ms)
+{
+    return sync->fit_local_us + (((sender_ms - sync->fit_sender_ms) * sync->slope_q16) >> 16);
+}
+
+// Least squares fit of arrival time against sender time. The sums are taken
+// relative to the newest sample and then to the means to keep them small.
+static void ble_midi_clock_sync_fit(ble_midi_clock_sync_t* sync)
+{
+    int64_t x0 = sync->sender_ms[sync->newest_idx];
+    int64_t y0 = sync->arrival_us[sync->newest_idx];
+    int64_t sum_x = 0, sum_y = 0;
+    for (uint8_t age = 0; age < sync->nsamples; age++) {
+        uint8_t idx = ble_midi_clock_sync_sample_idx(sync, age);
+        sum_x += sync->sender_ms[idx] - x0;
+        sum_y += sync->arrival_us[idx] - y0;
+    }
+    int64_t mean_x = sum_x / sync->nsamples;
+    int64_t mean_y = sum_y / sync->nsamples;
+    int64_t sum_xx = 0, sum_xy = 0;
+    for (uint8_t age = 0; age < sync->nsamples; age++) {
+        uint8_t idx = ble_midi_clock_sync_sample_idx(sync, age);
+        int64_t dx = sync->sender_ms[idx] - x0 - mean_x;
+        int64_t dy = sync->arrival_us[idx] - y0 - mean_y;
+        sum_xx += dx * dx;
+        sum_xy += dx * dy;
+    }
+    sync->fit_sender_ms = x0 + mean_x;
+    sync->fit_local_us = y0 + mean_y;
+    sync->slope_q16 = BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16;
+    int64_t span_ms = x0 - sync->sender_ms[ble_midi_clock_sync_sample_idx(sync, sync->nsamples - 1)];
+    if (span_ms >= BLE_MIDI_CLOCK_SYNC_MIN_FIT_SPAN_MS && sum_xx > 0) {
+        int64_t slope = (sum_xy * 65536) / sum_xx;
+        if (slope > BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16 + BLE_MIDI_CLOCK_SYNC_MAX_SLOPE_ERROR_Q16)
+            slope = BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16 + BLE_MIDI_CLOCK_SYNC_MAX_SLOPE_ERROR_Q16;
+        else if (slope < BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16 - BLE_MIDI_CLOCK_SYNC_MAX_SLOPE_ERROR_Q16)
+            slope = BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16 - BLE_MIDI_CLOCK_SYNC_MAX_SLOPE_ERROR_Q16;
+        sync->slope_q16 = (int32_t)slope;
+    }
+}
+
+void ble_midi_clock_sync_init(ble_midi_clock_sync_t* sync)
+{
+    sync->nsamples = 0;
+    sync->newest_idx = 0;
+    sync->have_candidate = false;
+    sync->have_last = false;
+    sync->fit_sender_ms = 0;
+    sync->fit_local_us = 0;
+    sync->slope_q16 = BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16;
+}
+
+static void ble_midi_clock_sync_add_sample(ble_midi_clock_sync_t* sync, int64_t sender_ms, int64_t arrival_us)
+{
+    if (sync->nsamples > 0)
+        sync->newest_idx = (sync->newest_idx + 1) % BLE_MIDI_CLOCK_SYNC_NSAMPLES;
+    sync->sender_ms[sync->newest_idx] = sender_ms;
+    sync->arrival_us[sync->newest_idx] = arrival_us;
+    if (sync->nsamples < BLE_MIDI_CLOCK_SYNC_NSAMPLES)
+        ++sync->nsamples;
+    while (sync->nsamples > 1 &&
+            sender_ms - sync->sender_ms[ble_midi_clock_sync_sample_idx(sync, sync->nsamples - 1)] > BLE_MIDI_CLOCK_SYNC_MAX_SPAN_MS) {
+        --sync->nsamples;
+    }
+    ble_midi_clock_sync_fit(sync);
+}
+
+void ble_midi_clock_sync_add_packet(ble_midi_clock_sync_t* sync, uint16_t timestamp_ms, uint64_t arrival_us)
+{
+    timestamp_ms &= BLE_MIDI_TIMESTAMP_MASK;
+    int64_t arrival = (int64_t)arrival_us;
+    int64_t sender_ms = timestamp_ms;
+    if (sync->have_last) {
+        // The local time since the previous packet says how many whole
+        // timestamp periods the sender's clock went through
+        int64_t elapsed_ms = (arrival - sync->last_arrival_us) / 1000;
+        int64_t delta_ms = (timestamp_ms - sync->last_ts) & BLE_MIDI_TIMESTAMP_MASK;
+        delta_ms += BLE_MIDI_TIMESTAMP_PERIOD_MS * ble_midi_clock_sync_floor_div(
+            elapsed_ms - delta_ms + BLE_MIDI_TIMESTAMP_PERIOD_MS / 2, BLE_MIDI_TIMESTAMP_PERIOD_MS);
+        sender_ms = sync->last_sender_ms + delta_ms;
+    }
+    sync->have_last = true;
+    sync->last_ts = timestamp_ms;
+    sync->last_sender_ms = sender_ms;
+    sync->last_arrival_us = arrival;
+
+    if (sync->nsamples > 0) {
+        int64_t error_us = arrival - ble_midi_clock_sync_predict_us(sync, sender_ms);
+        if (error_us > BLE_MIDI_CLOCK_SYNC_RESET_US || error_us < -BLE_MIDI_CLOCK_SYNC_RESET_US) {
+            sync->nsamples = 0;
+            sync->have_candidate = false;
+        }
+    }
+    if (sync->nsamples == 0) {
+        // map timestamps with the first packet until there is a better sample
+        ble_midi_clock_sync_add_sample(sync, sender_ms, arrival);
+        sync->interval_start_ms = sender_ms;
+        sync->interval_npackets = 0;
+        return;
+    }
+    if (sender_ms - sync->interval_start_ms >= BLE_MIDI_CLOCK_SYNC_INTERVAL_MS) {
+        // the interval is over; this packet is the first of the next one
+        if (sync->have_candidate && (sync->interval_npackets >= BLE_MIDI_CLOCK_SYNC_MIN_INTERVAL_PACKETS ||
+                sync->candidate_arrival_us <= ble_midi_clock_sync_predict_us(sync, sync->candidate_sender_ms))) {
+            ble_midi_clock_sync_add_sample(sync, sync->candidate_sender_ms, sync->candidate_arrival_us);
+        }
+        sync->have_candidate = false;
+        sync->interval_npackets = 0;
+        sync->interval_start_ms = sender_ms;
+    }
+    if (sync->interval_npackets < UINT8_MAX)
+        ++sync->interval_npackets;
+    if (!sync->have_candidate ||
+            arrival - sender_ms * 1000 < sync->candidate_arrival_us - sync->candidate_sender_ms * 1000) {
+        sync->candidate_sender_ms = sender_ms;
+        sync->candidate_arrival_us = arrival;
+        sync->have_candidate = true;
+    }
+}
+
+uint64_t ble_midi_clock_sync_to_local_us(const ble_midi_clock_sync_t* sync, uint16_t timestamp_ms)
+{
+    if (sync->nsamples == 0)
+        return time_us_64();
+    int64_t sender_ms = sync->last_sender_ms +
+        ble_midi_clock_sync_timestamp_diff(timestamp_ms & BLE_MIDI_TIMESTAMP_MASK, sync->last_ts);
+    return (uint64_t)ble_midi_clock_sync_predict_us(sync, sender_ms);
+}
+
+int32_t ble_midi_clock_sync_get_drift_ppm(const ble_midi_clock_sync_t* sync)
+{
+    return (int32_t)(((int64_t)(sync->slope_q16 - BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16) * 1000000) /
+        BLE_MIDI_CLOCK_SYNC_NOMINAL_SLOPE_Q16);
+}
+
+int64_t ble_midi_clock_sync_get_offset_us(const ble_midi_clock_sync_t* sync)
+{
+    return sync->fit_local_us - sync->fit_sender_ms * 1000;
+}
@@ -0,0 +1,123 @@
+/******************************************************************************
+ * @file ble_midi_clock_sync.h
+ *
+ * @brief Map a BLE-MIDI sender's 13-bit millisecond timestamps to local time
+ *
+ * Each received packet pairs the sender timestamp of its first message with
+ * the local time_us_64() when it arrived. Sender timestamps are unwrapped to
+ * a 64-bit millisecond count using the local time between packets, so gaps
+ * longer than the 8.192 second timestamp period do not alias.
+ *
+ * Connection interval scheduling delays packets by up to tens of
+ * milliseconds, always late and never early. So the tracker keeps only the
+ * least delayed packet of each BLE_MIDI_CLOCK_SYNC_INTERVAL_MS as a sample. A
+ * least squares line through the most recent samples gives the clock offset
+ * and the sender's drift relative to the local clock.
+ *
+ * The mapped time includes the connection's minimum transport latency: it is
+ * when a message would have arrived if its packet had the least delay.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of samples the fit uses
+#ifndef BLE_MIDI_CLOCK_SYNC_NSAMPLES
+#define BLE_MIDI_CLOCK_SYNC_NSAMPLES 16
+#endif
+
+// Sender milliseconds per sample; the least delayed packet in each interval is the sample
+#ifndef BLE_MIDI_CLOCK_SYNC_INTERVAL_MS
+#define BLE_MIDI_CLOCK_SYNC_INTERVAL_MS 1000
+#endif
+
+// Samples older than this many sender milliseconds are dropped from the fit.
+// This also bounds the fit arithmetic so it cannot overflow.
+#ifndef BLE_MIDI_CLOCK_SYNC_MAX_SPAN_MS
+#define BLE_MIDI_CLOCK_SYNC_MAX_SPAN_MS 60000
+#endif
+
+// If a packet arrives further than this from where the fit predicts, the
+// sender's clock is assumed to have jumped and the fit starts over
+#ifndef BLE_MIDI_CLOCK_SYNC_RESET_US
+#define BLE_MIDI_CLOCK_SYNC_RESET_US 500000
+#endif
+
+typedef struct ble_midi_clock_sync_s {
+    int64_t sender_ms[BLE_MIDI_CLOCK_SYNC_NSAMPLES];    // unwrapped sender timestamps
+    int64_t arrival_us[BLE_MIDI_CLOCK_SYNC_NSAMPLES];   // local arrival times
+    uint8_t nsamples;
+    uint8_t newest_idx;         // index of the most recent sample
+    bool have_candidate;        // true if candidate_* hold a packet from the current interval
+    uint8_t interval_npackets;  // the number of packets in the current interval, up to 255
+    int64_t candidate_sender_ms; // the least delayed packet so far in the current interval
+    int64_t candidate_arrival_us;
+    int64_t interval_start_ms;  // the unwrapped sender time the current interval started
+    // the most recent packet, the reference for unwrapping timestamps
+    bool have_last;
+    uint16_t last_ts;
+    int64_t last_sender_ms;
+    int64_t last_arrival_us;
+    // the fit: local_us = fit_local_us + (((sender_ms - fit_sender_ms) * slope_q16) >> 16)
+    int64_t fit_sender_ms;
+    int64_t fit_local_us;
+    int32_t slope_q16;          // local microseconds per sender millisecond, 16 fraction bits
+} ble_midi_clock_sync_t;
+
+/**
+ * @brief forget all samples
+ *
+ * @param sync the clock tracking state for one connection
+ */
+void ble_midi_clock_sync_init(ble_midi_clock_sync_t* sync);
+
+/**
+ * @brief add a packet's sender timestamp and local arrival time and update the fit
+ *
+ * @param sync the clock tracking state for one connection
+ * @param timestamp_ms the sender timestamp of the first message in the packet
+ * @param arrival_us the local time_us_64() when the packet arrived
+ */
+void ble_midi_clock_sync_add_packet(ble_midi_clock_sync_t* sync, uint16_t timestamp_ms, uint64_t arrival_us);
+
+/**
+ * @brief map a sender timestamp to local time
+ *
+ * The timestamp must be within about 4 seconds of the most recent packet,
+ * which is true for any message decoded from a recent packet.
+ *
+ * @param sync the clock tracking state for one connection
+ * @param timestamp_ms a decoded message timestamp
+ * @return the local time in microseconds on the time_us_64() clock, or
+ * time_us_64() if no packets have arrived yet
+ */
+uint64_t ble_midi_clock_sync_to_local_us(const ble_midi_clock_sync_t* sync, uint16_t timestamp_ms);
+
+/**
+ * @brief get how fast the sender's clock runs relative to the local clock
+ *
+ * @param sync the clock tracking state for one connection
+ * @return the drift in parts per million; positive if the sender's clock is slow
+ */
+int32_t ble_midi_clock_sync_get_drift_ppm(const ble_midi_clock_sync_t* sync);
+
+/**
+ * @brief get the local time minus the sender time at the center of the fit
+ *
+ * @param sync the clock tracking state for one connection
+ * @return the offset in microseconds, including the minimum transport latency
+ */
+int64_t ble_midi_clock_sync_get_offset_us(const ble_midi_clock_sync_t* sync);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,223 @@
+/******************************************************************************
+ * @file ble_midi_ecc.c
+ *
+ * @brief Run the LE Secure Connections P-256 operations on core 1
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "btstack.h"
+#include "btstack_crypto.h"
+#include "ble_midi_ecc.h"
+
+#if defined(ENABLE_LE_SECURE_CONNECTIONS) && defined(ENABLE_MICRO_ECC_FOR_LE_SECURE_CONNECTIONS)
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "pico/rand.h"
+#include "pico/flash.h"
+#include "uECC.h"
+
+// What core 1 is doing. Core 0 changes the state only from ECC_JOB_IDLE and
+// ECC_JOB_DONE and core 1 only from the others.
+typedef enum {
+    ECC_JOB_IDLE,               // core 0 may start a job
+    ECC_JOB_GENERATE_KEY,       // core 1 is generating the keypair
+    ECC_JOB_CALCULATE_DHKEY,    // core 1 is computing job_dhkey from peer_public_key
+    ECC_JOB_DONE,               // core 1 has finished; core 0 collects the result
+} ecc_job_t;
+
+// shared with core 1
+static volatile ecc_job_t job;
+static volatile uint32_t job_duration_us;
+static uint8_t local_private_key[32];
+static uint8_t local_public_key[64];
+static uint8_t peer_public_key[64];
+static uint8_t job_dhkey[32];
+
+// core 0 only
+static bool core1_started = false;
+static bool have_key;
+static btstack_crypto_ecc_p256_t* job_request;    // the request the running DH job is for, if any
+static btstack_linked_list_t requests;             // requests from the SM, oldest first
+static btstack_timer_source_t poll_timer;
+
+// uECC_RNG_Function on the ring oscillator based pico_rand generator
+static int ecc_rng(uint8_t* dest, unsigned size)
+{
+    while (size > 0) {
+        uint32_t rand = get_rand_32();
+        unsigned ncopy = MIN(size, sizeof(rand));
+        memcpy(dest, &rand, ncopy);
+        dest += ncopy;
+        size -= ncopy;
+    }
+    return 1;
+}
+
+static void ecc_core1_main()
+{
+    // park this core while core 0 writes the TLV flash bank
+    flash_safe_execute_core_init();
+    uECC_set_rng(ecc_rng);
+    while (true) {
+        ecc_job_t todo = job;
+        if (todo != ECC_JOB_GENERATE_KEY && todo != ECC_JOB_CALCULATE_DHKEY) {
+            __wfe();
+            continue;
+        }
+        __mem_fence_acquire();
+        uint64_t start_us = time_us_64();
+        if (todo == ECC_JOB_GENERATE_KEY) {
+            while (!uECC_make_key(local_public_key, local_private_key, uECC_secp256r1())) {
+            }
+        }
+        else if (!uECC_shared_secret(peer_public_key, local_private_key, job_dhkey, uECC_secp256r1())) {
+            // the SM validated the peer's key, so this should not happen
+            memset(job_dhkey, 0, sizeof(job_dhkey));
+        }
+        job_duration_us = (uint32_t)(time_us_64() - start_us);
+        __mem_fence_release();
+        job = ECC_JOB_DONE;
+    }
+}
+
+static void ecc_start_job(ecc_job_t todo)
+{
+    __mem_fence_release();
+    job = todo;
+    __sev();
+}
+
+static void ecc_poll(btstack_timer_source_t* ts);
+
+static void ecc_schedule_poll(uint32_t delay_ms)
+{
+    btstack_run_loop_remove_timer(&poll_timer);
+    btstack_run_loop_set_timer(&poll_timer, delay_ms);
+    btstack_run_loop_add_timer(&poll_timer);
+}
+
+static void ecc_complete(btstack_crypto_ecc_p256_t* request)
+{
+    btstack_linked_list_remove(&requests, (btstack_linked_item_t*)request);
+    (*request->btstack_crypto.context_callback.callback)(request->btstack_crypto.context_callback.context);
+}
+
+// Collect core 1's result and hand over the next request; runs in the BTstack context
+static void ecc_poll(btstack_timer_source_t* ts)
+{
+    UNUSED(ts);
+    if (job == ECC_JOB_DONE) {
+        __mem_fence_acquire();
+        if (!have_key) {
+            have_key = true;
+            printf("ble ecc: P-256 keypair generated on core 1 in %lu us\n", (unsigned long)job_duration_us);
+        }
+        else if (job_request != NULL) {
+            memcpy(job_request->dhkey, job_dhkey, sizeof(job_dhkey));
+            printf("ble ecc: DH key computed on core 1 in %lu us\n", (unsigned long)job_duration_us);
+            btstack_crypto_ecc_p256_t* request = job_request;
+            job_request = NULL;
+            ecc_complete(request);
+        }
+        job = ECC_JOB_IDLE;
+    }
+    while (job == ECC_JOB_IDLE && have_key && !btstack_linked_list_empty(&requests)) {
+        btstack_crypto_ecc_p256_t* request = (btstack_crypto_ecc_p256_t*)btstack_linked_list_get_first_item(&requests);
+        if (request->btstack_crypto.operation == BTSTACK_CRYPTO_ECC_P256_GENERATE_KEY) {
+            memcpy(request->public_key, local_public_key, sizeof(local_public_key));
+            ecc_complete(request);
+        }
+        else {
+            memcpy(peer_public_key, request->public_key, sizeof(peer_public_key));
+            job_request = request;
+            ecc_start_job(ECC_JOB_CALCULATE_DHKEY);
+        }
+    }
+    if (job != ECC_JOB_IDLE)
+        ecc_schedule_poll(BLE_MIDI_ECC_POLL_MS);
+}
+
+static void ecc_add_request(btstack_crypto_ecc_p256_t* request, btstack_crypto_operation_t operation,
+    void (*callback)(void* arg), void* callback_arg)
+{
+    ble_midi_ecc_init();
+    request->btstack_crypto.operation = operation;
+    request->btstack_crypto.context_callback.callback = callback;
+    request->btstack_crypto.context_callback.context = callback_arg;
+    btstack_linked_list_add_tail(&requests, (btstack_linked_item_t*)request);
+    // never call back before the caller returns, as BTstack does with the controller
+    ecc_schedule_poll(0);
+}
+
+void __wrap_btstack_crypto_ecc_p256_generate_key(btstack_crypto_ecc_p256_t* request, uint8_t* public_key,
+    void (*callback)(void* arg), void* callback_arg)
+{
+    request->public_key = public_key;
+    ecc_add_request(request, BTSTACK_CRYPTO_ECC_P256_GENERATE_KEY, callback, callback_arg);
+}
+
+void __wrap_btstack_crypto_ecc_p256_calculate_dhkey(btstack_crypto_ecc_p256_t* request, const uint8_t* public_key,
+    uint8_t* dhkey, void (*callback)(void* arg), void* callback_arg)
+{
+    request->public_key = (uint8_t*)public_key;
+    request->dhkey = dhkey;
+    ecc_add_request(request, BTSTACK_CRYPTO_ECC_P256_CALCULATE_DHKEY, callback, callback_arg);
+}
+
+void ble_midi_ecc_init()
+{
+    if (core1_started)
+        return;
+    core1_started = true;
+    have_key = false;
+    job_request = NULL;
+    requests = NULL;
+    btstack_run_loop_set_timer_handler(&poll_timer, ecc_poll);
+    job = ECC_JOB_GENERATE_KEY;
+    multicore_launch_core1(ecc_core1_main);
+    ecc_schedule_poll(BLE_MIDI_ECC_POLL_MS);
+}
+
+void ble_midi_ecc_deinit()
+{
+    // keep polling while core 1 is busy so the keypair is not lost
+    job_request = NULL;
+    requests = NULL;
+}
+
+#else
+#ifdef ENABLE_LE_SECURE_CONNECTIONS
+// BTstack's own P-256 implementation does not use micro-ecc; pass the requests on.
+// The build links calls to the real functions to the __wrap_ versions.
+void __real_btstack_crypto_ecc_p256_generate_key(btstack_crypto_ecc_p256_t* request, uint8_t* public_key,
+    void (*callback)(void* arg), void* callback_arg);
+void __real_btstack_crypto_ecc_p256_calculate_dhkey(btstack_crypto_ecc_p256_t* request, const uint8_t* public_key,
+    uint8_t* dhkey, void (*callback)(void* arg), void* callback_arg);
+
+void __wrap_btstack_crypto_ecc_p256_generate_key(btstack_crypto_ecc_p256_t* request, uint8_t* public_key,
+    void (*callback)(void* arg), void* callback_arg)
+{
+    __real_btstack_crypto_ecc_p256_generate_key(request, public_key, callback, callback_arg);
+}
+
+void __wrap_btstack_crypto_ecc_p256_calculate_dhkey(btstack_crypto_ecc_p256_t* request, const uint8_t* public_key,
+    uint8_t* dhkey, void (*callback)(void* arg), void* callback_arg)
+{
+    __real_btstack_crypto_ecc_p256_calculate_dhkey(request, public_key, dhkey, callback, callback_arg);
+}
+#endif
+
+void ble_midi_ecc_init()
+{
+}
+
+void ble_midi_ecc_deinit()
+{
+}
+#endif
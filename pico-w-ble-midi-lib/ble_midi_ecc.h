@@ -0,0 +1,56 @@
+/******************************************************************************
+ * @file ble_midi_ecc.h
+ *
+ * @brief Run the LE Secure Connections P-256 operations on core 1
+ *
+ * With ENABLE_MICRO_ECC_FOR_LE_SECURE_CONNECTIONS, BTstack generates the
+ * P-256 keypair and computes each pairing's DH key with micro-ecc in the
+ * BTstack context, which is the main loop with pico_cyw43_arch_none. Both
+ * take a long time on the Cortex-M0+, and no MIDI is handled meanwhile.
+ *
+ * The build wraps btstack_crypto_ecc_p256_generate_key() and
+ * btstack_crypto_ecc_p256_calculate_dhkey() so these requests come here
+ * instead. Core 1 generates the keypair once as soon as the server or client
+ * starts and computes the DH keys; the main loop only hands the requests over
+ * and polls for the results. The keypair lasts until the next power cycle,
+ * which is also what BTstack does.
+ *
+ * Core 1 calls flash_safe_execute_core_init() so core 0 can still write the
+ * BTstack TLV flash bank. The application must not use core 1 for anything
+ * else.
+ *
+ * @author mitimidi-relay
+ * @date 2026-10-17
+ *
+ * SPDX-License-Identifier: MIT
+ ******************************************************************************/
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// How often the BTstack context checks whether core 1 has finished, in ms
+#ifndef BLE_MIDI_ECC_POLL_MS
+#define BLE_MIDI_ECC_POLL_MS 1
+#endif
+
+/**
+ * @brief start core 1 and generate the P-256 keypair there
+ *
+ * Call before sm_init(). Calling again after ble_midi_ecc_deinit() keeps the
+ * keypair.
+ */
+void ble_midi_ecc_init();
+
+/**
+ * @brief drop the requests BTstack has not gotten a result for yet
+ *
+ * Call before sm_deinit(). Core 1 finishes the operation it is running, if
+ * any, and its result is discarded.
+ */
+void ble_midi_ecc_deinit();
+
+#ifdef __cplusplus
+}
+#endif
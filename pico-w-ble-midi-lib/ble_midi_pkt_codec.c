@@ -31,10 +31,13 @@
  *
  */
 #include "ble_midi_pkt_codec.h"
-#include "ring_buffer_lib.h"
+#include "ble_midi_block_pool.h"
+#include "ble_midi_clock_sync.h"
+#include "midi_sysex_assembler.h"
 #include "pico/stdlib.h"
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #define MIDI_SERVICE_HEADER(x) (0x80 | (((x) >> 7) & 0x3F) )
 #define MIDI_SERVICE_TIMESTAMP_LOW(x) (0x80 | ((x) & 0x7F))
@@ -46,26 +49,112 @@ typedef struct to_ble_midi_stream_s {
     uint16_t next_msg_byte_idx;                 // the next status or data byte will be written to mes.msg_bytes[next_msg_byte_idx]
     uint16_t previous_timestamp;                // the timestamp of the last MIDI status byte encoded to be sent in pending_ble_pkt
     uint8_t running_status;                     // the MIDI message stream channel message running status
-    uint8_t npending_rt;                        // number of pending real-time messages
-    uint8_t pending_rt_status[4];               // buffer of pending real-time messages
-    uint16_t pending_rt_timestamp[4];           // buffer of pending real-time message timestamps
     ble_midi_packet_t pending_ble_pkt;          // packet currently being encoded from the message stream
     uint8_t pending_ble_midi_pkt_running_status; // the channel message running status of the pending BLE-MIDI packet
     uint8_t pending_ble_midi_pkt_prev_status;   // the last encoded status message for the ble midi packet
+    uint32_t pending_ble_pkt_start_us;          // time_us_32() when the first byte was encoded to pending_ble_pkt
 } to_ble_midi_stream_t;
 
 struct ble_midi_codec_data_s {
-    // data packets sent to the Blueooth stack are stored here
-    uint8_t to_ble_buffer_storage[sizeof(ble_midi_packet_t) * 10];
     to_ble_midi_stream_t to_ble_midi_stream;
+    // data packets sent to the Blueooth stack are stored here as variable length
+    // records: the packet's nbytes followed by only the nbytes used in pkt[]
+    ble_midi_block_queue_t to_ble;
     // parsed messages received from the Blueooth stack are stored here
-    uint8_t from_ble_buffer_storage[sizeof(ble_midi_message_t) * 100];
-    ring_buffer_t to_ble;
-    ring_buffer_t from_ble;
+    ble_midi_block_queue_t from_ble;
+    // the pool blocks held by to_ble and from_ble
+    ble_midi_pool_owner_t pool_owner;
+    bool pool_owner_added;
+    // maps received timestamps to local time
+    ble_midi_clock_sync_t clock_sync;
     uint16_t ble_mtu;
+    // if not NULL, decoded messages go here instead of to from_ble
+    ble_midi_pkt_codec_message_cb_t message_cb;
+    void* message_cb_context;
+    // if not 0, pending_ble_pkt collects messages for this many microseconds before it is sent
+    uint32_t coalesce_window_us;
+    // if not NULL, system exclusive bytes go here instead of being decoded to fragments
+    ble_midi_pkt_codec_sysex_cb_t sysex_cb;
+    bool in_sysex;                              // true if sysex_cb has seen the 0xF0 of the current message
+    void* sysex_cb_context;
 };
 
-static ble_midi_codec_data_t ble_midi_codec_data[BLE_MIDI_SERVER_MAX_CONNECTIONS];
+static ble_midi_codec_data_t ble_midi_codec_data[BLE_MIDI_POOL_NOWNERS];
+
+// BLE-MIDI packet decoder byte classes. Each ble_midi_byte_info[] entry holds
+// the class of a byte in the upper nibble and, for status bytes, the length of
+// the MIDI message the byte starts in the lower nibble.
+enum {
+    BLE_MIDI_BYTE_DATA,         // 0x00-0x7F
+    BLE_MIDI_BYTE_CHANNEL,      // 0x80-0xEF
+    BLE_MIDI_BYTE_SYSEX_START,  // 0xF0
+    BLE_MIDI_BYTE_COMMON,       // 0xF1-0xF6
+    BLE_MIDI_BYTE_SYSEX_END,    // 0xF7
+    BLE_MIDI_BYTE_REAL_TIME,    // 0xF8-0xFF
+    BLE_MIDI_EVENT_NO_TIMESTAMP, // not a byte class: the next byte to decode is a data byte
+    BLE_MIDI_NUM_EVENTS
+};
+
+#define BLE_MIDI_BYTE_INFO(cls, len) (((cls) << 4) | (len))
+#define BLE_MIDI_BYTE_CLASS(byte) (ble_midi_byte_info[(byte)] >> 4)
+#define BLE_MIDI_BYTE_MSG_LEN(byte) (ble_midi_byte_info[(byte)] & 0xF)
+
+static const uint8_t ble_midi_byte_info[256] = {
+    [0x00 ... 0x7F] = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_DATA, 0),
+    [0x80 ... 0xBF] = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_CHANNEL, 3),
+    [0xC0 ... 0xDF] = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_CHANNEL, 2),
+    [0xE0 ... 0xEF] = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_CHANNEL, 3),
+    [0xF0]          = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_SYSEX_START, 1),
+    [0xF1]          = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_COMMON, 2),
+    [0xF2]          = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_COMMON, 3),
+    [0xF3]          = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_COMMON, 2),
+    [0xF4 ... 0xF6] = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_COMMON, 1),
+    [0xF7]          = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_SYSEX_END, 1),
+    [0xF8 ... 0xFF] = BLE_MIDI_BYTE_INFO(BLE_MIDI_BYTE_REAL_TIME, 1),
+};
+
+// Decoder states
+enum {
+    BLE_MIDI_DECODE_MESSAGE,    // between messages
+    BLE_MIDI_DECODE_SYSEX,      // all sysex data up to the next timestamp is delivered
+    BLE_MIDI_NUM_DECODE_STATES
+};
+
+// Decoder actions
+enum {
+    BLE_MIDI_ACTION_ERROR,
+    BLE_MIDI_ACTION_TIMESTAMP_RUNNING_STATUS,
+    BLE_MIDI_ACTION_RUNNING_STATUS,
+    BLE_MIDI_ACTION_CHANNEL,
+    BLE_MIDI_ACTION_COMMON,
+    BLE_MIDI_ACTION_REAL_TIME,
+    BLE_MIDI_ACTION_SYSEX_START,
+    BLE_MIDI_ACTION_SYSEX_REAL_TIME,
+    BLE_MIDI_ACTION_SYSEX_END,
+};
+
+// The action for each decoder state. Unless the event is BLE_MIDI_EVENT_NO_TIMESTAMP,
+// the next byte is a timestamp and the event is the class of the byte after it.
+static const uint8_t ble_midi_decode_action[BLE_MIDI_NUM_DECODE_STATES][BLE_MIDI_NUM_EVENTS] = {
+    [BLE_MIDI_DECODE_MESSAGE] = {
+        [BLE_MIDI_BYTE_DATA]            = BLE_MIDI_ACTION_TIMESTAMP_RUNNING_STATUS,
+        [BLE_MIDI_BYTE_CHANNEL]         = BLE_MIDI_ACTION_CHANNEL,
+        [BLE_MIDI_BYTE_SYSEX_START]     = BLE_MIDI_ACTION_SYSEX_START,
+        [BLE_MIDI_BYTE_COMMON]          = BLE_MIDI_ACTION_COMMON,
+        [BLE_MIDI_BYTE_SYSEX_END]       = BLE_MIDI_ACTION_COMMON, // unexpected EOX: pass it on
+        [BLE_MIDI_BYTE_REAL_TIME]       = BLE_MIDI_ACTION_REAL_TIME,
+        [BLE_MIDI_EVENT_NO_TIMESTAMP]   = BLE_MIDI_ACTION_RUNNING_STATUS,
+    },
+    [BLE_MIDI_DECODE_SYSEX] = {
+        [BLE_MIDI_BYTE_DATA]            = BLE_MIDI_ACTION_TIMESTAMP_RUNNING_STATUS,
+        [BLE_MIDI_BYTE_CHANNEL]         = BLE_MIDI_ACTION_ERROR,
+        [BLE_MIDI_BYTE_SYSEX_START]     = BLE_MIDI_ACTION_ERROR,
+        [BLE_MIDI_BYTE_COMMON]          = BLE_MIDI_ACTION_ERROR,
+        [BLE_MIDI_BYTE_SYSEX_END]       = BLE_MIDI_ACTION_SYSEX_END,
+        [BLE_MIDI_BYTE_REAL_TIME]       = BLE_MIDI_ACTION_SYSEX_REAL_TIME,
+        [BLE_MIDI_EVENT_NO_TIMESTAMP]   = BLE_MIDI_ACTION_ERROR,
+    },
+};
 
 static uint16_t midi_service_timestamp_decode(uint16_t* msb, uint8_t lsb, uint8_t* prev_lsb)
 {
@@ -80,7 +169,7 @@ static uint16_t midi_service_timestamp_decode(uint16_t* msb, uint8_t lsb, uint8_
 ble_midi_codec_data_t* ble_midi_pkt_codec_get_data_by_index(uint8_t idx)
 {
     ble_midi_codec_data_t* context = NULL;
-    if (idx < BLE_MIDI_SERVER_MAX_CONNECTIONS) {
+    if (idx < BLE_MIDI_POOL_NOWNERS) {
         context = ble_midi_codec_data + idx;
         
     }
@@ -88,23 +177,41 @@ ble_midi_codec_data_t* ble_midi_pkt_codec_get_data_by_index(uint8_t idx)
 }
 
 
-static void ble_midi_pkt_codec_init_ring_buffers(ble_midi_codec_data_t* context)
+static void ble_midi_pkt_codec_init_queues(ble_midi_codec_data_t* context)
 {
     context->to_ble_midi_stream.next_msg_byte_idx = 0;
     context->to_ble_midi_stream.previous_timestamp = 0xffff; // illegal value
     context->to_ble_midi_stream.running_status = 0;
     context->to_ble_midi_stream.mes.nbytes = 0;
     context->to_ble_midi_stream.mes.timestamp_ms = 0xffff;
-    context->to_ble_midi_stream.npending_rt = 0;
     context->to_ble_midi_stream.pending_ble_pkt.nbytes = 0;
-    ring_buffer_init(&context->from_ble, (uint8_t *)context->from_ble_buffer_storage, sizeof(context->from_ble_buffer_storage), 0);
-    ring_buffer_init(&context->to_ble, (uint8_t *)context->to_ble_buffer_storage, sizeof(context->to_ble_buffer_storage), 0);
+    context->in_sysex = false;
+    if (!context->pool_owner_added) {
+        ble_midi_block_pool_add_owner(&context->pool_owner);
+        ble_midi_block_queue_init(&context->from_ble, &context->pool_owner);
+        ble_midi_block_queue_init(&context->to_ble, &context->pool_owner);
+        context->pool_owner_added = true;
+    }
+    else {
+        ble_midi_block_queue_clear(&context->from_ble);
+        ble_midi_block_queue_clear(&context->to_ble);
+    }
 }
 
 void ble_midi_pkt_codec_init_data(ble_midi_codec_data_t* context, uint16_t ble_mtu)
 {
     ble_midi_pkt_codec_set_mtu(context, ble_mtu);
-    ble_midi_pkt_codec_init_ring_buffers(context);
+    ble_midi_pkt_codec_init_queues(context);
+    ble_midi_clock_sync_init(&context->clock_sync);
+}
+
+void ble_midi_pkt_codec_release_data(ble_midi_codec_data_t* context)
+{
+    if (!context->pool_owner_added)
+        return;
+    ble_midi_block_queue_clear(&context->from_ble);
+    ble_midi_block_queue_clear(&context->to_ble);
+    context->to_ble_midi_stream.pending_ble_pkt.nbytes = 0;
 }
 
 void ble_midi_pkt_codec_set_mtu(ble_midi_codec_data_t* context, uint16_t ble_mtu)
@@ -122,37 +229,63 @@ uint16_t ble_midi_pkt_codec_get_mtu(ble_midi_codec_data_t* context)
     return context->ble_mtu;
 }
 
+void ble_midi_pkt_codec_set_message_callback(ble_midi_codec_data_t* context, ble_midi_pkt_codec_message_cb_t message_cb, void* cb_context)
+{
+    context->message_cb = message_cb;
+    context->message_cb_context = cb_context;
+}
+
+void ble_midi_pkt_codec_set_sysex_callback(ble_midi_codec_data_t* context, ble_midi_pkt_codec_sysex_cb_t sysex_cb, void* cb_context)
+{
+    context->sysex_cb = sysex_cb;
+    context->sysex_cb_context = cb_context;
+    context->in_sysex = false;
+}
+
 static uint16_t midi_service_stream_get_system_13_bit_ms_timestamp()
 {
     return (uint16_t)((time_us_32()/1000) & 0x1FFF);
 }
 
-static void midi_service_stream_add_header_if_needed(ble_midi_packet_t* pkt, uint16_t timestamp)
+static void midi_service_stream_add_header_if_needed(to_ble_midi_stream_t* ble_midi_stream, uint16_t timestamp)
 {
+    ble_midi_packet_t* pkt = &ble_midi_stream->pending_ble_pkt;
     if (pkt->nbytes == 0) {
         pkt->pkt[pkt->nbytes++] = MIDI_SERVICE_HEADER(timestamp);
+        ble_midi_stream->pending_ble_pkt_start_us = time_us_32();
     }
 }
 
-static void midi_service_stream_flush_rt_midi_to_pkt(ble_midi_codec_data_t* context)
+// The number of bytes a packet occupies in the to_ble queue
+#define BLE_MIDI_PKT_RECORD_LEN(nbytes_) (sizeof(((ble_midi_packet_t*)0)->nbytes) + (nbytes_))
+
+// Move the packet being encoded to the packet to send queue and start a new one.
+// The packet is dropped if the queue cannot get pool blocks for all of it.
+static void midi_service_stream_push_pending_pkt(ble_midi_codec_data_t* context)
 {
     to_ble_midi_stream_t* ble_midi_stream = &context->to_ble_midi_stream;
-    for (uint8_t idx = 0; idx < ble_midi_stream->npending_rt; idx++) {
-        // make sure there is room in the ATT packet to store the data
-        if ((ble_midi_stream->pending_ble_pkt.nbytes + 2) >= context->ble_mtu) {
-            ring_buffer_push(&context->to_ble, (uint8_t*)&ble_midi_stream->pending_ble_pkt, sizeof(ble_midi_stream->pending_ble_pkt));
-            ble_midi_stream->pending_ble_pkt.nbytes = 0;
-            ble_midi_stream->pending_ble_midi_pkt_running_status = 0;
-            ble_midi_stream->pending_ble_midi_pkt_prev_status = 0;
-        }
-        if (ble_midi_stream->pending_ble_pkt.nbytes == 0) {
-            ble_midi_stream->pending_ble_pkt.pkt[ble_midi_stream->pending_ble_pkt.nbytes++] = MIDI_SERVICE_HEADER(ble_midi_stream->pending_rt_timestamp[0]);
-        }
-        ble_midi_stream->pending_ble_pkt.pkt[ble_midi_stream->pending_ble_pkt.nbytes++] = MIDI_SERVICE_TIMESTAMP_LOW(ble_midi_stream->pending_rt_timestamp[idx]);
-        ble_midi_stream->pending_ble_pkt.pkt[ble_midi_stream->pending_ble_pkt.nbytes++] = ble_midi_stream->pending_rt_status[idx];
-        ble_midi_stream->pending_ble_midi_pkt_prev_status = ble_midi_stream->pending_rt_status[idx];
+    ble_midi_block_queue_push(&context->to_ble, (uint8_t*)&ble_midi_stream->pending_ble_pkt,
+        BLE_MIDI_PKT_RECORD_LEN(ble_midi_stream->pending_ble_pkt.nbytes));
+    ble_midi_stream->pending_ble_pkt.nbytes = 0;
+    ble_midi_stream->pending_ble_midi_pkt_running_status = 0;
+    ble_midi_stream->pending_ble_midi_pkt_prev_status = 0;
+}
+
+// Real-time messages may interrupt any other message, so encode each one to
+// the open packet as soon as it arrives. Every real-time status byte needs its
+// own timestamp byte: both have bit 7 set, and a receiver takes the first such
+// byte after a complete message to be a timestamp.
+static void midi_service_stream_encode_rt_to_pkt(ble_midi_codec_data_t* context, uint8_t rt_status, uint16_t timestamp)
+{
+    to_ble_midi_stream_t* ble_midi_stream = &context->to_ble_midi_stream;
+    // make sure there is room in the ATT packet to store the data
+    if ((ble_midi_stream->pending_ble_pkt.nbytes + 2) >= context->ble_mtu) {
+        midi_service_stream_push_pending_pkt(context);
     }
-    ble_midi_stream->npending_rt = 0;
+    midi_service_stream_add_header_if_needed(ble_midi_stream, timestamp);
+    ble_midi_stream->pending_ble_pkt.pkt[ble_midi_stream->pending_ble_pkt.nbytes++] = MIDI_SERVICE_TIMESTAMP_LOW(timestamp);
+    ble_midi_stream->pending_ble_pkt.pkt[ble_midi_stream->pending_ble_pkt.nbytes++] = rt_status;
+    ble_midi_stream->pending_ble_midi_pkt_prev_status = rt_status;
 }
 
 static void midi_service_stream_encode_bt_pkt(ble_midi_codec_data_t* context)
@@ -161,9 +294,6 @@ static void midi_service_stream_encode_bt_pkt(ble_midi_codec_data_t* context)
     uint8_t nbytes = ble_midi_stream->mes.nbytes & ble_midi_packet_nbytes_mask;
     if (nbytes == 0)
         return;
-    if ((ble_midi_stream->mes.nbytes & ble_midi_packet_is_real_time) != ble_midi_packet_is_real_time) {
-        midi_service_stream_flush_rt_midi_to_pkt(context);
-    }
 
     // channel messages for which the midi packet running status match the status byte running status may omit byte 0 of msg_bytes
     bool requires_byte0 = (((ble_midi_stream->mes.nbytes & ble_midi_packet_is_channel) != ble_midi_packet_is_channel) ||
@@ -182,10 +312,7 @@ static void midi_service_stream_encode_bt_pkt(ble_midi_codec_data_t* context)
     uint8_t first_byte_idx = (requires_byte0 ? 0:1);
     uint8_t total_bytes = nbytes + (needs_timestamp ? 1:0) - first_byte_idx;
     if ((ble_midi_stream->pending_ble_pkt.nbytes + total_bytes) >= context->ble_mtu) {
-        ring_buffer_push(&context->to_ble, (uint8_t*)&ble_midi_stream->pending_ble_pkt, sizeof(ble_midi_stream->pending_ble_pkt));
-        ble_midi_stream->pending_ble_pkt.nbytes = 0;
-        ble_midi_stream->pending_ble_midi_pkt_running_status = 0;
-        ble_midi_stream->pending_ble_midi_pkt_prev_status = 0;
+        midi_service_stream_push_pending_pkt(context);
         needs_timestamp = true;
         requires_byte0 = true;
     }
@@ -196,7 +323,7 @@ static void midi_service_stream_encode_bt_pkt(ble_midi_codec_data_t* context)
     if (ble_midi_stream->mes.msg_bytes[0] & 0x80) {
         ble_midi_stream->pending_ble_midi_pkt_prev_status = ble_midi_stream->mes.msg_bytes[0];
     }
-    midi_service_stream_add_header_if_needed(&ble_midi_stream->pending_ble_pkt, ble_midi_stream->mes.timestamp_ms);
+    midi_service_stream_add_header_if_needed(ble_midi_stream, ble_midi_stream->mes.timestamp_ms);
     if (needs_timestamp) {
         ble_midi_stream->pending_ble_pkt.pkt[ble_midi_stream->pending_ble_pkt.nbytes++] = MIDI_SERVICE_TIMESTAMP_LOW(ble_midi_stream->mes.timestamp_ms);
     }
@@ -210,7 +337,6 @@ static void midi_service_stream_encode_full_bt_pkt(ble_midi_codec_data_t* contex
 {
     midi_service_stream_encode_bt_pkt(context);
     context->to_ble_midi_stream.next_msg_byte_idx = 0;
-    //midi_service_stream_flush_rt_midi_to_pkt(context);
 }
 
 
@@ -223,7 +349,6 @@ static void midi_service_stream_discard_stream(const uint8_t* midi_stream, uint1
     ble_midi_stream->running_status = 0;
     ble_midi_stream->mes.nbytes = 0;
     ble_midi_stream->mes.timestamp_ms = 0xffff;
-    ble_midi_stream->npending_rt = 0;
     while(nbytes--) {
         printf("%02x ", *midi_stream++);
     }
@@ -266,7 +391,7 @@ uint16_t ble_midi_pkt_codec_push_midi(const uint8_t* midi_stream, uint16_t nbyte
                 if ((ble_midi_stream->mes.nbytes & ble_midi_packet_is_sysex) == 0) {
                     // terminated a sysex message without being inside a sysex message.
                     // Something went wrong with the MIDI stream or this design
-                    // Discard the pending message and pending real-time messages
+                    // Discard the pending message
                     midi_service_stream_discard_stream(midi_stream, nbytes, ble_midi_stream);
 
                     return bytes_pushed;
@@ -291,17 +416,8 @@ uint16_t ble_midi_pkt_codec_push_midi(const uint8_t* midi_stream, uint16_t nbyte
                     context->to_ble_midi_stream.next_msg_byte_idx = 0;
                     ble_midi_stream->mes.nbytes = ble_midi_packet_is_sysex;
                 }
-                ble_midi_stream->pending_rt_status[ble_midi_stream->npending_rt] = ms_byte;
-                ble_midi_stream->pending_rt_timestamp[ble_midi_stream->npending_rt++] = timestamp;
                 ++bytes_pushed;
-                if (ble_midi_stream->npending_rt >= sizeof(ble_midi_stream->pending_rt_status)) {
-                    // Something went wrong with the MIDI stream or this design
-                    // Discard the pending message and pending real-time messages
-                    midi_service_stream_discard_stream(midi_stream, nbytes, ble_midi_stream);
-
-                    return bytes_pushed;
-                }
-                midi_service_stream_flush_rt_midi_to_pkt(context);
+                midi_service_stream_encode_rt_to_pkt(context, ms_byte, timestamp);
             }
             else if (ms_byte > 0xF0) {
                 // system common message
@@ -394,35 +510,51 @@ uint16_t ble_midi_pkt_codec_push_midi(const uint8_t* midi_stream, uint16_t nbyte
     // parsed the full MIDI stream sent
     if (bytes_pushed > 0) {
         if (ble_midi_stream->pending_ble_pkt.nbytes > 0) {
-            ring_buffer_push(&context->to_ble, (uint8_t*)&ble_midi_stream->pending_ble_pkt, sizeof(ble_midi_stream->pending_ble_pkt));
-            ble_midi_stream->pending_ble_pkt.nbytes = 0;
-            ble_midi_stream->pending_ble_midi_pkt_running_status = 0;
-            ble_midi_stream->pending_ble_midi_pkt_prev_status = 0;
+            // When coalescing, leave the packet open for more messages unless the
+            // largest message (timestamp + 3 bytes) would not fit
+            if (context->coalesce_window_us == 0 ||
+                    (ble_midi_stream->pending_ble_pkt.nbytes + 4) >= context->ble_mtu) {
+                midi_service_stream_push_pending_pkt(context);
+            }
             *ready_to_send = true;
         }
     }
     return bytes_pushed;
 }
 
-static bool midi_service_stream_push(ring_buffer_t* buf, uint8_t* data, RING_BUFFER_SIZE_TYPE size)
+// Deliver a decoded message to the registered callback or, if there is none, to the from_ble queue
+static bool ble_midi_pkt_codec_deliver(ble_midi_codec_data_t* context, ble_midi_message_t* mes)
 {
-    bool success = false;
-    RING_BUFFER_SIZE_TYPE after_push = ring_buffer_get_num_bytes(buf);
-    after_push += size;
-    if (buf->bufsize >= after_push) {
-        ring_buffer_push(buf, data, size);
-        success = true;
+    if (context->message_cb != NULL) {
+        context->message_cb(mes, context->message_cb_context);
+        return true;
     }
-    return success;
+    return ble_midi_block_queue_push(&context->from_ble, (uint8_t*)mes, sizeof(*mes));
 }
 
 static bool ble_midi_pkt_codec_decode_sysex_data(const uint8_t* pkt, uint16_t nbytes, ble_midi_codec_data_t* context, ble_midi_message_t* mes, uint16_t* ndecoded, uint8_t idx)
 {
-    while (*ndecoded < nbytes && (pkt[*ndecoded] & 0x80) == 0) {
+    uint16_t run = midi_sysex_data_run_length(pkt + *ndecoded, nbytes - *ndecoded);
+    if (context->sysex_cb != NULL) {
+        if (idx == 1) {
+            // the 0xF0 is the byte before the data, so the whole run is contiguous in pkt
+            context->in_sysex = true;
+            context->sysex_cb(pkt + *ndecoded - 1, run + 1, false, context->sysex_cb_context);
+        }
+        else if (context->in_sysex && run > 0) {
+            // data without a preceding 0xF0 belongs to a message that started before this connection did
+            context->sysex_cb(pkt + *ndecoded, run, false, context->sysex_cb_context);
+        }
+        *ndecoded += run;
+        mes->nbytes = ble_midi_packet_is_sysex;
+        return true;
+    }
+    uint16_t end = *ndecoded + run;
+    while (*ndecoded < end) {
         mes->msg_bytes[idx++] = pkt[(*ndecoded)++];
         mes->nbytes++;
         if (idx == 3) {
-            if (!midi_service_stream_push(&context->from_ble, (uint8_t*)mes, sizeof(*mes))) {
+            if (!ble_midi_pkt_codec_deliver(context, mes)) {
                 *ndecoded -= 3;
                 return false;
             }
@@ -432,7 +564,7 @@ static bool ble_midi_pkt_codec_decode_sysex_data(const uint8_t* pkt, uint16_t nb
     }
     uint8_t bytecount = (mes->nbytes & ble_midi_packet_nbytes_mask);
     if (bytecount > 0) {
-        if (!midi_service_stream_push(&context->from_ble, (uint8_t*)mes, sizeof(*mes))) {
+        if (!ble_midi_pkt_codec_deliver(context, mes)) {
             *ndecoded -= bytecount;
             return false;
         }
@@ -453,10 +585,15 @@ uint16_t ble_midi_pkt_codec_ble_midi_decode_push(const uint8_t* pkt, uint16_t nb
         return 0;
     }
     uint16_t timestamp = ((uint16_t)(pkt[0] & 0x3f)) << 7;
+    if ((pkt[1] & 0x80) != 0) {
+        // sample the sender's clock with the packet's first timestamp
+        ble_midi_clock_sync_add_packet(&context->clock_sync, timestamp | (pkt[1] & 0x7F), time_us_64());
+    }
     uint8_t prev_lsb = 0;
     uint16_t ndecoded = 1;
     uint8_t running_status = 0;
     uint8_t running_status_nbytes = 0;
+    const uint8_t* state_actions = ble_midi_decode_action[BLE_MIDI_DECODE_MESSAGE];
     ble_midi_message_t mes = {0, {0,0,0}, 0};
     // check to see if the start of the packet is sysex continuation data
     if ((pkt[ndecoded] & 0x80) == 0) {
@@ -465,166 +602,142 @@ uint16_t ble_midi_pkt_codec_ble_midi_decode_push(const uint8_t* pkt, uint16_t nb
         if (!ble_midi_pkt_codec_decode_sysex_data(pkt, nbytes, context, &mes, &ndecoded, 0)) {
             return ndecoded;
         }
+        state_actions = ble_midi_decode_action[BLE_MIDI_DECODE_SYSEX];
     }
     while (ndecoded < nbytes) {
-        // message start usually is a timestamp followed by a status byte
-        if (ndecoded+1 < nbytes) {
-            if ((pkt[ndecoded] & 0x80) != 0 && (pkt[ndecoded+1] & 0x80) != 0) {
-                // As long as it is not a sysex message, this is a timestamp followed by a status byte
-                if ((mes.nbytes & ble_midi_packet_is_sysex) == 0) {
-                    // 1st byte is the timestamp; 2nd byte is status byte
-                    mes.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
-                    mes.msg_bytes[0] = pkt[ndecoded++];
-                    if (mes.msg_bytes[0] >= 0xF8) {
-                        mes.nbytes = ble_midi_packet_is_real_time + 1;
-                        if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                            return ndecoded;
-                        }
-                    }
-                    else if (mes.msg_bytes[0] > 0xF0 && mes.msg_bytes[0] <= 0xF7) {
-                        // system common
-                        if (mes.msg_bytes[0] == 0xF1 || mes.msg_bytes[0] == 0xF3) {
-                            mes.nbytes = 2;
-                        }
-                        else if (mes.msg_bytes[0] == 0xF2) {
-                            mes.nbytes = 3;
-                        }
-                        else {
-                            mes.nbytes = 1;
-                        }
-                        if ((ndecoded + mes.nbytes - 1) <= nbytes) {
-                            for (uint8_t idx = 1; idx < mes.nbytes; idx++) {
-                                mes.msg_bytes[idx] = pkt[ndecoded++];
-                            }
-                            if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                                --ndecoded;
-                                return ndecoded;
-                            }
-                        }
-                        else {
-                            return ndecoded;
-                        }
-                    }
-                    else if (mes.msg_bytes[0] < 0xF0) {
-                        // channel message
-                        running_status = mes.msg_bytes[0];
-                        uint8_t stat = (mes.msg_bytes[0] >> 4) & 0xF; // ignore the channel
-                        if (stat == 0xC || stat == 0xD) {
-                            mes.nbytes = 2;
-                            running_status_nbytes = 2;
-                        }
-                        else {
-                            running_status_nbytes = 3;
-                        }
-                        if ((running_status_nbytes + ndecoded -1) <= nbytes) {
-                            for (uint8_t idx = 1; idx < running_status_nbytes; idx++) {
-                                mes.msg_bytes[idx] = pkt[ndecoded++];
-                            }
-                            mes.nbytes = running_status_nbytes | ble_midi_packet_is_channel;
-                            if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                                --ndecoded;
-                                return ndecoded;
-                            }
-                        }
-                    }
-                    else { // 0xF0; start of sysex
-                        // keep decoding until encountering a new timestamp.
-                        mes.nbytes = ble_midi_packet_is_sysex + 1;
-                        if (!ble_midi_pkt_codec_decode_sysex_data(pkt, nbytes, context, &mes, &ndecoded, 1)) {
-                            return ndecoded;
-                        }
-                    }
+        uint8_t event;
+        if ((pkt[ndecoded] & 0x80) == 0) {
+            event = BLE_MIDI_EVENT_NO_TIMESTAMP;
+        }
+        else if (ndecoded + 1 < nbytes) {
+            event = BLE_MIDI_BYTE_CLASS(pkt[ndecoded+1]);
+        }
+        else {
+            // a timestamp with nothing after it
+            return ndecoded;
+        }
+        uint8_t len;
+        switch (state_actions[event]) {
+            case BLE_MIDI_ACTION_TIMESTAMP_RUNNING_STATUS:
+                // a timestamp followed by the data byte(s) of a channel message with running status
+                if (running_status == 0 || (ndecoded + running_status_nbytes) > nbytes) {
+                    return ndecoded;
                 }
-                else if (pkt[ndecoded+1] >= 0xF8) {
-                    uint8_t bytecount = (mes.nbytes & ble_midi_packet_nbytes_mask);
-                    if (bytecount > 0) {
-                        if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                            ndecoded -= bytecount;
-                            return ndecoded;
-                        }
-                    }
-                    // This is a real-time message timestamp and status byte within a sysex message
-                    ble_midi_message_t mes_rt = {0, {0,0,0}, 0};
-                    mes_rt.nbytes = ble_midi_packet_is_real_time + 1;
-                    mes_rt.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
-                    mes_rt.msg_bytes[0] = pkt[ndecoded++];
-                    if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes_rt, sizeof(mes_rt))) {
-                        ndecoded -= 2;
-                        return ndecoded;
-                    }
-                    // real-time packet is out of the way, continue parsing the data
-                    mes.nbytes = ble_midi_packet_is_sysex;
-                    uint8_t idx = 0;
-                    while (ndecoded < nbytes && (pkt[ndecoded] & 0x80) == 0) {
-                        mes.msg_bytes[idx++] = pkt[ndecoded++];
-                        mes.nbytes++;
-                        if (idx == 3) {
-                            if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                                ndecoded -= 3;
-                                return ndecoded;
-                            }
-                            idx = 0;
-                            mes.nbytes = ble_midi_packet_is_sysex;
-                        }
-                    }
-                    bytecount = (mes.nbytes & ble_midi_packet_nbytes_mask);
-                    if (bytecount > 0) {
-                        if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                            ndecoded -= bytecount;
-                            return ndecoded;
-                        }
-                        // if MSB==1 in the BLE packet, it could be a real-time message's timestamp or EOX message's timestamp
-                        mes.nbytes = ble_midi_packet_is_sysex;
-                    }
+                mes.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
+                mes.msg_bytes[0] = running_status;
+                mes.nbytes = running_status_nbytes | ble_midi_packet_is_channel;
+                for (uint8_t idx = 1; idx < running_status_nbytes; idx++) {
+                    mes.msg_bytes[idx] = pkt[ndecoded++];
                 }
-                else if (pkt[ndecoded+1] == 0xF7) {
-                    // was sysex, now sysex is over; push the last data packet, then the F7 packet on the next iteration.
-                    uint8_t bytecount = (mes.nbytes & ble_midi_packet_nbytes_mask);
-                    if (bytecount > 0) {
-                        if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                            ndecoded -= bytecount;
-                            return ndecoded;
-                        }
-                    }
-                    mes.nbytes = 0; // clear is_sysex flag
+                if (!ble_midi_pkt_codec_deliver(context, &mes)) {
+                    ndecoded -= running_status_nbytes;
+                    return ndecoded;
                 }
-            }
-            else if ((pkt[ndecoded] & 0x80) != 0 && (pkt[ndecoded+1] & 0x80) == 0) {
-                // This pattern could be a channel message running status timestamp followed by the channel message data byte(s)
-                if (running_status != 0 && (ndecoded + running_status_nbytes) <= nbytes) {
-                    mes.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
-                    mes.msg_bytes[0] = running_status;
-                    mes.nbytes = running_status_nbytes | ble_midi_packet_is_channel;
-                    for (uint8_t idx = 1; idx < running_status_nbytes; idx++) {
-                        mes.msg_bytes[idx] = pkt[ndecoded++];
-                    }
-                    if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                        ndecoded -= running_status_nbytes;
+                state_actions = ble_midi_decode_action[BLE_MIDI_DECODE_MESSAGE];
+                break;
+            case BLE_MIDI_ACTION_RUNNING_STATUS:
+                // new data for a running status channel message with the same timestamp as the previous message
+                if (running_status != mes.msg_bytes[0] || (mes.nbytes & ble_midi_packet_is_channel) == 0 ||
+                        (ndecoded + running_status_nbytes - 1) > nbytes) {
+                    return ndecoded;
+                }
+                for (uint8_t idx = 1; idx < running_status_nbytes; idx++) {
+                    mes.msg_bytes[idx] = pkt[ndecoded + idx - 1];
+                    if ((mes.msg_bytes[idx] & 0x80) != 0) {
                         return ndecoded;
                     }
                 }
-                else {
-                    // the pattern of timestamp plus not-timestamp is not legal otherwise at the beginning of a message
+                if (!ble_midi_pkt_codec_deliver(context, &mes)) {
                     return ndecoded;
                 }
-            }
-            else if ((pkt[ndecoded] & 0x80) == 0 && (pkt[ndecoded+1] & 0x80) == 0) {
-                if (running_status == mes.msg_bytes[0] && (mes.nbytes & ble_midi_packet_is_channel) != 0 &&  (ndecoded + running_status_nbytes - 1) <= nbytes) {
-                    // this is a running status channel message same as previous message with the same timestamp and new data
-                    // status byte is already correct, and the there are enough data bytes in the undecoded (at least the full message length - 1)
-                    for (uint8_t idx = 1; idx < running_status_nbytes; idx++) {
-                        mes.msg_bytes[idx] = pkt[ndecoded++];
-                    }
-                    if (!midi_service_stream_push(&context->from_ble, (uint8_t*)&mes, sizeof(mes))) {
-                        ndecoded -= (running_status_nbytes-1);
-                        return ndecoded;
-                    }
+                ndecoded += running_status_nbytes - 1;
+                break;
+            case BLE_MIDI_ACTION_CHANNEL:
+                mes.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
+                mes.msg_bytes[0] = pkt[ndecoded++];
+                running_status = mes.msg_bytes[0];
+                running_status_nbytes = BLE_MIDI_BYTE_MSG_LEN(running_status);
+                if ((running_status_nbytes + ndecoded - 1) > nbytes) {
+                    return ndecoded;
                 }
-                else {
-                    // this should not happen
+                for (uint8_t idx = 1; idx < running_status_nbytes; idx++) {
+                    mes.msg_bytes[idx] = pkt[ndecoded++];
+                }
+                mes.nbytes = running_status_nbytes | ble_midi_packet_is_channel;
+                if (!ble_midi_pkt_codec_deliver(context, &mes)) {
+                    --ndecoded;
+                    return ndecoded;
+                }
+                break;
+            case BLE_MIDI_ACTION_COMMON:
+                mes.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
+                mes.msg_bytes[0] = pkt[ndecoded++];
+                len = BLE_MIDI_BYTE_MSG_LEN(mes.msg_bytes[0]);
+                mes.nbytes = len;
+                if ((ndecoded + len - 1) > nbytes) {
+                    return ndecoded;
+                }
+                for (uint8_t idx = 1; idx < len; idx++) {
+                    mes.msg_bytes[idx] = pkt[ndecoded++];
+                }
+                if (!ble_midi_pkt_codec_deliver(context, &mes)) {
+                    --ndecoded;
+                    return ndecoded;
+                }
+                break;
+            case BLE_MIDI_ACTION_REAL_TIME:
+                mes.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
+                mes.msg_bytes[0] = pkt[ndecoded++];
+                mes.nbytes = ble_midi_packet_is_real_time + 1;
+                if (!ble_midi_pkt_codec_deliver(context, &mes)) {
+                    return ndecoded;
+                }
+                break;
+            case BLE_MIDI_ACTION_SYSEX_START:
+                // keep decoding until encountering a new timestamp.
+                mes.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
+                mes.msg_bytes[0] = pkt[ndecoded++];
+                mes.nbytes = ble_midi_packet_is_sysex + 1;
+                if (!ble_midi_pkt_codec_decode_sysex_data(pkt, nbytes, context, &mes, &ndecoded, 1)) {
+                    return ndecoded;
+                }
+                state_actions = ble_midi_decode_action[BLE_MIDI_DECODE_SYSEX];
+                break;
+            case BLE_MIDI_ACTION_SYSEX_REAL_TIME: {
+                // This is a real-time message timestamp and status byte within a sysex message
+                ble_midi_message_t mes_rt = {0, {0,0,0}, 0};
+                mes_rt.nbytes = ble_midi_packet_is_real_time + 1;
+                mes_rt.timestamp_ms = midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
+                mes_rt.msg_bytes[0] = pkt[ndecoded++];
+                if (!ble_midi_pkt_codec_deliver(context, &mes_rt)) {
+                    ndecoded -= 2;
+                    return ndecoded;
+                }
+                // real-time packet is out of the way, continue parsing the data
+                mes.nbytes = ble_midi_packet_is_sysex;
+                if (!ble_midi_pkt_codec_decode_sysex_data(pkt, nbytes, context, &mes, &ndecoded, 0)) {
                     return ndecoded;
                 }
+                break;
             }
+            case BLE_MIDI_ACTION_SYSEX_END:
+                if (context->sysex_cb != NULL) {
+                    // the 0xF7 completes the message
+                    midi_service_timestamp_decode(&timestamp, pkt[ndecoded++], &prev_lsb);
+                    if (context->in_sysex) {
+                        context->sysex_cb(pkt + ndecoded, 1, true, context->sysex_cb_context);
+                    }
+                    ndecoded++;
+                    context->in_sysex = false;
+                }
+                // otherwise the sysex data is all delivered; decode the timestamp and
+                // 0xF7 as a one-byte system common message on the next pass
+                mes.nbytes = 0;
+                state_actions = ble_midi_decode_action[BLE_MIDI_DECODE_MESSAGE];
+                break;
+            default:
+                // the byte sequence is not legal here
+                return ndecoded;
         }
     }
     return ndecoded;
@@ -633,18 +746,89 @@ uint16_t ble_midi_pkt_codec_ble_midi_decode_push(const uint8_t* pkt, uint16_t nb
 uint16_t ble_midi_pkt_codec_pop_midi(ble_midi_message_t* mes, ble_midi_codec_data_t* context)
 {
     uint8_t nbytes = 0;
-    if (context != NULL && ring_buffer_get_num_bytes(&context->from_ble) >= sizeof(*mes)) {
-        nbytes = ring_buffer_pop(&context->from_ble, (uint8_t*)mes, sizeof(*mes));
+    if (context != NULL && ble_midi_block_queue_get_num_bytes(&context->from_ble) >= sizeof(*mes)) {
+        nbytes = ble_midi_block_queue_pop(&context->from_ble, (uint8_t*)mes, sizeof(*mes));
     }
     return nbytes;
 }
 
+uint16_t ble_midi_pkt_codec_pop_midi_batch(ble_midi_message_t* mes, uint16_t max_mes, ble_midi_codec_data_t* context)
+{
+    if (context == NULL)
+        return 0;
+    // The decoder only pushes whole messages, so one pop always returns a
+    // whole number of messages
+    uint16_t max_buffered = ble_midi_block_queue_get_num_bytes(&context->from_ble) / sizeof(*mes);
+    if (max_mes > max_buffered)
+        max_mes = max_buffered;
+    uint16_t npopped = ble_midi_block_queue_pop(&context->from_ble, (uint8_t*)mes, max_mes * sizeof(*mes));
+    return npopped / sizeof(*mes);
+}
+
+int ble_midi_pkt_codec_get_push_midi_cost(ble_midi_codec_data_t* context, uint16_t nbytes)
+{
+    // Each stream byte encodes to at most 2 packet bytes (a timestamp and a
+    // status byte), and each packet adds a header byte and its record length.
+    // A packet is finished once it cannot hold the largest message.
+    uint32_t npackets = 2 + (2u * nbytes) / MAX(context->ble_mtu - 4, 1);
+    uint32_t max_queued = BLE_MIDI_PKT_RECORD_LEN(context->to_ble_midi_stream.pending_ble_pkt.nbytes) +
+        2u * nbytes + npackets * BLE_MIDI_PKT_RECORD_LEN(1);
+    if (max_queued > UINT16_MAX)
+        return -1;
+    return ble_midi_block_queue_get_push_cost(&context->to_ble, max_queued);
+}
+
+void ble_midi_pkt_codec_set_coalesce_window(ble_midi_codec_data_t* context, uint32_t window_us)
+{
+    context->coalesce_window_us = window_us;
+}
+
+bool ble_midi_pkt_codec_flush_coalesced(ble_midi_codec_data_t* context, uint32_t* wait_us)
+{
+    to_ble_midi_stream_t* ble_midi_stream = &context->to_ble_midi_stream;
+    *wait_us = 0;
+    if (ble_midi_stream->pending_ble_pkt.nbytes > 0) {
+        uint32_t elapsed_us = time_us_32() - ble_midi_stream->pending_ble_pkt_start_us;
+        if (elapsed_us >= context->coalesce_window_us) {
+            midi_service_stream_push_pending_pkt(context);
+        }
+        else {
+            *wait_us = context->coalesce_window_us - elapsed_us;
+        }
+    }
+    return ble_midi_pkt_codec_ble_pkt_available(context);
+}
+
+uint32_t ble_midi_pkt_codec_coalesce_timeout_ms(uint32_t wait_us)
+{
+    return (wait_us + 999) / 1000;
+}
+
 uint16_t ble_midi_pkt_codec_ble_pkt_pop(ble_midi_packet_t* pkt, ble_midi_codec_data_t* context)
 {
-    return ring_buffer_pop(&context->to_ble, (uint8_t*)pkt, sizeof(*pkt));
+    // packets are pushed as whole records, so a record's nbytes is never alone in the buffer
+    if (ble_midi_block_queue_peek(&context->to_ble, (uint8_t*)&pkt->nbytes, sizeof(pkt->nbytes)) != sizeof(pkt->nbytes))
+        return 0;
+    ble_midi_block_queue_pop(&context->to_ble, (uint8_t*)pkt, BLE_MIDI_PKT_RECORD_LEN(pkt->nbytes));
+    return sizeof(*pkt);
 }
 
 bool ble_midi_pkt_codec_ble_pkt_available(ble_midi_codec_data_t* context)
 {
-    return ring_buffer_get_num_bytes(&context->to_ble) >= sizeof(ble_midi_packet_t);
+    return ble_midi_block_queue_get_num_bytes(&context->to_ble) > 0;
+}
+
+uint64_t ble_midi_pkt_codec_get_local_time_us(ble_midi_codec_data_t* context, uint16_t timestamp_ms)
+{
+    return ble_midi_clock_sync_to_local_us(&context->clock_sync, timestamp_ms);
+}
+
+const ble_midi_clock_sync_t* ble_midi_pkt_codec_get_clock_sync(ble_midi_codec_data_t* context)
+{
+    return &context->clock_sync;
+}
+
+uint16_t ble_midi_pkt_codec_get_pool_blocks_held(ble_midi_codec_data_t* context)
+{
+    return context->pool_owner.nheld;
 }
\ No newline at end of file
@@ -27,20 +27,23 @@
 #include <stdint.h>
 #include "btstack_config.h" // for ENABLE_LE_DATA_LENGTH_EXTENSION & BLE_MIDI_SERVER_MAX_CONNECTIONS
 #include "bluetooth.h"  // for ATT_DEFAULT_MTU
+#include "ble_midi_clock_sync.h"
 
 #if defined __cplusplus
 extern "C" {
 #else
 #include <stdbool.h>
 #endif
-// This driver makes use of the LE Data Packet Length Extension feature to improve throughput
+// This driver makes use of the LE Data Packet Length Extension feature to improve throughput.
+// The longest packet is the longest link layer payload less the 4 byte L2CAP
+// and 3 byte ATT headers, so that a full packet is never fragmented.
 #ifdef ENABLE_LE_DATA_LENGTH_EXTENSION
-#define MAX_BLE_MIDI_PACKET 251-3
+#define MAX_BLE_MIDI_PACKET (251-4-3)
 #else
 #define MAX_BLE_MIDI_PACKET ATT_DEFAULT_MTU-3
 #endif
 
-// This structure is used to hold BLE-MIDI 1.0 data packets in a ring_buffer
+// This structure is used to hold BLE-MIDI 1.0 data packets
 typedef struct ble_midi_packet_s {
     uint16_t nbytes;
     uint8_t pkt[MAX_BLE_MIDI_PACKET];
@@ -77,26 +80,110 @@ static const uint8_t ble_midi_packet_is_real_time = 0x10;
 static const uint8_t ble_midi_packet_is_channel = 0x08;
 static const uint8_t ble_midi_packet_nbytes_mask = 0x03;
 
+/**
+ * @brief the function ble_midi_pkt_codec_ble_midi_decode_push() calls for each decoded message
+ * when the context is in callback mode
+ *
+ * @param mes the decoded message; it is only valid for the duration of the call
+ * @param cb_context the cb_context pointer passed to ble_midi_pkt_codec_set_message_callback()
+ */
+typedef void (*ble_midi_pkt_codec_message_cb_t)(const ble_midi_message_t* mes, void* cb_context);
+
+/**
+ * @brief the function the decoder calls with each run of system exclusive bytes
+ * when the context has a sysex callback
+ *
+ * @param sysex the system exclusive bytes. They point into the packet being
+ * decoded, so they are only valid for the duration of the call
+ * @param nbytes the number of bytes in sysex
+ * @param complete true if sysex is the 0xF7 that ends the message. The first
+ * run of a message starts with the 0xF0.
+ * @param cb_context the cb_context pointer passed to ble_midi_pkt_codec_set_sysex_callback()
+ */
+typedef void (*ble_midi_pkt_codec_sysex_cb_t)(const uint8_t* sysex, uint16_t nbytes, bool complete, void* cb_context);
+
+/**
+ * @brief get a connection's encoder/decoder context
+ *
+ * @param idx 0 to BLE_MIDI_SERVER_MAX_CONNECTIONS - 1 for the server's
+ * connections, then BLE_MIDI_POOL_CLIENT_OWNERS more for the client's
+ * @return the context, or NULL if idx is out of range
+ */
 ble_midi_codec_data_t* ble_midi_pkt_codec_get_data_by_index(uint8_t idx);
 
 void ble_midi_pkt_codec_init_data(ble_midi_codec_data_t* context, uint16_t ble_mtu);
 
+/**
+ * @brief return a connection's queued packets and messages to the shared pool
+ *
+ * Call this when the connection goes away, so the blocks it holds do not
+ * starve the other connections until this one reconnects.
+ *
+ * @param context the data associated with a BLE-MIDI 1.0 connection
+ */
+void ble_midi_pkt_codec_release_data(ble_midi_codec_data_t* context);
+
 void ble_midi_pkt_codec_update_mtu(ble_midi_codec_data_t* context, uint16_t ble_mtu);
 
 void ble_midi_pkt_codec_set_mtu(ble_midi_codec_data_t* context, uint16_t ble_mtu);
 
 uint16_t ble_midi_pkt_codec_get_mtu(ble_midi_codec_data_t* context);
+
+/**
+ * @brief select where ble_midi_pkt_codec_ble_midi_decode_push() sends decoded messages
+ *
+ * By default, decoded messages are pushed to the context's ring buffer and
+ * the application pops them with ble_midi_pkt_codec_pop_midi(). If message_cb
+ * is not NULL, each decoded message is instead passed to message_cb as soon
+ * as it is decoded, in the caller's context (normally the BTstack run loop),
+ * and the ring buffer is not used.
+ *
+ * @param context the data assocated with a BLE-MIDI 1.0 connection
+ * @param message_cb the callback function, or NULL to use the ring buffer
+ * @param cb_context a pointer passed to every call of message_cb
+ */
+void ble_midi_pkt_codec_set_message_callback(ble_midi_codec_data_t* context, ble_midi_pkt_codec_message_cb_t message_cb, void* cb_context);
+
+/**
+ * @brief pass system exclusive bytes to a callback instead of decoding them to fragments
+ *
+ * By default, system exclusive messages are decoded to 3-byte fragments that
+ * are delivered like other messages. If sysex_cb is not NULL, the decoder
+ * passes each whole run of system exclusive bytes in a packet, from the 0xF0
+ * through the 0xF7, to sysex_cb without copying it. Real-time messages inside
+ * the system exclusive message are still delivered as messages.
+ *
+ * @param context the data assocated with a BLE-MIDI 1.0 connection
+ * @param sysex_cb the function that receives the bytes, or NULL to decode system exclusive messages to fragments
+ * @param cb_context a pointer passed to every call of sysex_cb
+ */
+void ble_midi_pkt_codec_set_sysex_callback(ble_midi_codec_data_t* context, ble_midi_pkt_codec_sysex_cb_t sysex_cb, void* cb_context);
 /**
  * @brief push a MIDI stream to be encoded into the next BLE-MIDI 1.0 encoded packet
  * 
  * @param midi_stream a MIDI 1.0 byte stream (can be incomplete message)
  * @param nbytes number of bytes in the stream
  * @param context the data assocated with a BLE-MIDI 1.0 connection
- * @param ready_to_send true if a full MIDI packet is ready to be sent
+ * @param ready_to_send true if a full MIDI packet is ready to be sent or, if the
+ * context has a coalescing window, if a packet is collecting messages to send
  * @return uint16_t the number of bytes pushed
  */
 uint16_t ble_midi_pkt_codec_push_midi(const uint8_t* midi_stream, uint16_t nbytes, ble_midi_codec_data_t* context, bool* ready_to_send);
 
+/**
+ * @brief get the number of unreserved pool blocks pushing a MIDI stream may borrow
+ *
+ * ble_midi_pkt_codec_push_midi() drops a finished packet if the queue of
+ * packets to send cannot get pool blocks for it. The cost assumes the worst
+ * case encoding, so if the pool can lend this many blocks, no packet the
+ * stream completes is dropped.
+ *
+ * @param context the data assocated with a BLE-MIDI 1.0 connection
+ * @param nbytes number of bytes in the stream
+ * @return the number of blocks, or -1 if the connection's pool quota cannot hold the packets
+ */
+int ble_midi_pkt_codec_get_push_midi_cost(ble_midi_codec_data_t* context, uint16_t nbytes);
+
 /**
  * @brief pop the least recently pushed decoded ble_midi_message_t timestamped MIDI 1.0
  * message from the ring buffer
@@ -107,9 +194,21 @@ uint16_t ble_midi_pkt_codec_push_midi(const uint8_t* midi_stream, uint16_t nbyte
  */
 uint16_t ble_midi_pkt_codec_pop_midi(ble_midi_message_t* mes, ble_midi_codec_data_t* context);
 
+/**
+ * @brief pop up to max_mes of the least recently pushed decoded ble_midi_message_t
+ * timestamped MIDI 1.0 messages from the ring buffer in one operation
+ *
+ * @param mes a pointer to storage for an array of at least max_mes messages
+ * @param max_mes the maximum number of messages to pop
+ * @param context the data assocated with a BLE-MIDI 1.0 connection
+ * @return uint16_t the number of messages stored in mes (0 if the ring buffer is empty)
+ */
+uint16_t ble_midi_pkt_codec_pop_midi_batch(ble_midi_message_t* mes, uint16_t max_mes, ble_midi_codec_data_t* context);
+
 /**
  * @brief send a MIDI 1.0 encoded data packet to be decoded and cause each resulting timestamped
- * MIDI message to be pushed to the context's ring buffer.
+ * MIDI message to be pushed to the context's ring buffer, or passed to the context's
+ * message callback if one is set.
  * 
  * @param pkt a BLE-MIDI 1.0 formatted packet
  * @param nbytes the number of bytes in the packet
@@ -118,6 +217,44 @@ uint16_t ble_midi_pkt_codec_pop_midi(ble_midi_message_t* mes, ble_midi_codec_dat
  */
 uint16_t ble_midi_pkt_codec_ble_midi_decode_push(const uint8_t* pkt, uint16_t nbytes, ble_midi_codec_data_t* context);
 
+/**
+ * @brief collect the messages pushed within a time window into one packet
+ *
+ * By default, ble_midi_pkt_codec_push_midi() finishes the packet it encodes
+ * before it returns, so every call makes at least one packet. With a window,
+ * the packet stays open for more messages until it is nearly full or until
+ * ble_midi_pkt_codec_flush_coalesced() finds the window has elapsed.
+ *
+ * @param context the data associated with a BLE-MIDI 1.0 connection
+ * @param window_us the window in microseconds, measured from the first message
+ * in the packet, or 0 to finish every packet right away
+ */
+void ble_midi_pkt_codec_set_coalesce_window(ble_midi_codec_data_t* context, uint32_t window_us);
+
+/**
+ * @brief finish the packet that is collecting messages if its window has elapsed
+ *
+ * Call this when the Bluetooth stack is ready to send.
+ *
+ * @param context the data associated with a BLE-MIDI 1.0 connection
+ * @param wait_us set to the number of microseconds left in the window if a
+ * packet is still collecting messages, otherwise set to 0
+ * @return true if there is at least one BLE-MIDI packet available to send
+ */
+bool ble_midi_pkt_codec_flush_coalesced(ble_midi_codec_data_t* context, uint32_t* wait_us);
+
+/**
+ * @brief convert the wait from ble_midi_pkt_codec_flush_coalesced() to a run loop timeout
+ *
+ * The run loop timer has 1 ms resolution. The wait is rounded up so the timer
+ * never fires before the window ends; a 0 ms timer would fire on every pass
+ * of the run loop until then.
+ *
+ * @param wait_us the wait in microseconds
+ * @return the timeout in milliseconds
+ */
+uint32_t ble_midi_pkt_codec_coalesce_timeout_ms(uint32_t wait_us);
+
 /**
  * @brief pop the next ble_midi_packet_t from the context's packet to send ring buffer
  * 
@@ -134,6 +271,35 @@ uint16_t ble_midi_pkt_codec_ble_pkt_pop(ble_midi_packet_t* pkt, ble_midi_codec_d
  * @return true if there is at least one BLE-MIDI packet available to send
  */
 bool ble_midi_pkt_codec_ble_pkt_available(ble_midi_codec_data_t* context);
+
+/**
+ * @brief map a decoded message timestamp to local time
+ *
+ * Every received packet updates an estimate of the sender's clock offset and
+ * drift; see ble_midi_clock_sync.h.
+ *
+ * @param context the data associated with a BLE-MIDI 1.0 connection
+ * @param timestamp_ms the timestamp_ms of a recently decoded message
+ * @return the local time in microseconds on the time_us_64() clock
+ */
+uint64_t ble_midi_pkt_codec_get_local_time_us(ble_midi_codec_data_t* context, uint16_t timestamp_ms);
+
+/**
+ * @brief get the context's clock tracking state, e.g. for
+ * ble_midi_clock_sync_get_drift_ppm()
+ *
+ * @param context the data associated with a BLE-MIDI 1.0 connection
+ * @return the clock tracking state
+ */
+const ble_midi_clock_sync_t* ble_midi_pkt_codec_get_clock_sync(ble_midi_codec_data_t* context);
+
+/**
+ * @brief get the number of shared pool blocks the context's queues hold
+ *
+ * @param context the data associated with a BLE-MIDI 1.0 connection
+ * @return the number of blocks; see ble_midi_block_pool_get_stats() for the whole pool
+ */
+uint16_t ble_midi_pkt_codec_get_pool_blocks_held(ble_midi_codec_data_t* context);
 #if defined __cplusplus
 }
 #endif
\ No newline at end of file
@@ -24,9 +24,13 @@
  */
 #include <stdio.h>
 #include "ble_midi_server.h"
+#include "ble_midi_ecc.h"
 #include <inttypes.h>
 #include <assert.h>
-static hci_con_handle_t con_handle;
+// The connections with MIDI notifications enabled; unused entries are HCI_CON_HANDLE_INVALID
+static hci_con_handle_t con_handles[BLE_MIDI_SERVER_MAX_CONNECTIONS];
+// The connection ble_midi_server_stream_read() tries first
+static uint8_t next_read_idx;
 static const uint8_t APP_AD_FLAGS=0x06;
 static const uint8_t adv_data[] = {
         // Flags general discoverable
@@ -39,6 +43,128 @@ static uint8_t scan_resp_data[32];
 static uint8_t scan_resp_data_len;
 static btstack_packet_callback_registration_t sm_event_callback_registration;
 static bool initialized = false;
+
+// The advertising schedule: directed to the last central, then fast, then slow
+typedef enum {
+    ADV_PHASE_DIRECTED,
+    ADV_PHASE_FAST,
+    ADV_PHASE_SLOW,
+} adv_phase_t;
+static adv_phase_t adv_phase;
+static btstack_timer_source_t adv_timer;
+
+// The central that bonded or reconnected most recently, kept in the TLV store
+// so directed advertising can find it after a power cycle
+#define BLE_MIDI_SERVER_TLV_TAG_LAST_PEER (((uint32_t)'M' << 24) | ((uint32_t)'I' << 16) | ((uint32_t)'D' << 8) | 'P')
+typedef struct __attribute__((packed)) {
+    uint8_t addr_type;
+    bd_addr_t addr;
+} last_peer_t;
+static last_peer_t last_peer;
+static bool have_last_peer;
+
+static void add_connection(hci_con_handle_t handle)
+{
+    int free_idx = -1;
+    for (int idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        if (con_handles[idx] == handle)
+            return; // notifications were enabled again
+        if (free_idx < 0 && con_handles[idx] == HCI_CON_HANDLE_INVALID)
+            free_idx = idx;
+    }
+    if (free_idx >= 0)
+        con_handles[free_idx] = handle;
+}
+
+static void remove_connection(hci_con_handle_t handle)
+{
+    for (int idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        if (con_handles[idx] == handle)
+            con_handles[idx] = HCI_CON_HANDLE_INVALID;
+    }
+}
+
+// Return true if the LE device DB still holds the bonding information for the last peer
+static bool last_peer_is_bonded()
+{
+    for (int idx = 0; idx < le_device_db_max_count(); idx++) {
+        int addr_type;
+        bd_addr_t addr;
+        le_device_db_info(idx, &addr_type, addr, NULL);
+        if (addr_type == last_peer.addr_type && bd_addr_cmp(addr, last_peer.addr) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void load_last_peer()
+{
+    const btstack_tlv_t* tlv_impl;
+    void* tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    have_last_peer = tlv_impl != NULL &&
+        tlv_impl->get_tag(tlv_context, BLE_MIDI_SERVER_TLV_TAG_LAST_PEER, (uint8_t*)&last_peer, sizeof(last_peer)) == sizeof(last_peer) &&
+        last_peer_is_bonded();
+}
+
+static void save_last_peer(uint8_t addr_type, const bd_addr_t addr)
+{
+    if (have_last_peer && last_peer.addr_type == addr_type && bd_addr_cmp(last_peer.addr, addr) == 0)
+        return; // already saved; spare the flash
+    last_peer.addr_type = addr_type;
+    bd_addr_copy(last_peer.addr, addr);
+    have_last_peer = true;
+    const btstack_tlv_t* tlv_impl;
+    void* tlv_context;
+    btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+    if (tlv_impl != NULL)
+        tlv_impl->store_tag(tlv_context, BLE_MIDI_SERVER_TLV_TAG_LAST_PEER, (const uint8_t*)&last_peer, sizeof(last_peer));
+}
+
+static void adv_timeout(btstack_timer_source_t* ts);
+
+static void set_adv_phase(adv_phase_t phase)
+{
+    bd_addr_t null_addr;
+    memset(null_addr, 0, 6);
+    btstack_run_loop_remove_timer(&adv_timer);
+    adv_phase = phase;
+    // BTstack stops advertising to change the parameters if it has to
+    switch (phase) {
+        case ADV_PHASE_DIRECTED:
+            printf("ble server: advertising to %s\n", bd_addr_to_str(last_peer.addr));
+            // ADV_DIRECT_IND, high duty cycle; the interval is not used
+            gap_advertisements_set_params(0, 0, 0x01, last_peer.addr_type, last_peer.addr, 0x07, 0x00);
+            btstack_run_loop_set_timer(&adv_timer, BLE_MIDI_SERVER_DIRECTED_ADV_MS);
+            btstack_run_loop_add_timer(&adv_timer);
+            break;
+        case ADV_PHASE_FAST:
+            gap_advertisements_set_params(BLE_MIDI_SERVER_FAST_ADV_INTERVAL_MIN, BLE_MIDI_SERVER_FAST_ADV_INTERVAL_MAX, 0, 0, null_addr, 0x07, 0x00);
+            btstack_run_loop_set_timer(&adv_timer, BLE_MIDI_SERVER_FAST_ADV_MS);
+            btstack_run_loop_add_timer(&adv_timer);
+            break;
+        case ADV_PHASE_SLOW:
+        default:
+            gap_advertisements_set_params(BLE_MIDI_SERVER_SLOW_ADV_INTERVAL, BLE_MIDI_SERVER_SLOW_ADV_INTERVAL, 0, 0, null_addr, 0x07, 0x00);
+            break;
+    }
+}
+
+static void adv_timeout(btstack_timer_source_t* ts)
+{
+    UNUSED(ts);
+    set_adv_phase(adv_phase == ADV_PHASE_DIRECTED ? ADV_PHASE_FAST : ADV_PHASE_SLOW);
+}
+
+// Start the advertising schedule over, e.g. after a central disconnects
+static void restart_adv_schedule()
+{
+    if (have_last_peer && ble_midi_server_get_num_connections() == 0)
+        set_adv_phase(ADV_PHASE_DIRECTED);
+    else
+        set_adv_phase(ADV_PHASE_FAST);
+}
+
 static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
 {
    UNUSED(size);
@@ -48,11 +174,6 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
     bd_addr_t addr;
     bd_addr_type_t addr_type;
     uint8_t status;
-    // setup advertisements
-    uint16_t adv_int_min = 800;
-    uint16_t adv_int_max = 800;
-    uint8_t adv_type = 0;
-    bd_addr_t null_addr;
     switch(packet_type) {
         case HCI_EVENT_PACKET:
             event_type = hci_event_packet_get_type(packet);
@@ -64,8 +185,8 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
                     gap_local_bd_addr(local_addr);
                     printf("BTstack up and running on %s.\n", bd_addr_to_str(local_addr));
 
-                    memset(null_addr, 0, 6);
-                    gap_advertisements_set_params(adv_int_min, adv_int_max, adv_type, 0, null_addr, 0x07, 0x00);
+                    load_last_peer();
+                    restart_adv_schedule();
                     assert(adv_data_len <= 31); // ble limitation
                     gap_advertisements_set_data(adv_data_len, (uint8_t*) adv_data);
                     assert(scan_resp_data_len <= 31); // ble limitation
@@ -73,19 +194,35 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
                     gap_advertisements_enable(1);
 
                     break;
-                case HCI_EVENT_DISCONNECTION_COMPLETE:
+                case HCI_EVENT_DISCONNECTION_COMPLETE: {
+                    hci_con_handle_t con_handle = hci_event_disconnection_complete_get_connection_handle(packet);
+                    // links where this device is the central belong to the BLE-MIDI client;
+                    // BTstack frees the connection only after this event is handled
+                    if (gap_get_role(con_handle) != HCI_ROLE_SLAVE)
+                        break;
                     printf("ble server: HCI_EVENT_DISCONNECTION_COMPLETE event\r\n");
-                    con_handle = HCI_CON_HANDLE_INVALID;
+                    remove_connection(con_handle);
+                    restart_adv_schedule();
+                    break;
+                }
+                case HCI_EVENT_LE_META:
+                    // a connection, or the end of directed advertising without one
+                    if (hci_event_le_meta_get_subevent_code(packet) == HCI_SUBEVENT_LE_CONNECTION_COMPLETE &&
+                            adv_phase == ADV_PHASE_DIRECTED) {
+                        set_adv_phase(ADV_PHASE_FAST);
+                    }
                     break;
                 case HCI_EVENT_GATTSERVICE_META:
                     switch(hci_event_gattservice_meta_get_subevent_code(packet)) {
                         case GATTSERVICE_SUBEVENT_SPP_SERVICE_CONNECTED:
-                            con_handle = gattservice_subevent_spp_service_connected_get_con_handle(packet);
-                            printf("ble server: GATTSERVICE_SUBEVENT_SPP_SERVICE_CONNECTED event handle = %u\r\n", con_handle);
+                            add_connection(gattservice_subevent_spp_service_connected_get_con_handle(packet));
+                            printf("ble server: GATTSERVICE_SUBEVENT_SPP_SERVICE_CONNECTED event handle = %u, %u of %u connected\r\n",
+                                gattservice_subevent_spp_service_connected_get_con_handle(packet),
+                                ble_midi_server_get_num_connections(), BLE_MIDI_SERVER_MAX_CONNECTIONS);
                             break;
                         case GATTSERVICE_SUBEVENT_SPP_SERVICE_DISCONNECTED:
                             printf("ble server: GATTSERVICE_SUBEVENT_SPP_SERVICE_DISCONNECTED event\r\n");
-                            con_handle = HCI_CON_HANDLE_INVALID;
+                            remove_connection(gattservice_subevent_spp_service_disconnected_get_con_handle(packet));
                             break;
                         default:
                             break;
@@ -105,10 +242,12 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
                 case SM_EVENT_IDENTITY_CREATED:
                     sm_event_identity_created_get_identity_address(packet, addr);
                     printf("ble server: Identity created: type %u address %s\n", sm_event_identity_created_get_identity_addr_type(packet), bd_addr_to_str(addr));
+                    save_last_peer(sm_event_identity_created_get_identity_addr_type(packet), addr);
                     break;
                 case SM_EVENT_IDENTITY_RESOLVING_SUCCEEDED:
                     sm_event_identity_resolving_succeeded_get_identity_address(packet, addr);
                     printf("ble server: Identity resolved: type %u address %s\n", sm_event_identity_resolving_succeeded_get_identity_addr_type(packet), bd_addr_to_str(addr));
+                    save_last_peer(sm_event_identity_resolving_succeeded_get_identity_addr_type(packet), addr);
                     break;
                 case SM_EVENT_IDENTITY_RESOLVING_FAILED:
                     sm_event_identity_created_get_address(packet, addr);
@@ -192,6 +331,16 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
     } // HCI_PACKET
 }
 
+// The security manager's events for the links where this device is the
+// peripheral. Every SM event starts with the connection handle; when the
+// BLE-MIDI client runs too, the links where this device is the central are its.
+static void sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+    if (packet_type == HCI_EVENT_PACKET && gap_get_role(little_endian_read_16(packet, 2)) == HCI_ROLE_MASTER)
+        return;
+    packet_handler(packet_type, channel, packet, size);
+}
+
 // TODO initialize scan response data and data length
 void ble_midi_server_init(const uint8_t* profile_data, const uint8_t* resp_data, const uint8_t resp_data_len, io_capability_t iocaps, uint8_t secmask)
 {
@@ -202,19 +351,32 @@ void ble_midi_server_init(const uint8_t* profile_data, const uint8_t* resp_data,
         initialized = false;
     }
 
-    con_handle = HCI_CON_HANDLE_INVALID;
+    for (int idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        con_handles[idx] = HCI_CON_HANDLE_INVALID;
+    }
+    next_read_idx = 0;
+    have_last_peer = false;
+    adv_phase = ADV_PHASE_FAST;
+    btstack_run_loop_set_timer_handler(&adv_timer, adv_timeout);
     l2cap_init();
 
+    // generate the P-256 keypair on core 1 while the controller starts up
+    ble_midi_ecc_init();
     sm_init();
 
     // just works, legacy pairing, with bonding
     sm_set_io_capabilities(iocaps);
     sm_set_authentication_requirements(secmask);
     // register for SM events
-    sm_event_callback_registration.callback = &packet_handler;
+    sm_event_callback_registration.callback = &sm_packet_handler;
     sm_add_event_handler(&sm_event_callback_registration);
     att_server_init(profile_data, NULL, NULL);
-    midi_service_stream_init(sm_event_callback_registration.callback);
+    // the GATT client only negotiates the ATT MTU
+    gatt_client_init();
+    midi_service_stream_init(packet_handler);
+    // The controller stops advertising when a central connects. BTstack
+    // starts it again as long as fewer than this many centrals are connected.
+    gap_set_max_number_peripheral_connections(BLE_MIDI_SERVER_MAX_CONNECTIONS);
 
     // turn on bluetooth
     hci_power_control(HCI_POWER_ON);
@@ -226,10 +388,13 @@ void ble_midi_server_deinit()
     if (!initialized)
         return;
     hci_power_control(HCI_POWER_OFF);
+    btstack_run_loop_remove_timer(&adv_timer);
     midi_service_stream_deinit();
+    gatt_client_deinit();
     att_server_deinit();
     sm_remove_event_handler(&sm_event_callback_registration);
 
+    ble_midi_ecc_deinit();
     sm_deinit();
     btstack_crypto_deinit();
     l2cap_deinit();
@@ -238,26 +403,100 @@ void ble_midi_server_deinit()
 
 uint8_t ble_midi_server_stream_read(uint8_t max_bytes, uint8_t* midi_stream_bytes, uint16_t* timestamp)
 {
-    if (ble_midi_server_is_connected())
-        return midi_service_stream_read(con_handle, max_bytes, midi_stream_bytes, timestamp);
+    // take turns so a busy connection cannot starve the others
+    for (uint8_t count = 0; count < BLE_MIDI_SERVER_MAX_CONNECTIONS; count++) {
+        hci_con_handle_t handle = con_handles[next_read_idx];
+        if (++next_read_idx >= BLE_MIDI_SERVER_MAX_CONNECTIONS)
+            next_read_idx = 0;
+        if (handle == HCI_CON_HANDLE_INVALID)
+            continue;
+        uint8_t nread = midi_service_stream_read(handle, max_bytes, midi_stream_bytes, timestamp);
+        if (nread > 0)
+            return nread;
+    }
     return 0;
 }
 
-uint8_t ble_midi_server_stream_write(uint8_t nbytes, const uint8_t* midi_stream_bytes)
+uint16_t ble_midi_server_stream_read_batch(hci_con_handle_t* con_handle, ble_midi_message_t* mes, uint16_t max_mes)
 {
     if (ble_midi_server_is_connected())
-        return midi_service_stream_write(con_handle, nbytes, midi_stream_bytes);
+        return midi_service_stream_read_batch(con_handle, mes, max_mes);
     return 0;
 }
 
+void ble_midi_server_set_message_callback(midi_service_stream_message_cb_t message_cb)
+{
+    midi_service_stream_set_message_callback(message_cb);
+}
+
+void ble_midi_server_set_sysex_callback(midi_service_stream_sysex_cb_t sysex_cb)
+{
+    midi_service_stream_set_sysex_callback(sysex_cb);
+}
+
+void ble_midi_server_set_coalesce_window(uint32_t window_us)
+{
+    midi_service_stream_set_coalesce_window(window_us);
+}
+
+void ble_midi_server_get_pool_stats(ble_midi_pool_stats_t* stats)
+{
+    ble_midi_block_pool_get_stats(stats);
+}
+
+uint64_t ble_midi_server_get_local_time_us(hci_con_handle_t con_handle, uint16_t timestamp_ms)
+{
+    return midi_service_stream_get_local_time_us(con_handle, timestamp_ms);
+}
+
+uint8_t ble_midi_server_stream_write(uint8_t nbytes, const uint8_t* midi_stream_bytes)
+{
+    // check every client has room first so the stream goes to all of them or none
+    bool connected = false;
+    uint16_t nborrow = 0;
+    for (int idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        if (con_handles[idx] == HCI_CON_HANDLE_INVALID)
+            continue;
+        int cost = midi_service_stream_get_write_cost(con_handles[idx], nbytes);
+        if (cost < 0)
+            return 0;
+        connected = true;
+        nborrow += cost;
+    }
+    if (!connected || nborrow > ble_midi_block_pool_get_num_lendable())
+        return 0;
+    for (int idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        if (con_handles[idx] != HCI_CON_HANDLE_INVALID)
+            midi_service_stream_write(con_handles[idx], nbytes, midi_stream_bytes);
+    }
+    return nbytes;
+}
+
 
 void ble_midi_server_request_disconnect()
 {
-    if (ble_midi_server_is_connected())
-        gap_disconnect(con_handle);
+    for (int idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        if (con_handles[idx] != HCI_CON_HANDLE_INVALID)
+            gap_disconnect(con_handles[idx]);
+    }
 }
 
 bool ble_midi_server_is_connected()
 {
-    return con_handle != HCI_CON_HANDLE_INVALID;
+    return ble_midi_server_get_num_connections() > 0;
+}
+
+uint8_t ble_midi_server_get_num_connections()
+{
+    uint8_t nconnected = 0;
+    for (int idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        if (con_handles[idx] != HCI_CON_HANDLE_INVALID)
+            ++nconnected;
+    }
+    return nconnected;
+}
+
+int ble_midi_server_get_connection_index(hci_con_handle_t con_handle)
+{
+    return midi_service_stream_get_connection_index(con_handle);
 }
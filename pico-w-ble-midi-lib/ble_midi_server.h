@@ -36,12 +36,45 @@
 #include "pico/cyw43_arch.h"
 #include "pico/btstack_cyw43.h"
 #include "midi_service_stream_handler.h"
+#include "ble_midi_block_pool.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+// Advertising intervals in units of 0.625 ms. After power up or a
+// disconnection the server advertises every 20-30 ms for
+// BLE_MIDI_SERVER_FAST_ADV_MS so centrals find it quickly, and then every
+// 500 ms to leave the radio to the connections.
+#ifndef BLE_MIDI_SERVER_FAST_ADV_INTERVAL_MIN
+#define BLE_MIDI_SERVER_FAST_ADV_INTERVAL_MIN 32
+#endif
+#ifndef BLE_MIDI_SERVER_FAST_ADV_INTERVAL_MAX
+#define BLE_MIDI_SERVER_FAST_ADV_INTERVAL_MAX 48
+#endif
+#ifndef BLE_MIDI_SERVER_SLOW_ADV_INTERVAL
+#define BLE_MIDI_SERVER_SLOW_ADV_INTERVAL 800
+#endif
+#ifndef BLE_MIDI_SERVER_FAST_ADV_MS
+#define BLE_MIDI_SERVER_FAST_ADV_MS 30000
+#endif
+
+// How long to advertise only to the most recent bonded central before
+// advertising to everyone. High duty cycle directed advertising may last at
+// most 1.28 s.
+#ifndef BLE_MIDI_SERVER_DIRECTED_ADV_MS
+#define BLE_MIDI_SERVER_DIRECTED_ADV_MS 1280
+#endif
+
 /**
  * @brief initialize BT hardware and stack and then start advertising
  *
+ * Up to BLE_MIDI_SERVER_MAX_CONNECTIONS centrals may connect at once. The
+ * server keeps advertising until they have all connected.
+ *
+ * If the central that bonded or reconnected most recently is still bonded,
+ * the server first advertises directly to it so it can reconnect without
+ * scanning for the server. The central is remembered across power cycles.
+ *
  * @param profile_data is automatically generated from the .gatt file
  * @param resp_data is the data to send in response to active scanning
  * @param resp_data_len is the number of bytes in the resp_data buffer
@@ -58,6 +91,9 @@ void ble_midi_server_deinit();
 /**
  * @brief read a MIDI stream from Bluetooth if connected and data is available
  *
+ * Each call reads from the next connection that has data, so every
+ * connected client gets a turn.
+ *
  * @param max_bytes is the maximum number of bytes that can be returned in the midi_stream_bytes buffer
  * @param midi_stream_bytes is buffer to receive bytes read
  * @param timestamp is the Bluetooth MIDI timestamp value
@@ -66,16 +102,85 @@ void ble_midi_server_deinit();
 uint8_t ble_midi_server_stream_read(uint8_t max_bytes, uint8_t* midi_stream_bytes, uint16_t* timestamp);
 
 /**
- * @brief write a MIDI stream to Bluetooth if connected
+ * @brief read every timestamped MIDI message buffered for one connection in one call
+ *
+ * See midi_service_stream_read_batch(). Call in a loop until it returns 0.
+ *
+ * @param con_handle is a pointer to storage for the connection handle of the sender
+ * @param mes is a pointer to storage for an array of at least max_mes messages
+ * @param max_mes is the maximum number of messages to read
+ * @returns the number of messages stored in mes
+ */
+uint16_t ble_midi_server_stream_read_batch(hci_con_handle_t* con_handle, ble_midi_message_t* mes, uint16_t max_mes);
+
+/**
+ * @brief deliver each MIDI message to a callback as soon as it is decoded
+ *
+ * Call after ble_midi_server_init(). The callback runs in the BTstack context
+ * and ble_midi_server_stream_read() returns nothing while it is registered.
+ *
+ * @param message_cb the callback function, or NULL to go back to buffering
+ * messages for ble_midi_server_stream_read()
+ */
+void ble_midi_server_set_message_callback(midi_service_stream_message_cb_t message_cb);
+
+/**
+ * @brief pass each run of system exclusive bytes to a callback as soon as it is decoded
+ *
+ * Call after ble_midi_server_init(). System exclusive messages then bypass the
+ * 3-byte message fragments entirely.
+ *
+ * @param sysex_cb the callback function, or NULL to go back to message fragments
+ */
+void ble_midi_server_set_sysex_callback(midi_service_stream_sysex_cb_t sysex_cb);
+
+/**
+ * @brief let MIDI written within a time window share one notification
+ *
+ * Call after ble_midi_server_init(). Each ble_midi_server_stream_write() call
+ * normally makes its own notification. With a window, bytes written until the
+ * window elapses or the packet fills go out together, which trades up to
+ * window_us of latency for fewer, fuller notifications.
+ *
+ * @param window_us the window in microseconds, or 0 to disable coalescing
+ */
+void ble_midi_server_set_coalesce_window(uint32_t window_us);
+
+/**
+ * @brief get the occupancy of the block pool that holds every connection's
+ * packet and message queues
+ *
+ * @param stats a pointer to storage for the statistics
+ */
+void ble_midi_server_get_pool_stats(ble_midi_pool_stats_t* stats);
+
+/**
+ * @brief map the timestamp of a message from a connected client to local time
+ *
+ * The server tracks each client's clock offset and drift from the timestamps
+ * of every received packet.
+ *
+ * @param con_handle the connection handle of the client that sent the message
+ * @param timestamp_ms the timestamp of a recently received message
+ * @return the local time in microseconds on the time_us_64() clock
+ */
+uint64_t ble_midi_server_get_local_time_us(hci_con_handle_t con_handle, uint16_t timestamp_ms);
+
+/**
+ * @brief write a MIDI stream to every connected Bluetooth client
+ *
+ * The stream is queued for every client or for none, so no client gets
+ * bytes twice if the caller writes the stream again.
  *
  * @param nbytes is the number of bytes to write
  * @param midi_stream_bytes is the buffer of bytes to write
- * @return the number of bytes from the stream actually written
+ * @return nbytes, or 0 if no client is connected or a client's queue does
+ * not have room for the stream
  */
 uint8_t ble_midi_server_stream_write(uint8_t nbytes, const uint8_t* midi_stream_bytes);
 
 /**
- * @brief request disconnection from currently connected Bluetooth client
+ * @brief request disconnection from every connected Bluetooth client
  *
  * This function returns before the disconnection is complete.
  */
@@ -88,6 +193,24 @@ void ble_midi_server_request_disconnect();
  */
 bool ble_midi_server_is_connected();
 
+/**
+ * @brief get the number of connected Bluetooth clients
+ *
+ * @return the number of clients with MIDI notifications enabled
+ */
+uint8_t ble_midi_server_get_num_connections();
+
+/**
+ * @brief get a small number that identifies a connected client
+ *
+ * See midi_service_stream_get_connection_index().
+ *
+ * @param con_handle the connection handle passed to the message and SysEx callbacks
+ * @return the index, from 0 to BLE_MIDI_SERVER_MAX_CONNECTIONS - 1, or -1
+ * if con_handle is not connected
+ */
+int ble_midi_server_get_connection_index(hci_con_handle_t con_handle);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -186,6 +186,10 @@ bool midi_service_server_request_can_send_now(btstack_context_callback_registrat
 	return att_server_request_to_send_notification(request, con_handle) == ERROR_CODE_SUCCESS;
 }
 
+bool midi_service_server_can_send_now(hci_con_handle_t con_handle){
+	return att_server_can_send_packet_now(con_handle) != 0;
+}
+
 int midi_service_server_send(hci_con_handle_t con_handle, const uint8_t * data, uint16_t size){
 	return att_server_notify(con_handle, midi_tx_value_handle, data, size);
 }
@@ -58,6 +58,16 @@ void midi_service_server_deinit();
  */
 bool midi_service_server_request_can_send_now(btstack_context_callback_registration_t * request, hci_con_handle_t con_handle);
 
+/**
+ * @brief Check if another notification can be sent right away
+ *
+ * Use this in the can send now callback to send more than one packet while
+ * the controller has ACL buffers free.
+ * @param con_handle
+ * @return true if midi_service_server_send would not fail for lack of buffers
+ */
+bool midi_service_server_can_send_now(hci_con_handle_t con_handle);
+
 /**
  * @brief Send data
  * @param con_handle
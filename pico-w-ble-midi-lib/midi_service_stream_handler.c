@@ -75,7 +75,9 @@
 #include "pico/stdlib.h"
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include "ble/att_server.h"
+#include "ble/gatt_client.h"
 #include "btstack_debug.h"
 #include "btstack_event.h"
 
@@ -85,23 +87,150 @@ typedef struct midi_service_stream_connection_s {
     hci_con_handle_t connection_handle;
     btstack_context_callback_registration_t send_request;
     ble_midi_codec_data_t* ble_midi_pkt_codec_data;
+    btstack_timer_source_t coalesce_timer;  // requests can send now when the coalescing window ends
+    bool coalesce_timer_active;
+    midi_service_stream_link_t link;    // the negotiated ATT MTU, data length and PHY
+    uint16_t traffic_npackets;  // packets sent and received in the current traffic window
+    uint16_t nquiet_windows;    // quiet traffic windows in a row
+    bool conn_params_idle;      // true if the idle connection parameters were requested last
     char name[7]; //"MIDI x" where x is A, B, C, D
 } midi_service_stream_connection_t;
 static midi_service_stream_connection_t midi_service_stream_connection[BLE_MIDI_SERVER_MAX_CONNECTIONS];
 
+// Number of slots in the connection handle to context map; a power of 2 with
+// at least one free slot so a lookup always ends
+#ifndef MIDI_SERVICE_STREAM_MAP_SIZE
+#define MIDI_SERVICE_STREAM_MAP_SIZE 8
+#endif
+static_assert((MIDI_SERVICE_STREAM_MAP_SIZE & (MIDI_SERVICE_STREAM_MAP_SIZE - 1)) == 0,
+    "MIDI_SERVICE_STREAM_MAP_SIZE must be a power of 2");
+static_assert(MIDI_SERVICE_STREAM_MAP_SIZE > BLE_MIDI_SERVER_MAX_CONNECTIONS,
+    "MIDI_SERVICE_STREAM_MAP_SIZE must be larger than BLE_MIDI_SERVER_MAX_CONNECTIONS");
+// Open addressed map from connection handle to context index + 1; 0 marks an
+// empty slot. Controllers hand out small consecutive handles, so the low bits
+// of the handle rarely collide.
+static uint8_t context_map[MIDI_SERVICE_STREAM_MAP_SIZE];
+
 static btstack_packet_callback_registration_t hci_event_callback_registration;
 static btstack_packet_handler_t client_packet_handler;
+static midi_service_stream_message_cb_t client_message_cb;
+static midi_service_stream_sysex_cb_t client_sysex_cb;
+static uint8_t next_read_batch_idx;
+// ends each traffic window for every connection
+static btstack_timer_source_t traffic_timer;
+static bool traffic_timer_active;
+#ifdef ENABLE_LE_DATA_LENGTH_EXTENSION
+// links still waiting for their LE Set Data Length command because the controller was busy
+static hci_con_handle_t data_length_pending[MAX_NR_HCI_CONNECTIONS];
+#endif
+
+// The longest link layer payload and its transmit time on the LE 1M PHY
+#define MIDI_SERVICE_STREAM_LE_MAX_TX_OCTETS 251
+#define MIDI_SERVICE_STREAM_LE_MAX_TX_TIME 2120
+// The shortest link layer payload, which every connection starts with
+#define MIDI_SERVICE_STREAM_LE_MIN_TX_OCTETS 27
+// LE_Set_PHY bit for the LE 2M PHY
+#define MIDI_SERVICE_STREAM_LE_PHY_2M_BIT 0x02
+
+static midi_service_stream_connection_t* get_context_for_conn_handle(hci_con_handle_t con_handle);
+
+static void midi_service_stream_request_conn_params(midi_service_stream_connection_t* context, bool idle)
+{
+    context->conn_params_idle = idle;
+    if (idle) {
+#ifdef MIDI_SERVICE_STREAM_DEBUG_CONN_PARAMS
+        printf("%s: idle, request %u-%u interval units, latency %u\r\n", context->name,
+            MIDI_SERVICE_STREAM_IDLE_INTERVAL_MIN, MIDI_SERVICE_STREAM_IDLE_INTERVAL_MAX, MIDI_SERVICE_STREAM_IDLE_LATENCY);
+#endif
+        gap_request_connection_parameter_update(context->connection_handle, MIDI_SERVICE_STREAM_IDLE_INTERVAL_MIN,
+            MIDI_SERVICE_STREAM_IDLE_INTERVAL_MAX, MIDI_SERVICE_STREAM_IDLE_LATENCY, MIDI_SERVICE_STREAM_IDLE_TIMEOUT);
+    }
+    else {
+#ifdef MIDI_SERVICE_STREAM_DEBUG_CONN_PARAMS
+        printf("%s: active, request %u-%u interval units, latency %u\r\n", context->name,
+            MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MIN, MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MAX, MIDI_SERVICE_STREAM_ACTIVE_LATENCY);
+#endif
+        gap_request_connection_parameter_update(context->connection_handle, MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MIN,
+            MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MAX, MIDI_SERVICE_STREAM_ACTIVE_LATENCY, MIDI_SERVICE_STREAM_ACTIVE_TIMEOUT);
+    }
+}
+
+// Count packets sent or received on a connection. Leave the idle connection
+// parameters as soon as the window is no longer quiet rather than at the end
+// of the window, so a burst after a quiet spell is only slowed briefly.
+static void midi_service_stream_count_traffic(midi_service_stream_connection_t* context, uint16_t npackets)
+{
+    context->traffic_npackets = MIN((uint32_t)context->traffic_npackets + npackets, UINT16_MAX);
+    if (context->conn_params_idle && context->traffic_npackets > MIDI_SERVICE_STREAM_QUIET_MAX_PACKETS) {
+        midi_service_stream_request_conn_params(context, false);
+    }
+}
+
+static void midi_service_stream_start_traffic_timer()
+{
+    if (!traffic_timer_active) {
+        btstack_run_loop_set_timer(&traffic_timer, MIDI_SERVICE_STREAM_TRAFFIC_WINDOW_MS);
+        btstack_run_loop_add_timer(&traffic_timer);
+        traffic_timer_active = true;
+    }
+}
+
+// End the traffic window. A connection switches to the idle parameters only
+// after MIDI_SERVICE_STREAM_IDLE_AFTER_MS of quiet windows, so the parameters
+// do not flap between songs or cues.
+static void midi_traffic_timeout(btstack_timer_source_t* ts)
+{
+    UNUSED(ts);
+    traffic_timer_active = false;
+    bool connected = false;
+    for (uint8_t idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        midi_service_stream_connection_t* context = midi_service_stream_connection + idx;
+        if (context->connection_handle == HCI_CON_HANDLE_INVALID)
+            continue;
+        connected = true;
+        if (context->traffic_npackets > MIDI_SERVICE_STREAM_QUIET_MAX_PACKETS) {
+            context->nquiet_windows = 0;
+        }
+        else if (!context->conn_params_idle &&
+                ++context->nquiet_windows >= MIDI_SERVICE_STREAM_IDLE_AFTER_MS / MIDI_SERVICE_STREAM_TRAFFIC_WINDOW_MS) {
+            midi_service_stream_request_conn_params(context, true);
+        }
+        context->traffic_npackets = 0;
+    }
+    if (connected)
+        midi_service_stream_start_traffic_timer();
+}
+
+static void midi_coalesce_timeout(btstack_timer_source_t* ts)
+{
+    midi_service_stream_connection_t* context = (midi_service_stream_connection_t*)btstack_run_loop_get_timer_context(ts);
+    context->coalesce_timer_active = false;
+    if (context->connection_handle != HCI_CON_HANDLE_INVALID) {
+        midi_service_server_request_can_send_now(&context->send_request, context->connection_handle);
+    }
+}
 
 static void midi_can_send(void * void_context)
 {
     midi_service_stream_connection_t* context = (midi_service_stream_connection_t*)void_context;
     ble_midi_packet_t pending_ble_pkt;
+    uint32_t wait_us;
+    uint8_t nsent = 0;
 
-    if (ble_midi_pkt_codec_ble_pkt_pop(&pending_ble_pkt, context->ble_midi_pkt_codec_data) == sizeof(pending_ble_pkt)) {
+    ble_midi_pkt_codec_flush_coalesced(context->ble_midi_pkt_codec_data, &wait_us);
+    // The callback may always send one packet. Send more while the controller
+    // has ACL buffers free instead of waiting for another callback for each,
+    // but leave MIDI_SERVICE_STREAM_ACL_RESERVE of them to other links.
+    while (nsent < MIDI_SERVICE_STREAM_MAX_BURST &&
+            (nsent == 0 || (midi_service_server_can_send_now(context->connection_handle) &&
+                hci_number_free_acl_slots_for_handle(context->connection_handle) > MIDI_SERVICE_STREAM_ACL_RESERVE)) &&
+            ble_midi_pkt_codec_ble_pkt_pop(&pending_ble_pkt, context->ble_midi_pkt_codec_data) == sizeof(pending_ble_pkt)) {
         midi_service_server_send(context->connection_handle, pending_ble_pkt.pkt, pending_ble_pkt.nbytes);
         //printf_hexdump(pending_ble_pkt.pkt, pending_ble_pkt.nbytes);
+        ++nsent;
     }
-    else {
+    midi_service_stream_count_traffic(context, nsent);
+    if (nsent == 0 && wait_us == 0) {
         printf("No MIDI to send\r\n");
     }
     if (ble_midi_pkt_codec_ble_pkt_available(context->ble_midi_pkt_codec_data)) {
@@ -110,13 +239,64 @@ static void midi_can_send(void * void_context)
             printf("midi_service_server_request_can_send_now failed\r\n");
         }
     }
+    else if (wait_us > 0 && !context->coalesce_timer_active) {
+        // A packet is still collecting messages
+        btstack_run_loop_set_timer(&context->coalesce_timer, ble_midi_pkt_codec_coalesce_timeout_ms(wait_us));
+        btstack_run_loop_add_timer(&context->coalesce_timer);
+        context->coalesce_timer_active = true;
+    }
 }
 
+static void midi_service_stream_stop_coalesce_timer(midi_service_stream_connection_t* context)
+{
+    if (context->coalesce_timer_active) {
+        btstack_run_loop_remove_timer(&context->coalesce_timer);
+        context->coalesce_timer_active = false;
+    }
+}
+
+#ifdef ENABLE_LE_DATA_LENGTH_EXTENSION
+// Send LE Set Data Length for the waiting links while the controller takes commands
+static void midi_service_stream_send_pending_data_length()
+{
+    for (uint8_t idx = 0; idx < MAX_NR_HCI_CONNECTIONS; idx++) {
+        if (data_length_pending[idx] == HCI_CON_HANDLE_INVALID)
+            continue;
+        if (!hci_can_send_command_packet_now())
+            return;
+        hci_send_cmd(&hci_le_set_data_length, data_length_pending[idx], MIDI_SERVICE_STREAM_LE_MAX_TX_OCTETS, MIDI_SERVICE_STREAM_LE_MAX_TX_TIME);
+        data_length_pending[idx] = HCI_CON_HANDLE_INVALID;
+    }
+}
+
+// Ask for the longest link layer packets now or, if the controller is busy,
+// after the next command completes
+static void midi_service_stream_request_data_length(hci_con_handle_t con_handle)
+{
+    for (uint8_t idx = 0; idx < MAX_NR_HCI_CONNECTIONS; idx++) {
+        if (data_length_pending[idx] == HCI_CON_HANDLE_INVALID) {
+            data_length_pending[idx] = con_handle;
+            break;
+        }
+    }
+    midi_service_stream_send_pending_data_length();
+}
+
+static void midi_service_stream_cancel_data_length(hci_con_handle_t con_handle)
+{
+    for (uint8_t idx = 0; idx < MAX_NR_HCI_CONNECTIONS; idx++) {
+        if (data_length_pending[idx] == con_handle)
+            data_length_pending[idx] = HCI_CON_HANDLE_INVALID;
+    }
+}
+#endif
+
 static void hci_packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
     UNUSED(channel);
     UNUSED(size);
     uint16_t conn_interval;
     hci_con_handle_t con_handle;
+    midi_service_stream_connection_t* context;
 
     if (packet_type != HCI_EVENT_PACKET) return;
 
@@ -124,16 +304,32 @@ static void hci_packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *
         case HCI_EVENT_LE_META:
             switch (hci_event_le_meta_get_subevent_code(packet)) {
                 case HCI_SUBEVENT_LE_CONNECTION_COMPLETE:
+                    // the application sees every connection attempt, e.g. to end directed advertising
+                    client_packet_handler(packet_type, channel, packet, size);
+                    if (hci_subevent_le_connection_complete_get_status(packet) != ERROR_CODE_SUCCESS) break;
                     // print connection parameters (without using float operations)
                     con_handle    = hci_subevent_le_connection_complete_get_connection_handle(packet);
                     conn_interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
                     printf("LE Connection - Connection Interval: %u.%02u ms\n", conn_interval * 125 / 100, 25 * (conn_interval & 3));
                     printf("LE Connection - Connection Latency: %u\n", hci_subevent_le_connection_complete_get_conn_latency(packet));
 
-                    // request min con interval 15 ms for iOS per Apple accessory design guidelines, so we have to allow it:
-                    // https://developer.apple.com/accessories/Accessory-Design-Guidelines.pdf
-                    printf("LE Connection - Request 7.5ms-15ms connection interval\n");
-                    gap_request_connection_parameter_update(con_handle, 6, 12, 0, 0x0048);
+                    // The BLE-MIDI client picks the parameters of the links where this device
+                    // is the central; the data length and PHY below help both roles.
+                    if (hci_subevent_le_connection_complete_get_role(packet) == HCI_ROLE_SLAVE) {
+                        // request min con interval 15 ms for iOS per Apple accessory design guidelines, so we have to allow it:
+                        // https://developer.apple.com/accessories/Accessory-Design-Guidelines.pdf
+                        printf("LE Connection - Request 7.5ms-15ms connection interval\n");
+                        gap_request_connection_parameter_update(con_handle, MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MIN,
+                            MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MAX, MIDI_SERVICE_STREAM_ACTIVE_LATENCY, MIDI_SERVICE_STREAM_ACTIVE_TIMEOUT);
+                    }
+#ifdef ENABLE_LE_DATA_LENGTH_EXTENSION
+                    // ask for the longest link layer packets so a large notification does not have to be fragmented
+                    midi_service_stream_request_data_length(con_handle);
+#endif
+#ifdef BLE_MIDI_SERVER_REQUEST_2M_PHY
+                    // the controllers stay on the 1M PHY if the central does not support 2M
+                    gap_le_set_phy(con_handle, 0, MIDI_SERVICE_STREAM_LE_PHY_2M_BIT, MIDI_SERVICE_STREAM_LE_PHY_2M_BIT, 0);
+#endif
                     break;
                 case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
                     // print connection parameters (without using float operations)
@@ -142,31 +338,148 @@ static void hci_packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *
                     printf("LE Connection - Connection Param update - connection interval %u.%02u ms, latency %u\n", conn_interval * 125 / 100,
                         25 * (conn_interval & 3), hci_subevent_le_connection_update_complete_get_conn_latency(packet));
                     break;
+                case HCI_SUBEVENT_LE_DATA_LENGTH_CHANGE:
+                    con_handle = hci_subevent_le_data_length_change_get_connection_handle(packet);
+                    context = get_context_for_conn_handle(con_handle);
+                    if (!context) break;
+                    context->link.max_tx_octets = hci_subevent_le_data_length_change_get_max_tx_octets(packet);
+                    printf("%s: data length change - max %u bytes per link layer packet\n", context->name, context->link.max_tx_octets);
+                    break;
+                case HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE:
+                    con_handle = hci_subevent_le_phy_update_complete_get_connection_handle(packet);
+                    context = get_context_for_conn_handle(con_handle);
+                    if (!context || hci_subevent_le_phy_update_complete_get_status(packet) != ERROR_CODE_SUCCESS) break;
+                    context->link.tx_phy = hci_subevent_le_phy_update_complete_get_tx_phy(packet);
+                    printf("%s: PHY update - transmitting on LE %s PHY\n", context->name, context->link.tx_phy == 2 ? "2M" : "1M");
+                    break;
                 default:
                     client_packet_handler(packet_type, channel, packet, size);
                     break;
             }
             break;
+#ifdef ENABLE_LE_DATA_LENGTH_EXTENSION
+        case HCI_EVENT_COMMAND_COMPLETE:
+        case HCI_EVENT_COMMAND_STATUS:
+            // the controller can take another command
+            midi_service_stream_send_pending_data_length();
+            client_packet_handler(packet_type, channel, packet, size);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            midi_service_stream_cancel_data_length(hci_event_disconnection_complete_get_connection_handle(packet));
+            client_packet_handler(packet_type, channel, packet, size);
+            break;
+#endif
         default:
             client_packet_handler(packet_type, channel, packet, size);
             break;
     }
 }
 
-// Return the context that contains connection_handle ==  con_handle;
-// call with con_handle to HCI_CON_HANDLE_INVALID to find an available context
-static midi_service_stream_connection_t* get_context_for_conn_handle(hci_con_handle_t con_handle)
+// ble_midi_pkt_codec_message_cb_t that adds the connection handle and calls the application's callback
+static void midi_service_stream_deliver_message(const ble_midi_message_t* mes, void* cb_context)
+{
+    midi_service_stream_connection_t* context = (midi_service_stream_connection_t*)cb_context;
+    client_message_cb(context->connection_handle, mes);
+}
+
+// ble_midi_pkt_codec_sysex_cb_t that adds the connection handle and calls the application's callback
+static void midi_service_stream_deliver_sysex(const uint8_t* sysex, uint16_t nbytes, bool complete, void* cb_context)
 {
+    midi_service_stream_connection_t* context = (midi_service_stream_connection_t*)cb_context;
+    client_sysex_cb(context->connection_handle, sysex, nbytes, complete);
+}
+
+static void context_map_insert(uint8_t idx)
+{
+    uint8_t slot = midi_service_stream_connection[idx].connection_handle & (MIDI_SERVICE_STREAM_MAP_SIZE - 1);
+    while (context_map[slot] != 0)
+        slot = (slot + 1) & (MIDI_SERVICE_STREAM_MAP_SIZE - 1);
+    context_map[slot] = idx + 1;
+}
+
+// Rebuild the map from the connected contexts. Removing an entry from an open
+// addressed map would otherwise need the probe chains repaired; rebuilding
+// is simpler and only happens on disconnect.
+static void context_map_rebuild()
+{
+    memset(context_map, 0, sizeof(context_map));
     for (uint8_t idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
-        if (midi_service_stream_connection[idx].connection_handle == con_handle) {
+        if (midi_service_stream_connection[idx].connection_handle != HCI_CON_HANDLE_INVALID)
+            context_map_insert(idx);
+    }
+}
 
-            midi_service_stream_connection[idx].ble_midi_pkt_codec_data = ble_midi_pkt_codec_get_data_by_index(idx);
+// Return the context that contains connection_handle == con_handle, or NULL
+static midi_service_stream_connection_t* get_context_for_conn_handle(hci_con_handle_t con_handle)
+{
+    uint8_t slot = con_handle & (MIDI_SERVICE_STREAM_MAP_SIZE - 1);
+    while (context_map[slot] != 0) {
+        midi_service_stream_connection_t* context = midi_service_stream_connection + context_map[slot] - 1;
+        if (context->connection_handle == con_handle)
+            return context;
+        slot = (slot + 1) & (MIDI_SERVICE_STREAM_MAP_SIZE - 1);
+    }
+    return NULL;
+}
+
+// Return a context with no connection, or NULL if all are in use
+static midi_service_stream_connection_t* get_free_context()
+{
+    for (uint8_t idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        if (midi_service_stream_connection[idx].connection_handle == HCI_CON_HANDLE_INVALID)
             return midi_service_stream_connection + idx;
-        }
     }
     return NULL;
 }
 
+// Use a new ATT MTU for a connection's outgoing packets
+static void midi_service_stream_set_att_mtu(midi_service_stream_connection_t* context, uint16_t att_mtu)
+{
+    context->link.att_mtu = att_mtu;
+    // a notification carries the ATT MTU less the 3 byte ATT header
+    ble_midi_pkt_codec_update_mtu(context->ble_midi_pkt_codec_data, att_mtu - 3);
+    printf("%s: ATT MTU = %u => max MIDI packet len %u\n", context->name, att_mtu, ble_midi_pkt_codec_get_mtu(context->ble_midi_pkt_codec_data));
+}
+
+// gatt_client callback for the MTU exchange the server starts
+static void gatt_client_event_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+    UNUSED(channel);
+    UNUSED(size);
+    if (packet_type != HCI_EVENT_PACKET || hci_event_packet_get_type(packet) != GATT_EVENT_MTU) return;
+    midi_service_stream_connection_t* context = get_context_for_conn_handle(gatt_event_mtu_get_handle(packet));
+    if (!context) return;
+    midi_service_stream_set_att_mtu(context, gatt_event_mtu_get_MTU(packet));
+}
+
+// Bind a free context to a new connection
+static void midi_service_stream_connect(midi_service_stream_connection_t* context, hci_con_handle_t con_handle)
+{
+    context->connection_handle = con_handle;
+    context->link.att_mtu = ATT_DEFAULT_MTU;
+    context->link.max_tx_octets = MIDI_SERVICE_STREAM_LE_MIN_TX_OCTETS;
+    context->link.tx_phy = 1;
+    // the connection starts with the active parameters
+    context->traffic_npackets = 0;
+    context->nquiet_windows = 0;
+    context->conn_params_idle = false;
+    context_map_insert(context - midi_service_stream_connection);
+    midi_service_stream_start_traffic_timer();
+    // Many centrals never start an MTU exchange, which leaves notifications
+    // at 20 bytes, so offer the largest MTU from this side too
+    gatt_client_send_mtu_negotiation(gatt_client_event_handler, con_handle);
+}
+
+// Free a context when its connection goes away
+static void midi_service_stream_disconnect(midi_service_stream_connection_t* context)
+{
+    context->le_notification_enabled = 0;
+    context->connection_handle = HCI_CON_HANDLE_INVALID;
+    midi_service_stream_stop_coalesce_timer(context);
+    ble_midi_pkt_codec_release_data(context->ble_midi_pkt_codec_data);
+    context_map_rebuild();
+}
+
 /**
  * @brief This function handles packets from the Blueooth stack
  * 
@@ -190,16 +503,16 @@ static void midi_service_stream_packet_handler(uint8_t packet_type, uint16_t cha
                     context->le_notification_enabled = 1;
                     context->send_request.callback = midi_can_send;
                     context->send_request.context = context;
-                    ble_midi_pkt_codec_init_data(context->ble_midi_pkt_codec_data, att_server_get_mtu(con_handle));
+                    ble_midi_pkt_codec_init_data(context->ble_midi_pkt_codec_data, MAX_BLE_MIDI_PACKET);
+                    midi_service_stream_set_att_mtu(context, att_server_get_mtu(con_handle));
                     // also send this event up to the application so it can record the connection handle
                     client_packet_handler(packet_type, channel, packet, size);
                     break;
                 case GATTSERVICE_SUBEVENT_SPP_SERVICE_DISCONNECTED:
-                    con_handle = gattservice_subevent_spp_service_connected_get_con_handle(packet);
+                    con_handle = gattservice_subevent_spp_service_disconnected_get_con_handle(packet);
                     context = get_context_for_conn_handle(con_handle);
                     if (!context) break;
-                    context->le_notification_enabled = 0;
-                    context->connection_handle = HCI_CON_HANDLE_INVALID;
+                    midi_service_stream_disconnect(context);
                     client_packet_handler(packet_type, channel, packet, size);
                     break;
                 default:
@@ -211,6 +524,8 @@ static void midi_service_stream_packet_handler(uint8_t packet_type, uint16_t cha
             //printf("RECV: ");
             //printf_hexdump(packet, size);
             context = get_context_for_conn_handle((hci_con_handle_t) channel);
+            if (!context) break;
+            midi_service_stream_count_traffic(context, 1);
             uint16_t ndecoded = ble_midi_pkt_codec_ble_midi_decode_push(packet, size, context->ble_midi_pkt_codec_data);
             if (ndecoded != size) {
                 printf("Parse error decoding midi packet\r\n");
@@ -226,33 +541,31 @@ static void att_packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *
     UNUSED(channel);
     UNUSED(size);
 
-    int mtu;
     midi_service_stream_connection_t* context;
     switch (packet_type) {
         case HCI_EVENT_PACKET:
             switch (hci_event_packet_get_type(packet)) {
                 case ATT_EVENT_CONNECTED:
+                    // the ATT server also runs on the links to peripherals the BLE-MIDI client connected to
+                    if (gap_get_role(att_event_connected_get_handle(packet)) != HCI_ROLE_SLAVE) break;
                     // setup new 
-                    context = get_context_for_conn_handle(HCI_CON_HANDLE_INVALID);
+                    context = get_free_context();
                     if (!context) break;
                     // use the connection handle from this notification going forward
-                    context->connection_handle = att_event_connected_get_handle(packet);
+                    midi_service_stream_connect(context, att_event_connected_get_handle(packet));
                     printf("%s: ATT connected, handle 0x%04x\r\n", context->name, context->connection_handle);
                     break;
                 case ATT_EVENT_MTU_EXCHANGE_COMPLETE:
-                    mtu = att_event_mtu_exchange_complete_get_MTU(packet) - 3;
                     context = get_context_for_conn_handle(att_event_mtu_exchange_complete_get_handle(packet));
                     if (!context) break;
-                    ble_midi_pkt_codec_update_mtu(context->ble_midi_pkt_codec_data , mtu-3);
-                    printf("%s: ATT MTU = %u => max MIDI packet len %u\n", context->name, mtu, ble_midi_pkt_codec_get_mtu(context->ble_midi_pkt_codec_data));
+                    midi_service_stream_set_att_mtu(context, att_event_mtu_exchange_complete_get_MTU(packet));
                     break;
                 case ATT_EVENT_DISCONNECTED:
                     context = get_context_for_conn_handle(att_event_disconnected_get_handle(packet));
                     if (!context) break;
                     // free connection
                     printf("%s: ATT disconnected, handle 0x%04x\n", context->name, context->connection_handle);
-                    context->le_notification_enabled = 0;
-                    context->connection_handle = HCI_CON_HANDLE_INVALID;
+                    midi_service_stream_disconnect(context);
                     break;
                 default:
                     break;
@@ -270,10 +583,22 @@ void midi_service_stream_init(btstack_packet_handler_t packet_handler)
         context->ble_midi_pkt_codec_data = ble_midi_pkt_codec_get_data_by_index(idx);
         context->connection_handle = HCI_CON_HANDLE_INVALID;
         ble_midi_pkt_codec_init_data(context->ble_midi_pkt_codec_data, MAX_BLE_MIDI_PACKET);
+        btstack_run_loop_set_timer_handler(&context->coalesce_timer, midi_coalesce_timeout);
+        btstack_run_loop_set_timer_context(&context->coalesce_timer, context);
+        context->coalesce_timer_active = false;
         char name[] = "MIDI A";
         name[5] += idx;
         strcpy(context->name, name);
     }
+    context_map_rebuild();
+    btstack_run_loop_set_timer_handler(&traffic_timer, midi_traffic_timeout);
+    traffic_timer_active = false;
+#ifdef ENABLE_LE_DATA_LENGTH_EXTENSION
+    for (uint8_t idx = 0; idx < MAX_NR_HCI_CONNECTIONS; idx++)
+        data_length_pending[idx] = HCI_CON_HANDLE_INVALID;
+#endif
+    // gatt_client_send_mtu_negotiation() only starts an exchange with this off
+    gatt_client_mtu_enable_auto_negotiation(0);
     // register for HCI events
     hci_event_callback_registration.callback = &hci_packet_handler;
     hci_add_event_handler(&hci_event_callback_registration);
@@ -282,9 +607,73 @@ void midi_service_stream_init(btstack_packet_handler_t packet_handler)
     client_packet_handler = packet_handler;
 }
 
+void midi_service_stream_set_message_callback(midi_service_stream_message_cb_t message_cb)
+{
+    client_message_cb = message_cb;
+    for (uint8_t idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        midi_service_stream_connection_t* context = midi_service_stream_connection+idx;
+        ble_midi_pkt_codec_set_message_callback(context->ble_midi_pkt_codec_data,
+            message_cb ? midi_service_stream_deliver_message : NULL, context);
+    }
+}
+
+void midi_service_stream_set_sysex_callback(midi_service_stream_sysex_cb_t sysex_cb)
+{
+    client_sysex_cb = sysex_cb;
+    for (uint8_t idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        midi_service_stream_connection_t* context = midi_service_stream_connection+idx;
+        ble_midi_pkt_codec_set_sysex_callback(context->ble_midi_pkt_codec_data,
+            sysex_cb ? midi_service_stream_deliver_sysex : NULL, context);
+    }
+}
+
+void midi_service_stream_set_coalesce_window(uint32_t window_us)
+{
+    for (uint8_t idx = 0; idx < BLE_MIDI_SERVER_MAX_CONNECTIONS; idx++) {
+        ble_midi_pkt_codec_set_coalesce_window(midi_service_stream_connection[idx].ble_midi_pkt_codec_data, window_us);
+    }
+}
+
+bool midi_service_stream_get_link(hci_con_handle_t con_handle, midi_service_stream_link_t* link)
+{
+    midi_service_stream_connection_t* context = get_context_for_conn_handle(con_handle);
+    if (!context)
+        return false;
+    *link = context->link;
+    return true;
+}
+
+int midi_service_stream_get_connection_index(hci_con_handle_t con_handle)
+{
+    midi_service_stream_connection_t* context = get_context_for_conn_handle(con_handle);
+    return context ? (int)(context - midi_service_stream_connection) : -1;
+}
+
+uint16_t midi_service_stream_get_pool_blocks_held(hci_con_handle_t con_handle)
+{
+    midi_service_stream_connection_t* context = get_context_for_conn_handle(con_handle);
+    return context ? ble_midi_pkt_codec_get_pool_blocks_held(context->ble_midi_pkt_codec_data) : 0;
+}
+
+uint64_t midi_service_stream_get_local_time_us(hci_con_handle_t con_handle, uint16_t timestamp_ms)
+{
+    midi_service_stream_connection_t* context = get_context_for_conn_handle(con_handle);
+    return context ? ble_midi_pkt_codec_get_local_time_us(context->ble_midi_pkt_codec_data, timestamp_ms) : time_us_64();
+}
+
+int32_t midi_service_stream_get_clock_drift_ppm(hci_con_handle_t con_handle)
+{
+    midi_service_stream_connection_t* context = get_context_for_conn_handle(con_handle);
+    return context ? ble_midi_clock_sync_get_drift_ppm(ble_midi_pkt_codec_get_clock_sync(context->ble_midi_pkt_codec_data)) : 0;
+}
+
 void midi_service_stream_deinit()
 {
     hci_remove_event_handler(&hci_event_callback_registration);
+    if (traffic_timer_active) {
+        btstack_run_loop_remove_timer(&traffic_timer);
+        traffic_timer_active = false;
+    }
 }
 
 uint8_t midi_service_stream_write(hci_con_handle_t con_handle, uint8_t nbytes, const uint8_t* midi_stream_bytes)
@@ -301,6 +690,12 @@ uint8_t midi_service_stream_write(hci_con_handle_t con_handle, uint8_t nbytes, c
     return npushed;
 }
 
+int midi_service_stream_get_write_cost(hci_con_handle_t con_handle, uint8_t nbytes)
+{
+    midi_service_stream_connection_t* context = get_context_for_conn_handle(con_handle);
+    return context ? ble_midi_pkt_codec_get_push_midi_cost(context->ble_midi_pkt_codec_data, nbytes) : -1;
+}
+
 uint8_t midi_service_stream_read(hci_con_handle_t con_handle, uint8_t max_bytes, uint8_t* midi_stream_bytes, uint16_t* timestamp)
 {
     midi_service_stream_connection_t* context = get_context_for_conn_handle(con_handle);
@@ -320,3 +715,20 @@ uint8_t midi_service_stream_read(hci_con_handle_t con_handle, uint8_t max_bytes,
 
     return nread;
 }
+
+uint16_t midi_service_stream_read_batch(hci_con_handle_t* con_handle, ble_midi_message_t* mes, uint16_t max_mes)
+{
+    for (uint8_t count = 0; count < BLE_MIDI_SERVER_MAX_CONNECTIONS; count++) {
+        midi_service_stream_connection_t* context = midi_service_stream_connection + next_read_batch_idx;
+        if (++next_read_batch_idx >= BLE_MIDI_SERVER_MAX_CONNECTIONS)
+            next_read_batch_idx = 0;
+        if (context->connection_handle == HCI_CON_HANDLE_INVALID)
+            continue;
+        uint16_t nmes = ble_midi_pkt_codec_pop_midi_batch(mes, max_mes, context->ble_midi_pkt_codec_data);
+        if (nmes > 0) {
+            *con_handle = context->connection_handle;
+            return nmes;
+        }
+    }
+    return 0;
+}
@@ -24,12 +24,112 @@
  */
 #pragma once
 #include "midi_service_server.h"
+#include "ble_midi_pkt_codec.h"
+
+// The most notifications one connection sends per can send now callback.
+// By default, as many as the controller has ACL buffers for.
+#ifndef MIDI_SERVICE_STREAM_MAX_BURST
+#ifdef MAX_NR_CONTROLLER_ACL_BUFFERS
+#define MIDI_SERVICE_STREAM_MAX_BURST MAX_NR_CONTROLLER_ACL_BUFFERS
+#else
+#define MIDI_SERVICE_STREAM_MAX_BURST 1
+#endif
+#endif
+
+// The ACL buffers a burst leaves free, e.g. 1 so the links of a BLE-MIDI
+// client running next to the server never wait for the server's notifications
+#ifndef MIDI_SERVICE_STREAM_ACL_RESERVE
+#define MIDI_SERVICE_STREAM_ACL_RESERVE 0
+#endif
+
+// Connection parameters requested while MIDI is flowing: 7.5-15 ms interval,
+// no peripheral latency and a 720 ms supervision timeout (units of 1.25 ms,
+// connection events and 10 ms)
+#ifndef MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MIN
+#define MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MIN 6
+#endif
+#ifndef MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MAX
+#define MIDI_SERVICE_STREAM_ACTIVE_INTERVAL_MAX 12
+#endif
+#ifndef MIDI_SERVICE_STREAM_ACTIVE_LATENCY
+#define MIDI_SERVICE_STREAM_ACTIVE_LATENCY 0
+#endif
+#ifndef MIDI_SERVICE_STREAM_ACTIVE_TIMEOUT
+#define MIDI_SERVICE_STREAM_ACTIVE_TIMEOUT 0x0048
+#endif
+
+// Connection parameters requested when a connection goes quiet: 30-45 ms
+// interval and 2 events of peripheral latency, so the first message after a
+// quiet spell may wait up to 135 ms. The 2 s supervision timeout is within
+// Apple's accessory guidelines.
+#ifndef MIDI_SERVICE_STREAM_IDLE_INTERVAL_MIN
+#define MIDI_SERVICE_STREAM_IDLE_INTERVAL_MIN 24
+#endif
+#ifndef MIDI_SERVICE_STREAM_IDLE_INTERVAL_MAX
+#define MIDI_SERVICE_STREAM_IDLE_INTERVAL_MAX 36
+#endif
+#ifndef MIDI_SERVICE_STREAM_IDLE_LATENCY
+#define MIDI_SERVICE_STREAM_IDLE_LATENCY 2
+#endif
+#ifndef MIDI_SERVICE_STREAM_IDLE_TIMEOUT
+#define MIDI_SERVICE_STREAM_IDLE_TIMEOUT 200
+#endif
+// Define MIDI_SERVICE_STREAM_DEBUG_CONN_PARAMS to print each switch between
+// the active and idle connection parameters
+
+// Each connection counts the packets it sends and receives per window
+#ifndef MIDI_SERVICE_STREAM_TRAFFIC_WINDOW_MS
+#define MIDI_SERVICE_STREAM_TRAFFIC_WINDOW_MS 500
+#endif
+
+// A window with no more packets than this is quiet, e.g. 2 to ignore active
+// sensing. A connection switches to the active parameters as soon as the
+// count goes above it.
+#ifndef MIDI_SERVICE_STREAM_QUIET_MAX_PACKETS
+#define MIDI_SERVICE_STREAM_QUIET_MAX_PACKETS 0
+#endif
+
+// A connection switches to the idle parameters after this long with only quiet windows
+#ifndef MIDI_SERVICE_STREAM_IDLE_AFTER_MS
+#define MIDI_SERVICE_STREAM_IDLE_AFTER_MS 10000
+#endif
+
 #ifdef __cplusplus
     extern "C" {
 #endif
+// The parameters negotiated for a connection
+typedef struct midi_service_stream_link_s {
+    uint16_t att_mtu;           // ATT MTU; notifications carry up to att_mtu - 3 bytes
+    uint16_t max_tx_octets;     // link layer payload bytes; 27 unless the data length was extended
+    uint8_t tx_phy;             // 1 for the LE 1M PHY, 2 for the LE 2M PHY
+} midi_service_stream_link_t;
+
+/**
+ * @brief the function called for each MIDI message decoded from a BLE-MIDI packet
+ * when a message callback is registered with midi_service_stream_set_message_callback()
+ *
+ * @param con_handle the HCI connection handle for the connection that sent the message
+ * @param mes the decoded message; it is only valid for the duration of the call
+ */
+typedef void (*midi_service_stream_message_cb_t)(hci_con_handle_t con_handle, const ble_midi_message_t* mes);
+
+/**
+ * @brief the function called for each run of system exclusive bytes decoded from
+ * a BLE-MIDI packet when a sysex callback is registered with
+ * midi_service_stream_set_sysex_callback()
+ *
+ * @param con_handle the HCI connection handle for the connection that sent the bytes
+ * @param sysex the system exclusive bytes; only valid for the duration of the call
+ * @param nbytes the number of bytes in sysex
+ * @param complete true if sysex is the 0xF7 that ends the message
+ */
+typedef void (*midi_service_stream_sysex_cb_t)(hci_con_handle_t con_handle, const uint8_t* sysex, uint16_t nbytes, bool complete);
+
 /**
  * @brief initialize the MIDI service and MIDI parser/packet handlers
- * 
+ *
+ * Call after gatt_client_init(). This turns off the GATT client's automatic
+ * MTU negotiation so the service can offer the MTU itself.
  */
 void midi_service_stream_init(btstack_packet_handler_t packet_handler);
 
@@ -51,6 +151,16 @@ void midi_service_stream_deinit();
  */
 uint8_t midi_service_stream_write(hci_con_handle_t con_handle, uint8_t nbytes, const uint8_t* midi_stream_bytes);
 
+/**
+ * @brief get the number of unreserved pool blocks midi_service_stream_write() may borrow
+ *
+ * @param con_handle the connection to write to
+ * @param nbytes the number of bytes in the MIDI byte stream
+ * @return the number of blocks, or -1 if the connection is not valid or its
+ * queue cannot hold the stream
+ */
+int midi_service_stream_get_write_cost(hci_con_handle_t con_handle, uint8_t nbytes);
+
 /**
  * @brief read a MIDI 1.0 byte stream for a single timestamp up to max_bytes long
  *
@@ -69,6 +179,107 @@ uint8_t midi_service_stream_write(hci_con_handle_t con_handle, uint8_t nbytes, c
  * zero if there are no more bytes to read
  */
 uint8_t midi_service_stream_read(hci_con_handle_t con_handle, uint8_t max_bytes, uint8_t* midi_stream_bytes, uint16_t* timestamp);
+
+/**
+ * @brief read all of the buffered timestamped MIDI messages from one connection
+ *
+ * Each call serves the next connection with buffered messages, round-robin,
+ * and pops up to max_mes of its messages in one ring buffer operation. The
+ * messages keep the ble_midi_message_t flags, so running status is already
+ * expanded and system exclusive fragments are marked. Call this function in
+ * a loop until it returns 0 to drain every connection.
+ *
+ * @param con_handle a pointer to storage for the HCI connection handle of the
+ * connection that sent the messages
+ * @param mes a pointer to storage for an array of at least max_mes messages
+ * @param max_mes the maximum number of messages to read
+ * @return uint16_t the number of messages stored in mes, or zero if no
+ * connection has messages to read
+ */
+uint16_t midi_service_stream_read_batch(hci_con_handle_t* con_handle, ble_midi_message_t* mes, uint16_t max_mes);
+
+/**
+ * @brief deliver decoded MIDI messages directly to a callback instead of buffering them
+ *
+ * The callback is called from the BTstack context while the received packet
+ * is decoded, so messages skip the receive ring buffer and the copy made by
+ * midi_service_stream_read(). midi_service_stream_read() returns nothing while
+ * a callback is registered.
+ *
+ * @param message_cb the callback function, or NULL to buffer messages for midi_service_stream_read()
+ */
+void midi_service_stream_set_message_callback(midi_service_stream_message_cb_t message_cb);
+
+/**
+ * @brief pass system exclusive bytes to a callback instead of decoding them to 3-byte fragments
+ *
+ * See ble_midi_pkt_codec_set_sysex_callback(). The callback is called from the BTstack context.
+ *
+ * @param sysex_cb the callback function, or NULL to decode system exclusive messages to fragments
+ */
+void midi_service_stream_set_sysex_callback(midi_service_stream_sysex_cb_t sysex_cb);
+
+/**
+ * @brief collect the MIDI written within a time window into one notification
+ *
+ * See ble_midi_pkt_codec_set_coalesce_window(). The open packet is sent from
+ * the can send now callback once the window has elapsed, or sooner if it fills.
+ *
+ * @param window_us the window in microseconds, or 0 to send a packet for every write
+ */
+void midi_service_stream_set_coalesce_window(uint32_t window_us);
+
+/**
+ * @brief get the ATT MTU, data length and PHY negotiated for a connection
+ *
+ * After connecting, the server offers a large ATT MTU, asks for the longest
+ * link layer packets if ENABLE_LE_DATA_LENGTH_EXTENSION is defined and asks
+ * for the LE 2M PHY if BLE_MIDI_SERVER_REQUEST_2M_PHY is defined. Outgoing
+ * packets are sized to the negotiated ATT MTU.
+ *
+ * @param con_handle the HCI connection handle
+ * @param link a pointer to storage for the parameters
+ * @return true if con_handle is connected and link was filled in
+ */
+bool midi_service_stream_get_link(hci_con_handle_t con_handle, midi_service_stream_link_t* link);
+
+/**
+ * @brief get the index of the context that serves a connection
+ *
+ * Indices are stable for the life of the connection, so they can tag the
+ * messages from each connected device. They are reused after a disconnection.
+ *
+ * @param con_handle the HCI connection handle
+ * @return the index, from 0 to BLE_MIDI_SERVER_MAX_CONNECTIONS - 1, or -1
+ * if con_handle is not connected
+ */
+int midi_service_stream_get_connection_index(hci_con_handle_t con_handle);
+
+/**
+ * @brief get the number of shared pool blocks a connection's queues hold
+ *
+ * @param con_handle the HCI connection handle
+ * @return the number of blocks, or 0 if con_handle is not connected
+ */
+uint16_t midi_service_stream_get_pool_blocks_held(hci_con_handle_t con_handle);
+
+/**
+ * @brief map the timestamp of a message received on a connection to local time
+ *
+ * @param con_handle the HCI connection handle the message came from
+ * @param timestamp_ms the message's timestamp_ms
+ * @return the local time in microseconds on the time_us_64() clock, or
+ * time_us_64() if con_handle is not connected
+ */
+uint64_t midi_service_stream_get_local_time_us(hci_con_handle_t con_handle, uint16_t timestamp_ms);
+
+/**
+ * @brief get the estimated drift of a connected device's clock
+ *
+ * @param con_handle the HCI connection handle
+ * @return the drift in parts per million; positive if the device's clock is slow
+ */
+int32_t midi_service_stream_get_clock_drift_ppm(hci_con_handle_t con_handle);
 #ifdef __cplusplus
 }
 #endif